@@ -0,0 +1,51 @@
+#include "runner.hpp"
+#include "cgroup.hpp"
+
+namespace bench {
+
+    /**
+     * machine.slice as built by libvirt on a v2 host : one scope per VM with its libvirt sub-cgroups,
+     * next to a podman slice whose containers must not be descended into
+     */
+    static std::string generateTree(TempDir* dir, int vms) {
+        std::string slice = "machine" + std::to_string(vms) + ".slice";
+        dir->makeDir(slice);
+        for(int vm = 0; vm < vms; vm++){
+            std::string scope = slice + "/machine-qemu\\x2d" + std::to_string(vm + 1) + "\\x2dvm\\x2d" + std::to_string(vm) + ".scope";
+            dir->makeDir(scope);
+            dir->makeDir(scope + "/libvirt");
+            for(const char* leaf : {"vcpu0", "vcpu1", "emulator"}){
+                dir->makeDir(scope + "/libvirt/" + leaf);
+                dir->writeFile(scope + "/libvirt/" + leaf + "/cgroup.procs", std::to_string(10000 + vm) + "\n");
+            }
+        }
+        dir->makeDir(slice + "/machine-libpod_pod_bench.slice");
+        for(int container = 0; container < 16; container++)
+            dir->makeDir(slice + "/machine-libpod_pod_bench.slice/libpod-" + std::to_string(container) + ".scope");
+        return dir->path() + "/" + slice + "/";
+    }
+
+    void benchCgroup(BenchRunner* runner) {
+        if(!runner->enabled("cgroup/"))
+            return;
+        TempDir dir;
+        for(int vms : {10, 100, 1000}){
+            std::string suffix = "/vms:" + std::to_string(vms);
+            std::string base = generateTree(&dir, vms);
+            // Construction walks the whole tree and sets the inotify watches, as at start or after a queue overflow
+            runner->run("cgroup/scan" + suffix, [&](uint64_t iterations){
+                for(uint64_t i = 0; i < iterations; i++){
+                    server::CgroupClient client(base, 2);
+                    keep(client.getVersion());
+                }
+            });
+            server::CgroupClient client(base, 2);
+            if(BenchResult* result = runner->run("cgroup/retrieve" + suffix, [&](uint64_t iterations){
+                for(uint64_t i = 0; i < iterations; i++)
+                    keep(client.retrieveCgroupsVM().size());
+            }))
+                result->counters["vms"] = client.retrieveCgroupsVM().size();
+        }
+    }
+
+}
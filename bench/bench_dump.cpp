@@ -0,0 +1,64 @@
+#include "runner.hpp"
+#include "dump.hpp"
+
+// Series per VM, about what perf (4 events), procfs and libvirt register together
+#define BENCH_VM_SERIES 40
+
+namespace bench {
+
+    static void registerVMs(server::Dump* dump, int vms, std::vector<server::MetricId>* ids) {
+        for(int vm = 0; vm < vms; vm++)
+            for(int key = 0; key < BENCH_VM_SERIES; key++)
+                ids->push_back(dump->registerSpecificMetric("vm-" + std::to_string(vm), "key_" + std::to_string(key),
+                    key % 2 ? server::COUNTER : server::GAUGE, "Synthetic series"));
+    }
+
+    static void setAll(server::Dump* dump, const std::vector<server::MetricId>& ids, unsigned long long cycle) {
+        for(size_t i = 0; i < ids.size(); i++){
+            if(i % 4 == 0)
+                dump->set(ids[i], (double) (cycle + i) / 7);
+            else
+                dump->set(ids[i], cycle * 1000 + i);
+        }
+    }
+
+    void benchDump(BenchRunner* runner) {
+        for(int vms : {10, 100, 1000}){
+            std::string suffix = "/vms:" + std::to_string(vms);
+            if(BenchResult* result = runner->run("dump/register" + suffix, [&](uint64_t iterations){
+                for(uint64_t i = 0; i < iterations; i++){
+                    server::Dump dump("bench", "", false, false, false);
+                    std::vector<server::MetricId> ids;
+                    registerVMs(&dump, vms, &ids);
+                    keep(ids.back());
+                }
+            }))
+                result->counters["series"] = vms * BENCH_VM_SERIES;
+
+            for(bool labels : {false, true}){
+                server::Dump dump("bench", "", false, labels, false);
+                std::vector<server::MetricId> ids;
+                registerVMs(&dump, vms, &ids);
+                std::string mode = labels ? "_labels" : "";
+                unsigned long long cycle = 0;
+                if(!labels)
+                    if(BenchResult* result = runner->run("dump/insert" + suffix, [&](uint64_t iterations){
+                        for(uint64_t i = 0; i < iterations; i++){
+                            dump.clear();
+                            setAll(&dump, ids, cycle++);
+                        }
+                    }))
+                        result->counters["series"] = ids.size();
+                setAll(&dump, ids, cycle);
+                if(BenchResult* result = runner->run("dump/render" + mode + suffix, [&](uint64_t iterations){
+                    for(uint64_t i = 0; i < iterations; i++)
+                        dump.dump();
+                })){
+                    result->counters["series"] = ids.size();
+                    result->counters["bytes"] = dump.getBuffer().size();
+                }
+            }
+        }
+    }
+
+}
@@ -0,0 +1,64 @@
+#include "runner.hpp"
+#include "perfcli.hpp"
+#include "utils/config.hpp"
+
+namespace server {
+
+    /**
+     * Read path of perf counters opened on the benchmark process itself, with software events so that no PMU is needed
+     */
+    class PerfBench {
+
+        public:
+
+        static void run(bench::BenchRunner* runner, bool perThread, bool grouped, const std::list<std::string>& events) {
+            std::string name = "perf/read_specific/" + std::string(perThread ? "thread" : "cpus") + "/events:" + std::to_string(events.size())
+                + (grouped ? "/grouped" : "");
+            if(!runner->enabled(name))
+                return;
+            utils::Config::Get().perfEventHardware.clear();
+            utils::Config::Get().perfEventHardwareCache.clear();
+            utils::Config::Get().perfEventTracepoint.clear();
+            utils::Config::Get().perfEventSoftware = events;
+            utils::Config::Get().perfGroup = grouped;
+            utils::Config::Get().perfMonotonic = false;
+            PerfClient client;
+            client.perfLoadEvents();
+            PerfCounters counters;
+            client.perfSetCounters(&counters, 0, 0, perThread); // pid 0 is the calling thread
+            size_t fds = 0;
+            for(const auto& cpu : counters)
+                for(const auto& group : cpu)
+                    fds += group.fds.size();
+            if(fds == 0){
+                runner->skip(name, "perf_event_open denied (see /proc/sys/kernel/perf_event_paranoid)");
+                return;
+            }
+            client.perfEnableSpecific(&counters);
+            Dump dump("bench", "", false, false, false);
+            if(bench::BenchResult* result = runner->run(name, [&](uint64_t iterations){
+                for(uint64_t i = 0; i < iterations; i++)
+                    client.perfReadSpecific("", &counters, &dump);
+            })){
+                result->counters["fds"] = fds;
+                result->counters["cpus"] = counters.size();
+            }
+            client.perfCloseSpecific(&counters);
+        }
+    };
+
+}
+
+namespace bench {
+
+    void benchPerf(BenchRunner* runner) {
+        std::list<std::string> taskClock = {"PERF_COUNT_SW_TASK_CLOCK"};
+        std::list<std::string> software = {"PERF_COUNT_SW_TASK_CLOCK", "PERF_COUNT_SW_CONTEXT_SWITCHES", "PERF_COUNT_SW_PAGE_FAULTS",
+            "PERF_COUNT_SW_CPU_MIGRATIONS"};
+        server::PerfBench::run(runner, true, false, taskClock);
+        server::PerfBench::run(runner, false, false, taskClock);
+        server::PerfBench::run(runner, false, false, software);
+        server::PerfBench::run(runner, false, true, software);
+    }
+
+}
@@ -0,0 +1,97 @@
+#include "runner.hpp"
+#include <string.h>
+#include "perfcli.hpp"
+#include "utils/procfs.hpp"
+
+#define BENCH_BUFFER_SIZE 16384 // PROCFS_BUFFER_SIZE of perfcli.cpp
+
+namespace bench {
+
+    // Captured on a KVM host : /proc/[pid]/stat of a vCPU thread (comm with spaces and a slash) and its schedstat
+    static const char* const statSample = "2183004 (CPU 0/KVM) S 1 2182962 2182962 0 -1 138412096 5911 0 3 0 1836942 411305 0 0 20 0 37 0 "
+        "391783925 9073324032 1055017 18446744073709551615 94245474721792 94245481044213 140727300437376 0 0 0 268444224 4096 25155 0 0 0 -1 "
+        "12 0 0 0 0 0 94245483327280 94245493114856 94245515665408 140727300440641 140727300440766 140727300440766 140727300444123 0\n";
+    static const char* const schedstatSample = "22484123459782 813712406512 96712331\n";
+    // Header and first cpu of /proc/schedstat (version 15), replicated for a larger host
+    static const char* const nodeSchedstatHeader = "version 15\ntimestamp 4365894286\n";
+    static const char* const nodeSchedstatCpu = "cpu%d 0 0 0 0 0 0 1570393542887 167404447290 8123954\n"
+        "domain0 00000000,00000000,00000000,00000003 2191218 2180474 9412 10764536 1410 7 0 2180474 11287 11003 219 1236049 60 0 0 11003 "
+        "40427 36991 3263 2862106 275 2 0 36991 0 0 0 0 0 0 0 0 0 5139 126 0\n"
+        "domain1 00000000,00000000,ffffffff,ffffffff 461201 452207 8171 11432915 969 53 0 452207 7017 6479 452 1024618 94 1 0 6479 "
+        "17652 13981 3475 3327702 234 3 0 13981 0 0 0 0 0 0 0 0 0 4217 3 0\n";
+    static const char* const meminfoSample = "MemTotal:       527895484 kB\nMemFree:        123914308 kB\nMemAvailable:   389912676 kB\n"
+        "Buffers:          1853824 kB\nCached:         254812508 kB\nSwapCached:            0 kB\nActive:          88341060 kB\n"
+        "Inactive:       301014680 kB\nActive(anon):    62817132 kB\nInactive(anon):  71403728 kB\nActive(file):    25523928 kB\n"
+        "Inactive(file): 229610952 kB\nUnevictable:       41232 kB\nMlocked:           41232 kB\nSwapTotal:              0 kB\n"
+        "SwapFree:               0 kB\nDirty:               924 kB\nWriteback:             0 kB\nAnonPages:      133960412 kB\n"
+        "Mapped:           1421580 kB\nShmem:             279392 kB\nKReclaimable:    11931340 kB\nSlab:           14812124 kB\n"
+        "SReclaimable:    11931340 kB\nSUnreclaim:       2880784 kB\nKernelStack:       113424 kB\nPageTables:        391448 kB\n"
+        "CommitLimit:    263947740 kB\nCommitted_AS:   173617796 kB\nVmallocTotal:   34359738367 kB\nVmallocUsed:      687180 kB\n"
+        "HugePages_Total:       0\nHugePages_Free:        0\nHugepagesize:       2048 kB\nDirectMap4k:     12380364 kB\n"
+        "DirectMap2M:    361095168 kB\nDirectMap1G:    164626432 kB\n";
+
+    void benchProcfs(BenchRunner* runner) {
+        if(!runner->enabled("procfs/"))
+            return;
+        server::PerfClient client;
+        if(BenchResult* result = runner->run("procfs/stat_line", [&](uint64_t iterations){
+            unsigned long minflt = 0, cminflt = 0, majflt = 0, cmajflt = 0, vsize = 0, rss = 0, rsslim = 0;
+            const char* end = statSample + strlen(statSample);
+            for(uint64_t i = 0; i < iterations; i++)
+                client.readStatLine(statSample, end, &minflt, &cminflt, &majflt, &cmajflt, &vsize, &rss, &rsslim);
+            keep(minflt + rss);
+        }))
+            result->counters["bytes"] = strlen(statSample);
+
+        runner->run("procfs/schedstat_line", [&](uint64_t iterations){
+            unsigned long long runtime = 0, waittime = 0, timeslices = 0;
+            const char* end = schedstatSample + strlen(schedstatSample);
+            for(uint64_t i = 0; i < iterations; i++)
+                client.readSchedStatLine(schedstatSample, end, &runtime, &waittime, &timeslices);
+            keep(runtime + timeslices);
+        });
+
+        // Whole files read from disk line by line as the collectors do, a tmpfs file stands for procfs
+        TempDir dir;
+        for(int cpus : {8, 64, 256}){
+            std::string content = nodeSchedstatHeader;
+            char cpu[2048];
+            for(int c = 0; c < cpus; c++){
+                snprintf(cpu, sizeof(cpu), nodeSchedstatCpu, c);
+                content += cpu;
+            }
+            std::string name = "schedstat" + std::to_string(cpus);
+            dir.writeFile(name, content);
+            utils::ProcFile file;
+            file.open((dir.path() + "/" + name).c_str());
+            if(BenchResult* result = runner->run("procfs/node_schedstat/cpus:" + std::to_string(cpus), [&](uint64_t iterations){
+                char buffer[BENCH_BUFFER_SIZE];
+                unsigned long long runtime = 0, waittime = 0, timeslices = 0;
+                for(uint64_t i = 0; i < iterations; i++)
+                    file.forEachLine(buffer, sizeof(buffer), [&](const char* line, const char* end){
+                        if (end - line > 3 && strncmp(line, "cpu", 3) == 0)
+                            client.readSchedStatLine(line, end, &runtime, &waittime, &timeslices);
+                    });
+                keep(runtime);
+            }))
+                result->counters["bytes"] = content.size();
+        }
+
+        dir.writeFile("meminfo", meminfoSample);
+        utils::ProcFile meminfo;
+        meminfo.open((dir.path() + "/meminfo").c_str());
+        if(BenchResult* result = runner->run("procfs/meminfo_lines", [&](uint64_t iterations){
+            char buffer[BENCH_BUFFER_SIZE];
+            unsigned long long sum = 0;
+            for(uint64_t i = 0; i < iterations; i++)
+                meminfo.forEachLine(buffer, sizeof(buffer), [&](const char* line, const char* end){
+                    unsigned long long value;
+                    if(utils::scanU64(line, end, &value) != end)
+                        sum += value;
+                });
+            keep(sum);
+        }))
+            result->counters["bytes"] = strlen(meminfoSample);
+    }
+
+}
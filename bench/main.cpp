@@ -0,0 +1,67 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <chrono>
+#include <unistd.h>
+#include <sys/utsname.h>
+#include "runner.hpp"
+
+static int usage() {
+    std::cerr << "usage: vmprobe_bench [--filter regex] [--repetitions n] [--min-time ms] [--iterations n] [--label key=value] [--out file]" << std::endl;
+    return 1;
+}
+
+/**
+ * JSON results are written to stdout (or --out), the probe logs are sent to stderr
+ */
+int main(int argc, char** argv) {
+    std::string filter = ".*", output;
+    int repetitions = 5;
+    double minTime = 100;
+    uint64_t iterations = 0;
+    std::map<std::string, std::string> context;
+    for(int i = 1; i < argc; i++){
+        std::string arg = argv[i];
+        if(i + 1 >= argc)
+            return usage();
+        std::string value = argv[++i];
+        if(arg == "--filter")
+            filter = value;
+        else if(arg == "--repetitions")
+            repetitions = std::stoi(value);
+        else if(arg == "--min-time")
+            minTime = std::stod(value);
+        else if(arg == "--iterations")
+            iterations = std::stoull(value);
+        else if(arg == "--label" && value.find('=') != std::string::npos)
+            context[value.substr(0, value.find('='))] = value.substr(value.find('=') + 1);
+        else if(arg == "--out")
+            output = value;
+        else
+            return usage();
+    }
+    std::streambuf* stdoutBuffer = std::cout.rdbuf(std::cerr.rdbuf());
+
+    utsname host;
+    uname(&host);
+    context["host"] = host.nodename;
+    context["kernel"] = host.release;
+    context["cpus"] = std::to_string(sysconf(_SC_NPROCESSORS_ONLN));
+    context["date"] = std::to_string(std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count());
+    context["repetitions"] = std::to_string(repetitions);
+
+    bench::BenchRunner runner(filter, repetitions, minTime, iterations);
+    bench::benchDump(&runner);
+    bench::benchProcfs(&runner);
+    bench::benchCgroup(&runner);
+    bench::benchPerf(&runner);
+
+    std::cout.rdbuf(stdoutBuffer);
+    if(output.empty())
+        runner.writeJson(std::cout, context);
+    else{
+        std::ofstream file(output);
+        runner.writeJson(file, context);
+    }
+    return 0;
+}
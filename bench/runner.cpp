@@ -0,0 +1,99 @@
+#include "runner.hpp"
+#include <chrono>
+#include <algorithm>
+#include <iostream>
+
+namespace bench {
+
+    BenchRunner::BenchRunner(const std::string& filter, int repetitions, double minTime, uint64_t iterations) : _filter(filter),
+        _repetitions(std::max(1, repetitions)), _minTime(minTime), _iterations(iterations) {}
+
+    bool BenchRunner::enabled(const std::string& name) {
+        return std::regex_search(name, _filter);
+    }
+
+    static double elapsedNs(const std::function<void(uint64_t)>& body, uint64_t iterations) {
+        auto begin = std::chrono::steady_clock::now();
+        body(iterations);
+        auto end = std::chrono::steady_clock::now();
+        return std::chrono::duration<double, std::nano>(end - begin).count();
+    }
+
+    BenchResult* BenchRunner::run(const std::string& name, const std::function<void(uint64_t)>& body) {
+        if(!enabled(name))
+            return nullptr;
+        uint64_t iterations = _iterations;
+        if(iterations == 0){
+            // Warm up caches and lazy registrations, then double the count until a run is long enough
+            iterations = 1;
+            while(elapsedNs(body, iterations) < _minTime * 1e6 && iterations < (1ULL << 40))
+                iterations *= 2;
+        }
+        else
+            body(iterations);
+        BenchResult result;
+        result.name = name;
+        result.iterations = iterations;
+        for(int r = 0; r < _repetitions; r++)
+            result.samples.push_back(elapsedNs(body, iterations) / iterations);
+        std::vector<double> sorted = result.samples;
+        std::sort(sorted.begin(), sorted.end());
+        std::cerr << name << " " << sorted[sorted.size() / 2] << " ns/op" << std::endl;
+        _results.push_back(result);
+        return &_results.back();
+    }
+
+    void BenchRunner::skip(const std::string& name, const std::string& reason) {
+        if(!enabled(name))
+            return;
+        std::cerr << name << " skipped: " << reason << std::endl;
+        BenchResult result;
+        result.name = name;
+        result.iterations = 0;
+        result.skipped = reason;
+        _results.push_back(result);
+    }
+
+    static std::string quote(const std::string& text) {
+        std::string quoted = "\"";
+        for(char c : text){
+            if(c == '"' || c == '\\')
+                quoted.push_back('\\');
+            if((unsigned char) c < 0x20)
+                continue;
+            quoted.push_back(c);
+        }
+        return quoted + "\"";
+    }
+
+    void BenchRunner::writeJson(std::ostream& out, const std::map<std::string, std::string>& context) {
+        out.precision(6);
+        out << std::fixed;
+        out << "{\n  \"context\": {";
+        const char* separator = "";
+        for(const auto& entry : context){
+            out << separator << "\n    " << quote(entry.first) << ": " << quote(entry.second);
+            separator = ",";
+        }
+        out << "\n  },\n  \"benchmarks\": [";
+        separator = "";
+        for(auto& result : _results){
+            out << separator << "\n    {\"name\": " << quote(result.name);
+            separator = ",";
+            if(!result.skipped.empty()){
+                out << ", \"skipped\": " << quote(result.skipped) << "}";
+                continue;
+            }
+            std::vector<double> sorted = result.samples;
+            std::sort(sorted.begin(), sorted.end());
+            out << ", \"iterations\": " << result.iterations << ", \"repetitions\": " << sorted.size()
+                << ", \"ns_per_op\": " << sorted[sorted.size() / 2] << ", \"ns_per_op_min\": " << sorted.front()
+                << ", \"ns_per_op_max\": " << sorted.back();
+            for(const auto& counter : result.counters)
+                out << ", " << quote(counter.first) << ": " << counter.second;
+            out << "}";
+        }
+        out << "\n  ]\n}" << std::endl;
+    }
+
+}
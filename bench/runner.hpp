@@ -0,0 +1,79 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <map>
+#include <regex>
+#include <ostream>
+#include <functional>
+#include <stdint.h>
+#include "tempdir.hpp"
+
+namespace bench {
+
+	/**
+	 * Timings of a benchmark, per operation, over its repetitions
+	 */
+	struct BenchResult {
+		std::string name;
+		uint64_t iterations; // per repetition
+		std::vector<double> samples; // ns per operation of each repetition
+		std::map<std::string, double> counters; // free-form context (series, bytes, cpus...)
+		std::string skipped; // reason, empty if it ran
+	};
+
+	/**
+	 * Run benchmarks matching a filter and report them as JSON
+	 * The iteration count of a benchmark is calibrated once so that a repetition lasts at least minTime, then all repetitions
+	 * run the same count and the median is reported, so that results of two runs on the same host are comparable
+	 */
+	class BenchRunner {
+
+		private:
+
+		std::regex _filter;
+		int _repetitions;
+		double _minTime; // in ms
+		uint64_t _iterations; // fixed count if not 0
+		std::vector<BenchResult> _results;
+
+		public:
+
+		BenchRunner(const std::string& filter, int repetitions, double minTime, uint64_t iterations);
+
+		bool enabled(const std::string& name);
+
+		/**
+		 * body runs the measured operation iterations times, setup code belongs outside of it
+		 * Return the result so that counters can be added to it, nullptr if the benchmark is filtered out
+		 */
+		BenchResult* run(const std::string& name, const std::function<void(uint64_t iterations)>& body);
+
+		/**
+		 * Report a benchmark that cannot run on this host (e.g. perf_event_open denied)
+		 */
+		void skip(const std::string& name, const std::string& reason);
+
+		/**
+		 * context is written as is, e.g. a commit id or a label given on the command line
+		 */
+		void writeJson(std::ostream& out, const std::map<std::string, std::string>& context);
+	};
+
+	// Shared with the tests
+	using test::TempDir;
+
+	// Keep the optimizer from discarding a computed value
+	template <typename T>
+	inline void keep(const T& value) {
+		asm volatile("" : : "r,m"(value) : "memory");
+	}
+
+	void benchDump(BenchRunner* runner);
+
+	void benchProcfs(BenchRunner* runner);
+
+	void benchCgroup(BenchRunner* runner);
+
+	void benchPerf(BenchRunner* runner);
+
+}
@@ -0,0 +1,227 @@
+#include "cgroup.hpp"
+#include <fstream>
+#include <sstream>
+#include <fts.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include "utils/log.hpp"
+#include "utils/config.hpp"
+
+// Used when no hierarchy can be found in mountinfo, relative to the sysfs root
+#define DEFAULT_CGROUP_VM_BASEPATH "/fs/cgroup/perf_event/machine.slice/"
+// Relative to the procfs root
+#define DEFAULT_MOUNTINFO_PATH "/self/mountinfo"
+#define MACHINE_SLICE "/machine.slice/"
+#define INOTIFY_BUFFER_SIZE 16384
+#define INOTIFY_MASK (IN_CREATE | IN_DELETE | IN_ONLYDIR)
+
+namespace server {
+
+    CgroupClient::CgroupClient() : _version(1), _basePath(utils::Config::Get().sysRoot + DEFAULT_CGROUP_VM_BASEPATH), _inotifyFd(-1) {
+        const std::string& root = utils::Config::Get().cgroupRoot;
+        if (root.empty())
+            detectHierarchy();
+        else { // only the unified hierarchy has cgroup.controllers at its root
+            _version = access((root + "/cgroup.controllers").c_str(), F_OK) == 0 ? 2 : 1;
+            _basePath = root + MACHINE_SLICE;
+        }
+        start();
+    }
+
+    CgroupClient::CgroupClient(const std::string& basePath, int version) : _version(version), _basePath(basePath), _inotifyFd(-1) {
+        start();
+    }
+
+    void CgroupClient::start() {
+        utils::logging::info("Using cgroup v" + std::to_string(_version), "hierarchy", _basePath);
+        if (!rescan())
+            utils::logging::warn("CgroupClient inotify unavailable, the hierarchy will be walked at each refresh");
+    }
+
+    CgroupClient::~CgroupClient() {
+        if (_inotifyFd >= 0)
+            close(_inotifyFd);
+    }
+
+    /**
+     * A mountinfo line is "id parent major:minor root mountpoint options [optional fields] - fstype source superoptions"
+     * The v1 perf_event controller is preferred when mounted (hybrid setups), the unified hierarchy otherwise
+     */
+    void CgroupClient::detectHierarchy() {
+        std::ifstream mountinfo(utils::Config::Get().procRoot + DEFAULT_MOUNTINFO_PATH);
+        std::string line;
+        std::string unified;
+        while (std::getline(mountinfo, line)) {
+            size_t separator = line.find(" - ");
+            if (separator == std::string::npos)
+                continue;
+            std::istringstream mount(line.substr(0, separator));
+            std::istringstream filesystem(line.substr(separator + 3));
+            std::string skip, mountpoint, fstype, source, options;
+            mount >> skip >> skip >> skip >> skip >> mountpoint;
+            filesystem >> fstype >> source >> options;
+            if (fstype == "cgroup" && ("," + options + ",").find(",perf_event,") != std::string::npos) {
+                _version = 1;
+                _basePath = mountpoint + MACHINE_SLICE;
+                return;
+            }
+            if (fstype == "cgroup2" && unified.empty())
+                unified = mountpoint;
+        }
+        if (!unified.empty()) {
+            _version = 2;
+            _basePath = unified + MACHINE_SLICE;
+            return;
+        }
+        utils::logging::warn("CgroupClient::detectHierarchy no perf_event capable cgroup hierarchy found, defaulting to", _basePath);
+    }
+
+    std::unordered_map<std::string, std::string> CgroupClient::retrieveCgroupsVM() {
+        std::lock_guard<std::mutex> guard(_mutex);
+        // machine.slice is only created by systemd with the first VM, it cannot be watched before
+        if (_inotifyFd < 0 || _watches.empty() || !readEvents())
+            rescan();
+        return _vms;
+    }
+
+    bool CgroupClient::rescan() {
+        if (_inotifyFd >= 0)
+            close(_inotifyFd); // also drops its watches and pending events
+        _watches.clear();
+        _vms.clear();
+        _inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        scan(_basePath.substr(0, _basePath.size() - 1));
+        return _inotifyFd >= 0;
+    }
+
+    void CgroupClient::scan(const std::string& slice) {
+        const char *path[] = { slice.c_str(), NULL };
+        FTS *file_system = NULL;
+        FTSENT *node = NULL;
+        file_system = fts_open((char * const *)path, FTS_LOGICAL | FTS_NOCHDIR, NULL);
+        if (!file_system){
+            utils::logging::error("Error while opening", slice);
+            return;
+        }
+        for (node = fts_read(file_system); node; node = fts_read(file_system)) {
+            if (node->fts_info != FTS_D)
+                continue;
+            // VM scopes are not leaves when libvirt creates sub-cgroups (always the case in v2), stop at the scope
+            std::string vmname = node->fts_level == 0 ? "" : parseScopeName(node->fts_name);
+            if (!vmname.empty()) {
+                _vms[vmname] = node->fts_path;
+                fts_set(file_system, node, FTS_SKIP);
+                continue;
+            }
+            std::string name = node->fts_name;
+            if (node->fts_level > 0 && (name.size() < 6 || name.compare(name.size() - 6, 6, ".slice") != 0)) {
+                fts_set(file_system, node, FTS_SKIP);
+                continue;
+            }
+            // Watched before its entries are read, a scope created meanwhile is seen twice at worst
+            if (_inotifyFd >= 0) {
+                int wd = inotify_add_watch(_inotifyFd, node->fts_path, INOTIFY_MASK);
+                if (wd >= 0)
+                    _watches[wd] = node->fts_path;
+                else
+                    utils::logging::warn("CgroupClient::scan unable to watch", node->fts_path, strerror(errno));
+            }
+        }
+        fts_close(file_system);
+    }
+
+    bool CgroupClient::readEvents() {
+        alignas(inotify_event) char buffer[INOTIFY_BUFFER_SIZE];
+        while (true) {
+            ssize_t size = read(_inotifyFd, buffer, sizeof(buffer));
+            if (size < 0 && errno == EINTR)
+                continue;
+            if (size < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return true;
+            if (size <= 0) {
+                utils::logging::warn("CgroupClient::readEvents unable to read inotify events", strerror(errno));
+                return false;
+            }
+            for (ssize_t offset = 0; offset < size; offset += sizeof(inotify_event) + ((inotify_event*) (buffer + offset))->len) {
+                inotify_event* event = (inotify_event*) (buffer + offset);
+                if (event->mask & IN_Q_OVERFLOW) {
+                    utils::logging::warn("CgroupClient::readEvents inotify queue overflow, walking the hierarchy again");
+                    return false;
+                }
+                if (event->mask & IN_IGNORED) { // the slice was removed
+                    _watches.erase(event->wd);
+                    continue;
+                }
+                auto watch = _watches.find(event->wd);
+                if (watch == _watches.end() || !(event->mask & IN_ISDIR) || event->len == 0)
+                    continue;
+                std::string name = event->name;
+                std::string path = watch->second + "/" + name;
+                std::string vmname = parseScopeName(name);
+                if (event->mask & IN_CREATE) {
+                    if (!vmname.empty())
+                        _vms[vmname] = path;
+                    else if (name.size() >= 6 && name.compare(name.size() - 6, 6, ".slice") == 0)
+                        scan(path);
+                } else if ((event->mask & IN_DELETE) && !vmname.empty()) {
+                    auto vm = _vms.find(vmname);
+                    if (vm != _vms.end() && vm->second == path)
+                        _vms.erase(vm);
+                }
+            }
+        }
+    }
+
+    std::string CgroupClient::parseScopeName(std::string scope) {
+        // format is machine-qemu\x2d{id}\x2d{name which may contains \x2d}.scope
+        if (scope.rfind("machine-qemu\\x2d", 0) != 0)
+            return "";
+        std::string vmname_start_at_id = scope.substr(strlen("machine-qemu\\x2d"));
+        size_t found_second = vmname_start_at_id.find("\\x2d");
+        if (found_second == std::string::npos)
+            return "";
+        std::string vmname_start_at_name = vmname_start_at_id.substr(found_second+4);
+        size_t found_scope = vmname_start_at_name.find_last_of('.');
+        if (found_scope != std::string::npos) // remove .scope
+            vmname_start_at_name.erase(found_scope);
+        return unescapeName(vmname_start_at_name);
+    }
+
+    // systemd escapes unit names as \xNN (e.g. \x2d for dashes), restore the domain name
+    std::string CgroupClient::unescapeName(const std::string& escaped) {
+        std::string name;
+        for (size_t i = 0; i < escaped.size(); i++) {
+            if (escaped[i] == '\\' && i + 3 < escaped.size() && escaped[i+1] == 'x' && isxdigit(escaped[i+2]) && isxdigit(escaped[i+3])) {
+                name.push_back((char) std::stoi(escaped.substr(i+2, 2), nullptr, 16));
+                i += 3;
+                continue;
+            }
+            name.push_back(escaped[i]);
+        }
+        return name;
+    }
+
+    std::vector<std::string> CgroupClient::retrieveProcsFiles(std::string cgroupPath) {
+        std::vector<std::string> files;
+        const char *path[] = { cgroupPath.c_str(), NULL };
+        FTS *file_system = fts_open((char * const *)path, FTS_LOGICAL | FTS_NOCHDIR, NULL);
+        if (!file_system)
+            return files;
+        for (FTSENT *node = fts_read(file_system); node; node = fts_read(file_system))
+            if (node->fts_info == FTS_D)
+                files.push_back(std::string(node->fts_path) + "/cgroup.procs");
+        fts_close(file_system);
+        return files;
+    }
+
+    int CgroupClient::getVersion() const {
+        return _version;
+    }
+
+    const std::string& CgroupClient::getBasePath() const {
+        return _basePath;
+    }
+
+}
@@ -0,0 +1,85 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+
+namespace server {
+
+	/**
+	 * The cgroup client is used to find the cgroup of each VM
+	 * Both the legacy perf_event hierarchy (v1) and the unified hierarchy (v2) are supported,
+	 * the one in use is detected from /proc/self/mountinfo
+	 * The hierarchy is walked once, then kept up to date from inotify events on machine.slice and its sub-slices
+	 */
+	class CgroupClient {
+
+		private:
+
+		int _version;
+		std::string _basePath; // machine.slice directory, with a trailing slash
+
+		std::mutex _mutex; // VMs may be looked up by the libvirt event thread
+		int _inotifyFd;
+		std::unordered_map<int, std::string> _watches; // id : watch descriptor = slice directory
+		std::unordered_map<std::string, std::string> _vms; // id : vmname = scope directory
+
+		void detectHierarchy();
+
+		/**
+		 * Forget all watches and walk the whole hierarchy again, used at start and when the inotify queue overflowed
+		 * Return false if inotify is not available, the hierarchy is then walked at each lookup
+		 */
+		bool rescan();
+
+		/**
+		 * Walk a slice, watching it and its sub-slices, and register the VM scopes found
+		 * Other directories (podman containers, libvirt sub-cgroups) are not descended into
+		 */
+		void scan(const std::string& slice);
+
+		/**
+		 * Apply pending inotify events, return false if a rescan is needed
+		 */
+		bool readEvents();
+
+		void start();
+
+		public:
+
+		CgroupClient();
+
+		/**
+		 * Use the given hierarchy instead of the detected one, basePath is a machine.slice directory with a trailing slash
+		 */
+		CgroupClient(const std::string& basePath, int version);
+
+		~CgroupClient();
+
+		/**
+		 * Return the directory of each VM scope, id = vmname
+		 * Directories can be opened as perf cgroup targets (PERF_FLAG_PID_CGROUP)
+		 * @info: only the changes since the previous call are read, unless inotify is unavailable
+		 */
+		std::unordered_map<std::string, std::string> retrieveCgroupsVM();
+
+		/**
+		 * Return the cgroup.procs files of a cgroup and of all its sub-cgroups
+		 * In v2, pids of a VM only live in leaves (libvirt/vcpuN, libvirt/emulator)
+		 */
+		std::vector<std::string> retrieveProcsFiles(std::string cgroupPath);
+
+		/**
+		 * Parse a scope directory name such as machine-qemu\x2d{id}\x2d{name}.scope
+		 * Return the domain name, or an empty string if it does not belong to a VM (e.g. a podman container)
+		 */
+		static std::string parseScopeName(std::string scope);
+
+		static std::string unescapeName(const std::string& escaped);
+
+		int getVersion() const;
+
+		const std::string& getBasePath() const;
+	};
+
+}
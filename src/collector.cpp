@@ -0,0 +1,147 @@
+#include "collector.hpp"
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+#include "utils/config.hpp"
+#include "utils/log.hpp"
+
+namespace server {
+
+    Collector::Collector(const std::string& name, const std::vector<std::string>& prefixes, std::function<void(Dump*)> collect, int sampling) : _name(name),
+        _collect(collect), _dump(utils::Config::Get().prefix, "", false, utils::Config::Get().labels, false), _derived(prefixes), _sampling(sampling), _tick(0), _running(false), _stop(false), _skipped(0) {
+        if(_sampling > 0) // samples per window, rounded up
+            _window.reset(new WindowAggregates((utils::Config::Get().delay + _sampling - 1) / _sampling));
+    }
+
+    void Collector::collectorStart(bool threaded, const std::vector<SeriesSink*>& sinks) {
+        for(auto sink : sinks)
+            _dump.addSink(sink);
+        if(_sampling > 0)
+            _thread = std::thread(&Collector::samplingLoop, this);
+        else if(threaded)
+            _thread = std::thread(&Collector::collectorLoop, this);
+    }
+
+    void Collector::collectorTick() {
+        if(!_thread.joinable()){
+            collect();
+            return;
+        }
+        std::lock_guard<std::mutex> lock(_mutex);
+        if(_sampling == 0 && (_running || _tick > 0)){ // the previous collection overran, this one is skipped
+            _skipped++;
+            return;
+        }
+        _tick = 1;
+        _wake.notify_one();
+    }
+
+    void Collector::collectorLoop() {
+        while(true){
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _wake.wait(lock, [this]{ return _stop || _tick > 0; });
+                if(_stop)
+                    return;
+                _tick = 0;
+                _running = true;
+            }
+            collect();
+            std::lock_guard<std::mutex> lock(_mutex);
+            _running = false;
+        }
+    }
+
+    void Collector::samplingLoop() {
+        int timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+        itimerspec timer;
+        timer.it_interval.tv_sec = _sampling / 1000;
+        timer.it_interval.tv_nsec = (_sampling % 1000) * 1000000L;
+        timer.it_value = timer.it_interval;
+        if(timerFd < 0 || timerfd_settime(timerFd, 0, &timer, nullptr) < 0){
+            utils::logging::error("Collector::samplingLoop unable to arm the sampling timer of", _name, strerror(errno));
+            if(timerFd >= 0)
+                close(timerFd);
+            _window.reset();
+            collectorLoop(); // collected once per tick instead
+            return;
+        }
+        utils::logging::info("Collector", _name, "sampled every", _sampling, "ms");
+        while(true){
+            bool window;
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                if(_stop)
+                    break;
+                window = _tick > 0;
+                _tick = 0;
+            }
+            _collect(&_dump);
+            _derived.evaluate(&_dump);
+            _window->observe(&_dump);
+            if(window){
+                _window->flush(&_dump);
+                if(_windowEnd){
+                    _windowEnd(&_dump);
+                    _derived.evaluate(&_dump);
+                }
+                publish();
+            }
+            else
+                _dump.clear();
+            unsigned long long expirations = 0;
+            while(read(timerFd, &expirations, sizeof(expirations)) < 0 && errno == EINTR);
+            if(expirations > 1) // samples missed because the previous one overran its period
+                _skipped += expirations - 1;
+        }
+        close(timerFd);
+    }
+
+    void Collector::collect() {
+        _collect(&_dump);
+        _derived.evaluate(&_dump);
+        publish();
+    }
+
+    void Collector::publish() {
+        _dump.dump(); // render only
+        std::string rendered;
+        _dump.swapBuffer(&rendered);
+        _snapshot.publish(&rendered);
+        _dump.swapBuffer(&rendered); // previous back buffer, its capacity is reused by the next rendering
+        _dump.clear();
+    }
+
+    void Collector::collectorStop() {
+        if(!_thread.joinable())
+            return;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stop = true;
+        }
+        _wake.notify_one();
+        _thread.join();
+    }
+
+    void Collector::setWindowEnd(std::function<void(Dump*)> windowEnd) {
+        _windowEnd = windowEnd;
+    }
+
+    SnapshotBuffer* Collector::getSnapshot() {
+        return &_snapshot;
+    }
+
+    const std::string& Collector::getName() {
+        return _name;
+    }
+
+    bool Collector::derives(const std::string& name) {
+        return _derived.derives(name);
+    }
+
+    unsigned long long Collector::getSkipped() {
+        return _skipped;
+    }
+
+}
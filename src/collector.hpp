@@ -0,0 +1,95 @@
+#pragma once
+#include <string>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <memory>
+#include "dump.hpp"
+#include "sink.hpp"
+#include "derived.hpp"
+#include "window.hpp"
+
+namespace server {
+
+	/**
+	 * A source of metrics (perf, procfs, libvirt) collected into its own dump at each tick
+	 * Once a collection is complete its rendering is published, the renderer always appends the last complete one
+	 * so that a slow source only delays its own series
+	 */
+	class Collector {
+
+		private:
+
+		std::string _name;
+		std::function<void(Dump*)> _collect;
+		std::function<void(Dump*)> _windowEnd; // optional, sampled collectors only
+		Dump _dump;
+		DerivedMetrics _derived; // evaluated on each collection, before it is rendered
+		int _sampling; // in ms, 0 if collected once per tick
+		std::unique_ptr<WindowAggregates> _window; // only for sampled collectors
+		SnapshotBuffer _snapshot;
+
+		// Optional thread, collections run in the caller of collectorTick otherwise
+		std::thread _thread;
+		std::mutex _mutex;
+		std::condition_variable _wake;
+		unsigned long long _tick;
+		bool _running; // a collection is in progress in the collector thread
+		bool _stop;
+		std::atomic<unsigned long long> _skipped;
+
+		void collectorLoop();
+
+		/**
+		 * Sample at a fixed period from the collector thread, the window is closed by the first sample following a tick
+		 */
+		void samplingLoop();
+
+		void collect();
+
+		void publish();
+
+		public:
+
+		/**
+		 * Series are registered by collect in the dump it is given, they must not share a family with another collector
+		 * Their keys start with one of prefixes, derived metrics are only evaluated when all their variables match
+		 */
+		Collector(const std::string& name, const std::vector<std::string>& prefixes, std::function<void(Dump*)> collect, int sampling = 0);
+
+		/**
+		 * Sampled collectors always get their own thread, series of each collection are also written to sinks
+		 */
+		void collectorStart(bool threaded, const std::vector<SeriesSink*>& sinks);
+
+		/**
+		 * Trigger a collection, ticks received while the previous collection is still running are skipped
+		 */
+		void collectorTick();
+
+		void collectorStop();
+
+		/**
+		 * Called with the dump of the last sample of a window, after its aggregates were set and before it is published
+		 * so that the source can set its series to values covering the whole window, derived metrics are evaluated again
+		 */
+		void setWindowEnd(std::function<void(Dump*)> windowEnd);
+
+		SnapshotBuffer* getSnapshot();
+
+		const std::string& getName();
+
+		/**
+		 * Whether the derived metric name is evaluated on the series of this collector
+		 */
+		bool derives(const std::string& name);
+
+		/**
+		 * Ticks skipped since start because the collection was still running
+		 */
+		unsigned long long getSkipped();
+	};
+
+}
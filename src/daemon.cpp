@@ -4,63 +4,243 @@
 #include "utils/config.hpp"
 #include "utils/log.hpp"
 #include <chrono>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+#include "error.hpp"
 
 namespace server {
 
     Daemon::Daemon(){
         _delay = utils::Config::Get().delay;
-        _dump = new server::Dump(utils::Config::Get().prefix, utils::Config::Get().endpoint);
+        _sessions = 0;
+        _rescanSession = 0;
+        _rescan = 1;
+        _stopping = false;
+        _dump = new server::Dump(utils::Config::Get().prefix, utils::Config::Get().endpoint, utils::Config::Get().dumpSync,
+            utils::Config::Get().labels);
         _libvirt = new server::LibvirtClient(utils::Config::Get().url.c_str());
         _perfcli = new server::PerfClient();
+        _sampler = new server::PerfSampler();
+        // Cheap sources may be sampled several times per read session
+        int sampling = utils::Config::Get().samplingDelay;
+        if(sampling > 0 && sampling >= _delay){
+            utils::logging::warn("samplingdelay", sampling, "is not lower than delay", _delay, "sampling disabled");
+            sampling = 0;
+        }
+        _sampled = sampling > 0;
+        _collectors.push_back(new Collector("perf", {"perf_"}, [this](Dump* dump){ retrievePerfMetrics(dump); }, sampling));
+        if(_sampled) // perf series keep the counts of the whole session, samples are only seen through their window aggregates
+            _collectors.back()->setWindowEnd([this](Dump* dump){ _perfcli->perfSessionEnd(dump); });
+        _collectors.push_back(new Collector("schedstat", {"sched_"}, [this](Dump* dump){ retrieveSchedstatMetrics(dump); }, sampling));
+        _collectors.push_back(new Collector("procfs", {"cpu_", "memory_", "stat_", "sched_", "sample_"},
+            [this](Dump* dump){ retrieveProcfsMetrics(dump); }));
+        _collectors.push_back(new Collector("libvirt", {"cpu_", "memory_", "vcpu_", "state", "libvirt_"},
+            [this](Dump* dump){ retrieveLibvirtMetrics(dump); }));
+        for(auto collector : _collectors)
+            _snapshots.push_back(collector->getSnapshot());
+        // Collectors run at different times, an expression mixing their series would never get all its variables in one collection
+        for(const auto& program : DerivedMetrics::programs()){
+            bool evaluated = false;
+            for(auto collector : _collectors)
+                evaluated = evaluated || collector->derives(program.name);
+            if(!evaluated)
+                utils::logging::error("derived metric", program.name, "ignored, its variables are not all series of a single collector (perf, schedstat, procfs or libvirt)");
+        }
+        _http = nullptr;
+        if(utils::Config::Get().httpPort > 0)
+            _http = new server::HttpServer(utils::Config::Get().httpAddress, utils::Config::Get().httpPort, utils::Config::Get().httpGzip,
+                utils::Config::Get().httpTimeout, utils::Config::Get().httpMaxConnections);
     };
 
-    void Daemon::start () {
+    void Daemon::start (unsigned long long sessions) {
         this-> _libvirt->connect ();
-        this-> _perfcli->perfInit();
+        this-> _perfcli->perfInit(_sampled);
         this-> _perfcli->perfEnable();
+        this-> _sampler->samplerInit();
+        bool events = this-> _libvirt->startEvents([this](const std::string& vmname, bool running){
+            if(running)
+                this-> _perfcli->perfStartVM(vmname);
+            else
+                this-> _perfcli->perfStopVM(vmname);
+        });
+        if(events) // VMs are tracked as they start and stop, the rescan is only a consistency check
+            _rescan = std::max(1, utils::Config::Get().perfRescan);
+        this-> _profiler.profilerInit(_dump);
+        if(!utils::Config::Get().historyFile.empty() && _history.historyOpen(utils::Config::Get().historyFile, utils::Config::Get().historyHours,
+            _delay, utils::Config::Get().historySeries))
+            _sinks.push_back(&_history);
+        if(!utils::Config::Get().exportDir.empty() && _export.exportOpen(utils::Config::Get().exportDir,
+            (size_t) utils::Config::Get().exportSegmentMB << 20))
+            _sinks.push_back(&_export);
+        for(auto sink : _sinks)
+            _dump->addSink(sink);
+        if(this-> _http != nullptr && !this-> _http->httpStart()){
+            delete this-> _http;
+            this-> _http = nullptr;
+        }
         long long epochBegin;
-        long long epochEnd;
-        while(true){
+        // Ticks are absolute deadlines on the monotonic clock, late collections do not shift the following ones
+        int timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+        timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        timespec lastWake = deadline;
+        itimerspec timer;
+        timer.it_interval.tv_sec = _delay / 1000;
+        timer.it_interval.tv_nsec = (_delay % 1000) * 1000000L;
+        timer.it_value = deadline;
+        addDelay(&timer.it_value, 1);
+        if(timerFd < 0 || timerfd_settime(timerFd, TFD_TIMER_ABSTIME, &timer, nullptr) < 0){
+            utils::logging::error("Daemon::start unable to arm the collection timer", strerror(errno));
+            throw ProbeError("Daemon::start failed\n");
+        }
+        std::vector<double> periodBounds; // in us, around the configured delay
+        for(double ratio : {0.5, 0.9, 0.95, 0.99, 1.01, 1.05, 1.1, 1.5, 2.0})
+            periodBounds.push_back((long long) (_delay * 1000 * ratio));
+        _dump->registerHistogram("", "probe_period_us", periodBounds, "Time between two collection wake-ups, in microseconds", &_period);
+        _dump->registerHistogram("", "probe_jitter_us", {10, 50, 100, 500, 1000, 5000, 10000, 50000, 100000, 500000},
+            "Delay between a collection deadline and the wake-up, in microseconds", &_jitter);
+        MetricId skippedMetric = _dump->registerGlobalMetric("probe_skipped_ticks", COUNTER, "Collection deadlines missed because the previous collection overran");
+        std::vector<MetricId> collectorMetrics;
+        for(auto collector : _collectors){
+            collectorMetrics.push_back(_dump->registerGlobalMetric("probe_collector_skipped_ticks", "collector", collector->getName(), COUNTER,
+                "Ticks a collector skipped because its previous collection was still running"));
+            collector->collectorStart(utils::Config::Get().collectorThreads, _sinks);
+        }
+        unsigned long long skipped = 0;
+        while(!_stopping){
             _dump->addGlobalMetric("probe_delay", _delay);
             epochBegin =  std::chrono::duration_cast< std::chrono::milliseconds >(std::chrono::system_clock::now().time_since_epoch()).count();
             _dump->addGlobalMetric("probe_epoch", epochBegin);
-            retrievePerfMetrics();
-            retrieveLibvirtMetrics();
-            _dump->dump();
+            for(auto sink : _sinks)
+                sink->sinkBeginRow(epochBegin);
+            _dump->set(_period);
+            _dump->set(_jitter);
+            _dump->set(skippedMetric, skipped);
+            _sessions++;
+            // With threads, the dump below appends the previous complete snapshot of each collector
+            for(size_t i = 0; i < _collectors.size(); i++){
+                _collectors[i]->collectorTick();
+                _dump->set(collectorMetrics[i], _collectors[i]->getSkipped());
+            }
+            _profiler.profilerRead(_dump);
+            _profiler.phaseBegin(PHASE_DUMP);
+            _dump->dump(_snapshots);
+            if(_http != nullptr){
+                std::string rendered;
+                _dump->swapBuffer(&rendered);
+                _http->publish(&rendered);
+                _dump->swapBuffer(&rendered); // body of a snapshot no scraper holds anymore, its capacity is reused by the next rendering
+            }
             _dump->clear();
-            epochEnd= std::chrono::duration_cast< std::chrono::milliseconds >(std::chrono::system_clock::now().time_since_epoch()).count();
-            if(_delay > (epochEnd-epochBegin)){
-                sleep((_delay - (epochEnd-epochBegin))/1000);
+            _profiler.phaseEnd(PHASE_DUMP);
+            if((sessions > 0 && --sessions == 0) || _stopping)
+                break;
+            unsigned long long expirations = 0;
+            timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            timespec next = deadline;
+            addDelay(&next, 1);
+            if(elapsedMicroseconds(next, now) >= 0){ // the session overran, deadlines already expired are skipped
+                while(read(timerFd, &expirations, sizeof(expirations)) < 0 && errno == EINTR && !_stopping);
+                addDelay(&deadline, expirations);
+                skipped += expirations;
+                utils::logging::warn("delay exceeded by fetching time,", expirations, "tick(s) skipped");
             }
-            else{
-                utils::logging::warn("delay exceeded by fetching time", (epochEnd-epochBegin), ">", _delay);
+            // Interrupted by a signal when it is delivered to this thread, at the latest the stop is seen at the next deadline
+            while(read(timerFd, &expirations, sizeof(expirations)) < 0 && errno == EINTR && !_stopping);
+            if(_stopping)
+                break;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            addDelay(&deadline, expirations); // last expired deadline
+            if(expirations > 1){
+                skipped += expirations - 1;
+                utils::logging::warn("delay exceeded by fetching time,", expirations - 1, "tick(s) skipped");
             }
+            _jitter.observe(elapsedMicroseconds(deadline, now));
+            _period.observe(elapsedMicroseconds(lastWake, now));
+            lastWake = now;
         }
+        close(timerFd);
+    }
+
+    void Daemon::addDelay(timespec* time, unsigned long long ticks) {
+        long long nanoseconds = time->tv_nsec + (long long) (_delay % 1000) * 1000000L * ticks;
+        time->tv_sec += (_delay / 1000) * ticks + nanoseconds / 1000000000L;
+        time->tv_nsec = nanoseconds % 1000000000L;
     }
 
-    inline void Daemon::retrievePerfMetrics(){
-        long long instructions;
-        long long cycles;
-        _perfcli->perfRead(_dump);
+    long long Daemon::elapsedMicroseconds(const timespec& begin, const timespec& end) {
+        return (end.tv_sec - begin.tv_sec) * 1000000LL + (end.tv_nsec - begin.tv_nsec) / 1000;
+    }
+
+    void Daemon::retrievePerfMetrics(Dump* dump){
+        // Samples taken before the first tick belong to no session, perfInit already scanned the cgroups
+        unsigned long long session = _sessions;
+        if(session > 0 && (_rescanSession == 0 || session - _rescanSession >= (unsigned long long) _rescan)){
+            _rescanSession = session;
+            _profiler.phaseBegin(PHASE_PERF_REFRESH);
+            _perfcli->perfRefreshVMs();
+            _profiler.phaseEnd(PHASE_PERF_REFRESH);
+        }
+        _profiler.phaseBegin(PHASE_PERF_READ);
+        _perfcli->perfRead(dump);
         _perfcli->perfReset();
-        _dump->addGlobalMetric("cpu_freq", _perfcli->readCPUFrequency());
-        _dump->addGlobalMetric("cpu_minfreq", _perfcli->getMinFreq());
-        _dump->addGlobalMetric("cpu_maxfreq", _perfcli->getMaxFreq());
-        _dump->addGlobalMetric("cpu_total", _perfcli->getVCPUs());
-        _perfcli->addHostMemoryUsage(_dump);
-        _perfcli->readSchedStat(_dump);
+        _profiler.phaseEnd(PHASE_PERF_READ);
+    }
+
+    void Daemon::retrieveSchedstatMetrics(Dump* dump){
+        _profiler.phaseBegin(PHASE_SCHEDSTAT);
+        _perfcli->readNodeSchedStat(dump);
+        _profiler.phaseEnd(PHASE_SCHEDSTAT);
+    }
+
+    // The sampler follows the pids found by readVmSchedStat, both run on the same collector
+    void Daemon::retrieveProcfsMetrics(Dump* dump){
+        _profiler.phaseBegin(PHASE_PROCFS);
+        dump->addGlobalMetric("cpu_freq", _perfcli->readCPUFrequency());
+        dump->addGlobalMetric("cpu_minfreq", _perfcli->getMinFreq());
+        dump->addGlobalMetric("cpu_maxfreq", _perfcli->getMaxFreq());
+        dump->addGlobalMetric("cpu_total", _perfcli->getVCPUs());
+        _perfcli->addHostMemoryUsage(dump);
+        _perfcli->readVmSchedStat(dump);
+        _profiler.phaseEnd(PHASE_PROCFS);
+        _profiler.phaseBegin(PHASE_SAMPLER);
+        _sampler->samplerRead(dump, _perfcli->getVmPids());
+        _profiler.phaseEnd(PHASE_SAMPLER);
+    }
+
+    void Daemon::retrieveLibvirtMetrics(Dump* dump){
+        _profiler.phaseBegin(PHASE_LIBVIRT_NODE);
+        _libvirt->addNodeCPUMetrics(dump);
+        _profiler.phaseEnd(PHASE_LIBVIRT_NODE);
+        _profiler.phaseBegin(PHASE_LIBVIRT_DOMAINS);
+        _libvirt->addAllDomainsMetrics(dump);
+        _profiler.phaseEnd(PHASE_LIBVIRT_DOMAINS);
     }
 
-    inline void Daemon::retrieveLibvirtMetrics(){
-        _libvirt->addNodeCPUMetrics(_dump);
-        _libvirt->addAllDomainsMetrics(_dump);
+    void Daemon::stop () {
+        _stopping = true;
     }
 
     void Daemon::kill () {
+        for(auto collector : _collectors)
+            collector->collectorStop();
         this-> _libvirt->disconnect ();
         this-> _perfcli->perfClose();
-        free(_libvirt);
-        free(_perfcli);
+        this-> _sampler->samplerClose();
+        this-> _profiler.profilerClose();
+        this-> _history.historyClose();
+        this-> _export.exportClose();
+        if(this-> _http != nullptr)
+            this-> _http->httpStop();
+        delete _libvirt;
+        delete _perfcli;
+        delete _sampler;
+        _libvirt = nullptr;
+        _perfcli = nullptr;
+        _sampler = nullptr;
     }
 
 }
@@ -1,5 +1,12 @@
+#include <atomic>
 #include "libvirtcli.hpp"
 #include "perfcli.hpp"
+#include "sampler.hpp"
+#include "httpserver.hpp"
+#include "profiler.hpp"
+#include "collector.hpp"
+#include "history.hpp"
+#include "export.hpp"
 
 namespace server {
     
@@ -17,14 +24,61 @@ namespace server {
 			// The perf interface
 			PerfClient* _perfcli;
 
+			// The perf tracepoint sampler
+			PerfSampler* _sampler;
+
+			// Daemon series and output, collector snapshots are appended to it
 			Dump* _dump;
 
+			// Sources of metrics, each with its own dump and optionally its own thread
+			std::vector<Collector*> _collectors;
+			std::vector<SnapshotBuffer*> _snapshots;
+
+			// Self instrumentation of each phase of the read session
+			PhaseProfiler _profiler;
+
+			// Optional on-host history of all series, one row per read session
+			History _history;
+
+			// Optional binary export of all series to rotating segment files
+			SegmentExport _export;
+
+			// Enabled sinks among the above
+			std::vector<SeriesSink*> _sinks;
+
+			// Optional /metrics endpoint, nullptr if disabled
+			HttpServer* _http;
+
 			// Fetching delay
 			int _delay;
 
-			void retrievePerfMetrics();
+			// perf and schedstat collectors are sampled several times per read session
+			bool _sampled;
+
+			// Read sessions since start, counted by the main loop and read by the perf collector which may sample several times per session
+			// The cgroup rescan is only done every _rescan sessions when lifecycle events are received
+			std::atomic<unsigned long long> _sessions;
+			unsigned long long _rescanSession; // session of the last rescan, 0 before the first one
+			int _rescan;
+
+			// Set by stop, possibly from a signal handler, the main loop returns at its next wake-up
+			std::atomic<bool> _stopping;
 
-			void retrieveLibvirtMetrics();
+			// Collection timing, observed at each wake-up of the collection timer
+			MetricHistogram _period;
+			MetricHistogram _jitter;
+
+			void addDelay(timespec* time, unsigned long long ticks);
+
+			static long long elapsedMicroseconds(const timespec& begin, const timespec& end);
+
+			void retrievePerfMetrics(Dump* dump);
+
+			void retrieveSchedstatMetrics(Dump* dump);
+
+			void retrieveProcfsMetrics(Dump* dump);
+
+			void retrieveLibvirtMetrics(Dump* dump);
 		
 		public: 
 		
@@ -32,11 +86,17 @@ namespace server {
 
 			/**
 			 * Start the different part of the daemon
+			 * With sessions, return after that many read sessions (scale harness), run until stop is called otherwise
+			 */
+			void start (unsigned long long sessions = 0);
+
+			/**
+			 * Ask start to return, async-signal-safe
 			 */
-			void start ();
+			void stop ();
 
 			/**
-			 * Force the killing of the daemon
+			 * Close every source and sink, once start returned
 			 */
 			void kill ();
 	
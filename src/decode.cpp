@@ -0,0 +1,117 @@
+#include "decode.hpp"
+#include <string>
+#include <regex>
+#include <iostream>
+#include <charconv>
+#include <unordered_map>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "segment.hpp"
+
+namespace server {
+
+    static int usage() {
+        std::cerr << "usage: vmprobe decode [--match pattern] segment..." << std::endl;
+        return 1;
+    }
+
+    /**
+     * Print a segment, false if it cannot be read. A truncated segment (probe killed while writing) is printed up to its last complete block
+     */
+    static bool decodeSegment(const std::string& path, const std::regex& regex, std::string* out) {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        if(fd < 0 || fstat(fd, &st) < 0){
+            std::cerr << "cannot open segment " << path << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+        if(st.st_size == 0){
+            std::cerr << path << " is not a vmprobe segment" << std::endl;
+            close(fd);
+            return false;
+        }
+        const uint8_t* data = (const uint8_t*) mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if(data == MAP_FAILED){
+            std::cerr << "cannot map segment " << path << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+        size_t size = st.st_size, offset;
+        SegmentDecoder decoder;
+        if(!decoder.decoderHeader(data, size, &offset)){
+            std::cerr << path << " is not a vmprobe segment" << std::endl;
+            munmap((void*) data, size);
+            return false;
+        }
+        std::unordered_map<std::string, bool> matches; // by name, the regex is evaluated once per series
+        std::vector<std::pair<int, MetricValue>> cells;
+        int64_t timestamp;
+        char number[32];
+        while(offset < size && decoder.decoderBlock(data, size, &offset, &timestamp, &cells)){
+            std::string time = std::to_string(timestamp);
+            for(const auto& cell : cells){
+                const std::string& name = decoder.decoderName(cell.first);
+                auto match = matches.find(name);
+                if(match == matches.end())
+                    match = matches.emplace(name, std::regex_search(name, regex)).first;
+                if(!match->second)
+                    continue;
+                const MetricValue& v = cell.second;
+                std::to_chars_result result;
+                if(v.type == MetricValue::SIGNED)
+                    result = std::to_chars(number, number + sizeof(number), v.i);
+                else if(v.type == MetricValue::UNSIGNED)
+                    result = std::to_chars(number, number + sizeof(number), v.u);
+                else
+                    result = std::to_chars(number, number + sizeof(number), v.d);
+                out->append(name);
+                out->push_back(' ');
+                out->append(number, result.ptr);
+                out->push_back(' ');
+                out->append(time);
+                out->push_back('\n');
+            }
+            std::cout << *out;
+            out->clear();
+        }
+        if(offset < size)
+            std::cerr << path << " ends with an incomplete block at byte " << offset << std::endl;
+        munmap((void*) data, size);
+        return true;
+    }
+
+    int decodeMain(int argc, char** argv) {
+        std::string pattern = ".*";
+        std::vector<std::string> paths;
+        for(int i = 0; i < argc; i++){
+            std::string arg = argv[i];
+            if(arg == "--match" && i + 1 < argc)
+                pattern = argv[++i];
+            else if(arg.rfind("--", 0) == 0)
+                return usage();
+            else
+                paths.push_back(arg);
+        }
+        if(paths.empty())
+            return usage();
+        std::regex regex;
+        try {
+            regex = std::regex(pattern);
+        } catch(const std::regex_error& e) {
+            std::cerr << "invalid pattern " << pattern << ": " << e.what() << std::endl;
+            return 1;
+        }
+        std::string out;
+        int status = 0;
+        for(const auto& path : paths)
+            if(!decodeSegment(path, regex, &out))
+                status = 1;
+        std::cout << std::flush;
+        return status;
+    }
+
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+namespace server {
+
+	/**
+	 * vmprobe decode [--match pattern] segment...
+	 * Print the series of binary export segments whose name matches pattern (a regular expression) as "name value timestamp_ms" lines
+	 */
+	int decodeMain(int argc, char** argv);
+
+}
@@ -0,0 +1,198 @@
+#include "derived.hpp"
+#include <cmath>
+#include <ctype.h>
+#include <stdlib.h>
+#include "utils/config.hpp"
+#include "utils/log.hpp"
+
+namespace server {
+
+    DerivedMetrics::DerivedMetrics(const std::vector<std::string>& prefixes) {
+        for(const auto& program : programs()){
+            bool local = true;
+            for(const auto& variable : program.variables){
+                bool found = derives(variable);
+                for(const auto& prefix : prefixes)
+                    found = found || variable.compare(0, prefix.size(), prefix) == 0;
+                local = local && found;
+            }
+            if(local)
+                _programs.push_back(program);
+        }
+    }
+
+    bool DerivedMetrics::derives(const std::string& name) const {
+        for(const auto& program : _programs)
+            if(program.name == name)
+                return true;
+        return false;
+    }
+
+    const std::vector<DerivedProgram>& DerivedMetrics::programs() {
+        static const std::vector<DerivedProgram> compiled = []{
+            std::vector<DerivedProgram> programs;
+            for(const auto& derived : utils::Config::Get().derived){
+                DerivedProgram program;
+                if(compile(derived.first, derived.second, &program))
+                    programs.push_back(program);
+            }
+            if(!programs.empty())
+                utils::logging::info(programs.size(), "derived metric(s) compiled");
+            return programs;
+        }();
+        return compiled;
+    }
+
+    static int precedence(char op) {
+        return op == '+' || op == '-' ? 1 : op == '*' || op == '/' ? 2 : op == '~' ? 3 : 0; // ~ is the unary minus
+    }
+
+    /**
+     * Shunting-yard, operators are left associative except the unary minus
+     */
+    bool DerivedMetrics::compile(const std::string& name, const std::string& expression, DerivedProgram* program) {
+        std::vector<char> operators;
+        size_t depth = 0;
+        bool operand = true; // an operand is expected next
+        auto emit = [&](char op){
+            switch(op){
+                case '+': program->ops.push_back({DERIVED_ADD, -1, 0}); break;
+                case '-': program->ops.push_back({DERIVED_SUB, -1, 0}); break;
+                case '*': program->ops.push_back({DERIVED_MUL, -1, 0}); break;
+                case '/': program->ops.push_back({DERIVED_DIV, -1, 0}); break;
+                default: program->ops.push_back({DERIVED_NEG, -1, 0}); return; // does not change the depth
+            }
+            depth--;
+        };
+        auto fail = [&](const std::string& reason){
+            utils::logging::error("DerivedMetrics::compile", name, "=", expression, reason);
+            return false;
+        };
+        program->name = name;
+        for(size_t i = 0; i < expression.size();){
+            char c = expression[i];
+            if(operand && (isdigit((unsigned char) c) || c == '.')){
+                char* end;
+                double constant = strtod(expression.c_str() + i, &end);
+                program->ops.push_back({DERIVED_CONSTANT, -1, constant});
+                i = end - expression.c_str();
+                operand = false;
+            }
+            else if(operand && (isalpha((unsigned char) c) || c == '_')){
+                size_t begin = i;
+                while(i < expression.size() && (isalnum((unsigned char) expression[i]) || expression[i] == '_' || expression[i] == ':'))
+                    i++;
+                std::string variable = expression.substr(begin, i - begin);
+                size_t index = 0;
+                while(index < program->variables.size() && program->variables[index] != variable)
+                    index++;
+                if(index == program->variables.size())
+                    program->variables.push_back(variable);
+                program->ops.push_back({DERIVED_VARIABLE, (int) index, 0});
+                operand = false;
+            }
+            else if(operand && c == '-'){
+                operators.push_back('~');
+                i++;
+                continue;
+            }
+            else if(operand && c == '('){
+                operators.push_back('(');
+                i++;
+                continue;
+            }
+            else if(!operand && c == ')'){
+                while(!operators.empty() && operators.back() != '(')
+                    emit(operators.back()), operators.pop_back();
+                if(operators.empty())
+                    return fail("unbalanced parenthesis");
+                operators.pop_back();
+                i++;
+                continue;
+            }
+            else if(!operand && precedence(c) > 0 && c != '~'){
+                while(!operators.empty() && operators.back() != '(' && precedence(operators.back()) >= precedence(c))
+                    emit(operators.back()), operators.pop_back();
+                operators.push_back(c);
+                operand = true;
+                i++;
+                continue;
+            }
+            else
+                return fail("unexpected character at " + std::to_string(i));
+            depth++; // an operand was pushed
+            program->depth = std::max(program->depth, depth);
+        }
+        if(operand)
+            return fail("incomplete expression");
+        while(!operators.empty()){
+            if(operators.back() == '(')
+                return fail("unbalanced parenthesis");
+            emit(operators.back());
+            operators.pop_back();
+        }
+        return true;
+    }
+
+    bool DerivedMetrics::run(const DerivedProgram& program, const double* variables, double* stack, double* result) {
+        size_t top = 0;
+        for(const auto& op : program.ops){
+            switch(op.code){
+                case DERIVED_CONSTANT: stack[top++] = op.constant; break;
+                case DERIVED_VARIABLE: stack[top++] = variables[op.variable]; break;
+                case DERIVED_NEG: stack[top-1] = -stack[top-1]; break;
+                case DERIVED_ADD: top--; stack[top-1] += stack[top]; break;
+                case DERIVED_SUB: top--; stack[top-1] -= stack[top]; break;
+                case DERIVED_MUL: top--; stack[top-1] *= stack[top]; break;
+                case DERIVED_DIV: top--; stack[top-1] /= stack[top]; break;
+            }
+        }
+        *result = stack[0];
+        return std::isfinite(*result);
+    }
+
+    void DerivedMetrics::evaluate(Dump* dump) {
+        if(_programs.empty())
+            return;
+        std::vector<double> variables;
+        std::vector<double> stack;
+        std::vector<MetricId> released;
+        for(const auto& identifier : dump->getKeys()){
+            std::vector<MetricId>& metrics = _metrics[identifier.first];
+            metrics.resize(_programs.size(), -1);
+            for(size_t p = 0; p < _programs.size(); p++){
+                const DerivedProgram& program = _programs[p];
+                variables.resize(program.variables.size());
+                stack.resize(program.depth);
+                bool complete = true;
+                for(size_t v = 0; v < program.variables.size() && complete; v++){
+                    auto key = identifier.second.find(program.variables[v]);
+                    complete = key != identifier.second.end() && dump->get(key->second, &variables[v]);
+                }
+                double result;
+                if(!complete){
+                    if(metrics[p] >= 0) // e.g. the VM stopped, released once the iteration is over
+                        released.push_back(metrics[p]);
+                    metrics[p] = -1;
+                    continue;
+                }
+                if(!run(program, variables.data(), stack.data(), &result))
+                    continue;
+                if(metrics[p] < 0)
+                    metrics[p] = identifier.first.empty() ? dump->registerGlobalMetric(program.name, GAUGE, "Derived metric " + program.name)
+                        : dump->registerSpecificMetric(identifier.first, program.name, GAUGE, "Derived metric " + program.name);
+                dump->set(metrics[p], result);
+            }
+        }
+        for(auto id : released)
+            dump->releaseMetric(id);
+        // Identifiers without any series left
+        for(auto it = _metrics.begin(); it != _metrics.end();){
+            if(dump->getKeys().find(it->first) == dump->getKeys().end())
+                it = _metrics.erase(it);
+            else
+                ++it;
+        }
+    }
+
+}
@@ -0,0 +1,66 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include "dump.hpp"
+
+namespace server {
+
+	enum DerivedOpcode { DERIVED_CONSTANT, DERIVED_VARIABLE, DERIVED_ADD, DERIVED_SUB, DERIVED_MUL, DERIVED_DIV, DERIVED_NEG };
+
+	struct DerivedOp {
+		DerivedOpcode code;
+		int variable; // index in DerivedProgram::variables
+		double constant;
+	};
+
+	/**
+	 * An expression compiled to postfix order, evaluated with a stack of at most depth values
+	 */
+	struct DerivedProgram {
+		std::string name;
+		std::vector<std::string> variables; // keys of the series it reads, such as perf_hwinstructions
+		std::vector<DerivedOp> ops;
+		size_t depth = 0;
+	};
+
+	/**
+	 * Metrics computed from other series of a dump, configured as derived.[name]=[expression]
+	 * e.g. derived.ipc=perf_hwinstructions/perf_hwcpucycles or derived.sched_wait_share=sched_waittime/sched_runtime
+	 * Expressions support + - * / parenthesis and constants, they are compiled once and evaluated for the host and for each VM
+	 * whose series hold all their variables during the cycle, so that values all come from the same collection
+	 */
+	class DerivedMetrics {
+
+		private:
+
+		std::vector<DerivedProgram> _programs; // only those whose variables are all series of the collector
+		std::unordered_map<std::string, std::vector<MetricId>> _metrics; // id : identifier ("" for the host) = series of each program, -1 if not registered
+
+		static bool compile(const std::string& name, const std::string& expression, DerivedProgram* program);
+
+		static bool run(const DerivedProgram& program, const double* variables, double* stack, double* result);
+
+		public:
+
+		/**
+		 * Programs compiled from the configuration, shared by all instances
+		 */
+		static const std::vector<DerivedProgram>& programs();
+
+		/**
+		 * Programs evaluated on the series of a collector whose keys start with one of prefixes
+		 * A variable must match a prefix or be the name of an earlier program kept, all variables then come from the same collection
+		 */
+		DerivedMetrics(const std::vector<std::string>& prefixes);
+
+		bool derives(const std::string& name) const;
+
+		/**
+		 * Evaluate all programs on the series set during the current cycle of the dump, and set their results in it
+		 * A result which cannot be computed (missing series, division by zero) is not exported for this cycle
+		 */
+		void evaluate(Dump* dump);
+	};
+
+}
@@ -1,70 +1,382 @@
 #include "dump.hpp"
 #include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include "sink.hpp"
 #include "utils/log.hpp"
-#include <fstream>
 
 namespace server {
 
-    Dump::Dump(std::string prefix, std::string file) : _prefix(prefix), _file(file) {};
+    // Indexed by MetricType
+    static const char* const metricTypes[] = {" gauge", " counter", " histogram"};
 
-    void Dump::dump(){
-      std::ofstream stream(_file);
-      for(auto& kv : _map) {
-         stream << kv.first << " " << kv.second <<"\n"; 
+    SnapshotBuffer::SnapshotBuffer() : _front(0) {}
+
+    void SnapshotBuffer::publish(std::string* rendered){
+      int back = 1 - _front; // only the publishing thread changes _front
+      std::swap(_buffers[back], *rendered);
+      _mutex.lock();
+      _front = back;
+      _mutex.unlock();
+    }
+
+    void SnapshotBuffer::appendTo(std::string* output){
+      _mutex.lock();
+      output->append(_buffers[_front]);
+      _mutex.unlock();
+    }
+
+    Dump::Dump(std::string prefix, std::string file, bool sync, bool labels, bool self) : _prefix(prefix), _file(file), _tmpFile(file + ".tmp"),
+      _sync(sync), _labels(labels), _cycle(1) {
+      _renderMetric = _writeMetric = _errorMetric = -1;
+      // Latencies of a dump are exposed by the next one
+      if(self){
+         _renderMetric = registerGlobalMetric("dump_render_us", GAUGE, "Time spent rendering the previous exposition, in microseconds");
+         _writeMetric = registerGlobalMetric("dump_write_us", GAUGE, "Time spent writing the previous exposition to the endpoint file, in microseconds");
+         _errorMetric = registerGlobalMetric("dump_errors", COUNTER, "Failed writes of the endpoint file");
+      }
+      _renderLatency = _writeLatency = 0;
+      _errors = 0;
+    };
+
+    void Dump::dump(const std::vector<SnapshotBuffer*>& snapshots){
+      if(_renderMetric >= 0){
+         set(_renderMetric, _renderLatency);
+         set(_writeMetric, _writeLatency);
+         set(_errorMetric, _errors);
       }
-      stream.close();
+      auto begin = std::chrono::steady_clock::now();
+      render();
+      if(!_sinks.empty())
+         record();
+      for(auto snapshot : snapshots)
+         snapshot->appendTo(&_buffer);
+      auto rendered = std::chrono::steady_clock::now();
+      if(!_file.empty() && !write())
+         _errors++;
+      auto written = std::chrono::steady_clock::now();
+      _renderLatency = std::chrono::duration_cast<std::chrono::microseconds>(rendered - begin).count();
+      _writeLatency = std::chrono::duration_cast<std::chrono::microseconds>(written - rendered).count();
+    }
+
+    /**
+     * The exposition is written to a temporary file of the same directory then renamed over the endpoint,
+     * so that readers (e.g. node_exporter textfile collector) never see a partial file
+     */
+    bool Dump::write(){
+      int fd = open(_tmpFile.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+      if(fd < 0){
+         utils::logging::error("Dump::write unable to open", _tmpFile, strerror(errno));
+         return false;
+      }
+      const char* data = _buffer.data();
+      size_t remaining = _buffer.size();
+      while(remaining > 0){ // a single call unless interrupted
+         ssize_t written = ::write(fd, data, remaining);
+         if(written < 0 && errno == EINTR)
+            continue;
+         if(written < 0){
+            utils::logging::error("Dump::write unable to write", _tmpFile, strerror(errno));
+            ::close(fd);
+            unlink(_tmpFile.c_str());
+            return false;
+         }
+         data += written;
+         remaining -= written;
+      }
+      if(_sync && fdatasync(fd) < 0)
+         utils::logging::warn("Dump::write fdatasync failed on", _tmpFile, strerror(errno));
+      ::close(fd);
+      if(rename(_tmpFile.c_str(), _file.c_str()) < 0){
+         utils::logging::error("Dump::write unable to rename", _tmpFile, strerror(errno));
+         unlink(_tmpFile.c_str());
+         return false;
+      }
+      return true;
+    }
+
+    void Dump::renderValue(MetricId id){
+      char number[32];
+      const MetricValue& v = _values[id];
+      std::to_chars_result result;
+      switch(v.type) {
+         case MetricValue::SIGNED:
+            result = std::to_chars(number, number + sizeof(number), v.i);
+            break;
+         case MetricValue::UNSIGNED:
+            result = std::to_chars(number, number + sizeof(number), v.u);
+            break;
+         default:
+            result = std::to_chars(number, number + sizeof(number), v.d);
+            break;
+      }
+      _buffer.append(_names[id]);
+      _buffer.push_back(' ');
+      _buffer.append(number, result.ptr);
+      _buffer.push_back('\n');
+    }
+
+    void Dump::render(){
+      _buffer.clear();
+      if(!_labels){
+         for(size_t id = 0; id < _names.size(); id++)
+            if(_cycles[id] == _cycle)
+               renderValue(id);
+         return;
+      }
+      // Series of a family must be contiguous and follow its metadata
+      for(const auto& family : _families) {
+         bool header = false;
+         for(auto id : family.series) {
+            if(_cycles[id] != _cycle)
+               continue;
+            if(!header) {
+               if(!family.help.empty())
+                  _buffer.append("# HELP ").append(family.name).append(" ").append(family.help).push_back('\n');
+               _buffer.append("# TYPE ").append(family.name).append(metricTypes[family.type]).push_back('\n');
+               header = true;
+            }
+            renderValue(id);
+         }
+      }
+    }
+
+    const std::string& Dump::getBuffer(){
+      return _buffer;
+    }
+
+    void Dump::swapBuffer(std::string* buffer){
+      std::swap(_buffer, *buffer);
     }
 
     void Dump::clear(){
-      this -> _map.clear();
+      this -> _cycle++;
     }
 
-   void Dump::addGlobalMetric(std::string key, int value){
-      this-> addGlobalMetric(key, std::to_string(value));
+   MetricId Dump::registerGlobalMetric(const std::string& key, MetricType type, const std::string& help){
+      return this-> indexKey(this-> registerMetric(_prefix + "_global_" + key, "", "", type, help), "", key);
    }
 
-   void Dump::addGlobalMetric(std::string key, long long value){
-      this-> addGlobalMetric(key, std::to_string(value));
+   MetricId Dump::registerGlobalMetric(const std::string& key, const std::string& label, const std::string& value, MetricType type, const std::string& help){
+      if(_labels)
+         return this-> registerMetric(_prefix + "_global_" + key, "", "{" + label + "=\"" + escapeLabel(value) + "\"}", type, help);
+      return this-> registerMetric(_prefix + "_global_" + key + '_' + sanitizeName(value), "", "", type, help);
    }
 
-   void Dump::addGlobalMetric(std::string key, unsigned long value){
-      this-> addGlobalMetric(key, std::to_string(value));
+   MetricId Dump::registerSpecificMetric(const std::string& identifier, const std::string& key, MetricType type, const std::string& help){
+      if(_labels)
+         return this-> indexKey(this-> registerMetric(_prefix + "_domain_" + key, "", "{domain=\"" + escapeLabel(identifier) + "\"}", type, help),
+            identifier, key);
+      return this-> indexKey(this-> registerMetric(_prefix + "_domain_" + sanitizeName(identifier) + '_' + key, "", "", type, help), identifier, key);
    }
 
-   void Dump::addGlobalMetric(std::string key, unsigned long long value){
-      this-> addGlobalMetric(key, std::to_string(value));
+   MetricId Dump::indexKey(MetricId id, const std::string& identifier, const std::string& key){
+      if(_seriesKeys[id].second.empty()){
+         _seriesKeys[id] = {identifier, key};
+         _keyIds[identifier][key] = id;
+      }
+      return id;
    }
 
-   void Dump::addGlobalMetric(std::string key, std::string value){
-      this-> addMetric("global_" + key, value);
+   MetricId Dump::registerSpecificMetric(const std::string& identifier, const std::string& key, const std::string& label,
+      const std::string& value, MetricType type, const std::string& help){
+      if(_labels)
+         return this-> registerMetric(_prefix + "_domain_" + key, "",
+            "{domain=\"" + escapeLabel(identifier) + "\"," + label + "=\"" + escapeLabel(value) + "\"}", type, help);
+      return this-> registerMetric(_prefix + "_domain_" + sanitizeName(identifier) + '_' + key + '_' + sanitizeName(value), "", "", type, help);
    }
 
-   void Dump::addSpecificMetric(std::string identifier, std::string key, unsigned short value){
-      this-> addSpecificMetric(identifier, key, std::to_string(value));
+   std::string Dump::sanitizeName(const std::string& name){
+      std::string sanitized;
+      for(char c : name)
+         if(isalnum((unsigned char) c) || c == '_' || c == ':')
+            sanitized.push_back(c);
+      return sanitized;
    }
 
-   void Dump::addSpecificMetric(std::string identifier, std::string key, int value){
-      this-> addSpecificMetric(identifier, key, std::to_string(value));
+   std::string Dump::escapeLabel(const std::string& value){
+      std::string escaped;
+      for(char c : value) {
+         if(c == '\\' || c == '"')
+            escaped.push_back('\\');
+         if(c == '\n')
+            escaped.append("\\n");
+         else
+            escaped.push_back(c);
+      }
+      return escaped;
    }
 
-   void Dump::addSpecificMetric(std::string identifier, std::string key, long long value){
-      this-> addSpecificMetric(identifier, key, std::to_string(value));
+   void Dump::registerHistogram(const std::string& identifier, const std::string& key, const std::vector<double>& bounds,
+      const std::string& help, MetricHistogram* histogram, const std::string& label, const std::string& value){
+      std::string family;
+      std::string labels; // without braces, le is appended
+      if(identifier.empty())
+         family = _prefix + "_global_" + key;
+      else if(_labels){
+         family = _prefix + "_domain_" + key;
+         labels = "domain=\"" + escapeLabel(identifier) + "\",";
+      }
+      else
+         family = _prefix + "_domain_" + sanitizeName(identifier) + '_' + key;
+      if(!label.empty() && _labels)
+         labels += label + "=\"" + escapeLabel(value) + "\",";
+      else if(!label.empty())
+         family += '_' + sanitizeName(value);
+      histogram->bounds = bounds;
+      histogram->counts.assign(bounds.size() + 1, 0);
+      histogram->ids.clear();
+      for(size_t i = 0; i <= bounds.size(); i++){
+         std::string le = "+Inf";
+         if(i < bounds.size()){
+            char number[32];
+            le.assign(number, std::to_chars(number, number + sizeof(number), bounds[i], std::chars_format::fixed).ptr);
+         }
+         if(_labels)
+            histogram->ids.push_back(registerMetric(family, "_bucket", "{" + labels + "le=\"" + le + "\"}", HISTOGRAM, help));
+         else
+            histogram->ids.push_back(registerMetric(family, "_bucket_" + (i < bounds.size() ? sanitizeName(le) : "inf"), "", HISTOGRAM, help));
+      }
+      if(!labels.empty())
+         labels = "{" + labels.substr(0, labels.size() - 1) + "}";
+      histogram->ids.push_back(registerMetric(family, "_sum", labels, HISTOGRAM, help));
+      histogram->ids.push_back(registerMetric(family, "_count", labels, HISTOGRAM, help));
+   }
+
+   void Dump::set(const MetricHistogram& histogram){
+      unsigned long long cumulative = 0;
+      for(size_t i = 0; i < histogram.counts.size(); i++){
+         cumulative += histogram.counts[i];
+         set(histogram.ids[i], cumulative);
+      }
+      set(histogram.ids[histogram.counts.size()], histogram.sum);
+      set(histogram.ids[histogram.counts.size() + 1], histogram.count);
+   }
+
+   void Dump::releaseHistogram(MetricHistogram* histogram){
+      for(auto id : histogram->ids)
+         releaseMetric(id);
+      histogram->ids.clear();
+   }
+
+   void MetricHistogram::observe(double value){
+      size_t bucket = std::lower_bound(bounds.begin(), bounds.end(), value) - bounds.begin(); // le is inclusive
+      counts[bucket]++;
+      sum += value;
+      count++;
+   }
+
+   MetricId Dump::registerMetric(const std::string& family, const std::string& suffix, const std::string& labels, MetricType type, const std::string& help){
+      std::string name = family + suffix + labels;
+      auto it = _ids.find(name);
+      if(it != _ids.end()){
+         _refs[it->second]++;
+         return it->second;
+      }
+      MetricId id;
+      if(!_free.empty()){
+         id = _free.back();
+         _free.pop_back();
+         _names[id] = name;
+      }
+      else{
+         id = _names.size();
+         _names.push_back(name);
+         _values.emplace_back();
+         _cycles.push_back(0);
+         _refs.push_back(0);
+         _seriesFamily.push_back(-1);
+         _seriesKeys.emplace_back();
+         _types.push_back(GAUGE);
+         for(auto& columns : _sinkColumns)
+            columns.push_back(-1);
+      }
+      _cycles[id] = 0;
+      _types[id] = type;
+      _refs[id] = 1;
+      _ids[name] = id;
+      if(_labels){
+         auto familyId = _familyIds.find(family);
+         if(familyId == _familyIds.end()){
+            familyId = _familyIds.insert({family, (int) _families.size()}).first;
+            _families.push_back({family, help, type, {}});
+         }
+         _families[familyId->second].series.push_back(id);
+         _seriesFamily[id] = familyId->second;
+      }
+      return id;
+   }
+
+   void Dump::releaseMetric(MetricId id){
+      if(id < 0 || (size_t) id >= _refs.size() || _refs[id] == 0)
+         return;
+      if(--_refs[id] > 0)
+         return;
+      _ids.erase(_names[id]);
+      _names[id].clear();
+      if(_seriesFamily[id] >= 0){
+         auto& series = _families[_seriesFamily[id]].series;
+         series.erase(std::find(series.begin(), series.end(), id));
+         _seriesFamily[id] = -1;
+      }
+      if(!_seriesKeys[id].second.empty()){
+         auto keys = _keyIds.find(_seriesKeys[id].first);
+         keys->second.erase(_seriesKeys[id].second);
+         if(keys->second.empty())
+            _keyIds.erase(keys);
+         _seriesKeys[id] = {};
+      }
+      for(size_t s = 0; s < _sinks.size(); s++){
+         if(_sinkColumns[s][id] >= 0)
+            _sinks[s]->sinkRelease(_sinkColumns[s][id]);
+         _sinkColumns[s][id] = -1;
+      }
+      _cycles[id] = 0;
+      _free.push_back(id);
+   }
+
+   const std::map<std::string, std::unordered_map<std::string, MetricId>>& Dump::getKeys(){
+      return _keyIds;
    }
 
-   void Dump::addSpecificMetric(std::string identifier, std::string key, unsigned long value){
-      this-> addSpecificMetric(identifier, key, std::to_string(value));
+   void Dump::addSink(SeriesSink* sink){
+      _sinks.push_back(sink);
+      _sinkColumns.emplace_back(_names.size(), -1);
    }
 
-   void Dump::addSpecificMetric(std::string identifier, std::string key, unsigned long long value){
-      this-> addSpecificMetric(identifier, key, std::to_string(value));
+   void Dump::record(){
+      for(size_t s = 0; s < _sinks.size(); s++){
+         std::vector<int>& columns = _sinkColumns[s];
+         _sinkCells.clear();
+         for(size_t id = 0; id < _names.size(); id++){
+            if(_cycles[id] != _cycle)
+               continue;
+            if(columns[id] == -1){
+               int column = _sinks[s]->sinkColumn(_names[id]);
+               columns[id] = column >= 0 ? column : -2;
+            }
+            if(columns[id] >= 0)
+               _sinkCells.push_back({columns[id], _values[id]});
+         }
+         _sinks[s]->sinkWrite(_sinkCells);
+      }
    }
 
-   void Dump::addSpecificMetric(std::string identifier, std::string key, std::string value){
-      this-> addMetric("domain_" + identifier + '_' + key, value);
+   MetricType Dump::getType(MetricId id){
+      return _types[id];
    }
 
-   inline void Dump::addMetric(std::string key, std::string value){
-      this -> _map.insert({_prefix + "_" + key, value});
-   }   
+   bool Dump::get(MetricId id, double* value){
+      if(_cycles[id] != _cycle)
+         return false;
+      const MetricValue& v = _values[id];
+      *value = v.type == MetricValue::SIGNED ? (double) v.i : v.type == MetricValue::UNSIGNED ? (double) v.u : v.d;
+      return true;
+   }
 
-}
\ No newline at end of file
+}
@@ -1,49 +1,258 @@
 #include <unordered_map>
+#include <map>
 #include <string>
+#include <vector>
+#include <type_traits>
+#include "utils/mutex.hpp"
 #pragma once
 
 namespace server {
 
+    class SeriesSink;
+
+    /**
+     * Stable handle on a registered series
+     */
+    typedef int MetricId;
+
+    /**
+     * Exposed in label mode as # TYPE, counters only grow between two restarts of their source
+     */
+    enum MetricType { GAUGE, COUNTER, HISTOGRAM };
+
+    /**
+     * A value kept as it was given, so that 64 bits counters are not rounded
+     */
+    struct MetricValue {
+        enum { SIGNED, UNSIGNED, REAL } type;
+        union {
+            long long i;
+            unsigned long long u;
+            double d;
+        };
+    };
+
+    /**
+     * Cumulative histogram, exposed as Prometheus _bucket/_sum/_count series
+     * Observations are kept here, Dump::set(histogram) copies them to its series
+     */
+    struct MetricHistogram {
+        std::vector<double> bounds; // upper bounds, sorted, +Inf is implicit
+        std::vector<unsigned long long> counts; // per bucket, not cumulative
+        double sum = 0;
+        unsigned long long count = 0;
+        std::vector<MetricId> ids; // buckets (+Inf last), sum, count
+
+        void observe(double value);
+    };
+
+    /**
+     * Series sharing a name in label mode, rendered together under a single HELP/TYPE header
+     */
+    struct MetricFamily {
+        std::string name;
+        std::string help;
+        MetricType type;
+        std::vector<MetricId> series;
+    };
+
+    /**
+     * Double buffered rendering of a collector, written by its thread and read by the renderer
+     * The collector renders into the back buffer then flips it, the renderer always reads the last complete rendering
+     */
+    class SnapshotBuffer {
+
+        private:
+
+        std::string _buffers[2];
+        int _front;
+        utils::mutex _mutex; // protect _front and the front buffer
+
+        public:
+
+        SnapshotBuffer();
+
+        /**
+         * Exchange rendered with the back buffer and make it the front one, rendered gets the previous back buffer to be reused
+         */
+        void publish(std::string* rendered);
+
+        void appendTo(std::string* output);
+    };
+
+    /**
+     * Series are registered once and get a MetricId, values are then stored in a contiguous array
+     * Names are only rendered at registration, output is built in a buffer reused at each dump
+     * Two naming modes are supported:
+     * - names (default) : the VM is part of the name, prefix_domain_[vm]_[key]
+     * - labels : the VM is a label, prefix_domain_[key]{domain="[vm]"}, series are grouped in families
+     */
     class Dump {
 
         private:
 
-        std::unordered_map<std::string, std::string> _map;
         std::string _prefix;
         std::string _file;
+        std::string _tmpFile; // same directory as _file, so that rename is atomic
+        bool _sync;
+        bool _labels;
+
+        // Registry, indexed by MetricId
+        std::vector<std::string> _names; // full metric name
+        std::vector<MetricValue> _values;
+        std::vector<unsigned long long> _cycles; // cycle of the last set, only series set during the current cycle are dumped
+        std::vector<MetricType> _types;
+        std::vector<int> _refs;
+        std::vector<MetricId> _free;
+        std::unordered_map<std::string, MetricId> _ids; // id = full name, only used at registration
+        std::unordered_map<std::string, MetricId> _globalIds; // id = key, used by addGlobalMetric
+        std::vector<int> _seriesFamily; // indexed by MetricId, index in _families, label mode only
+        std::vector<std::pair<std::string, std::string>> _seriesKeys; // indexed by MetricId, identifier and key of series registered without label
+        std::map<std::string, std::unordered_map<std::string, MetricId>> _keyIds; // id = identifier ("" for global series), then key
+        std::vector<MetricFamily> _families; // never removed, bounded by the number of keys
+        std::unordered_map<std::string, int> _familyIds; // id = family name
+        unsigned long long _cycle;
+
+        std::string _buffer;
+
+        // Optional sinks (history, binary export), each series set during a cycle is written to its column when the dump is rendered
+        std::vector<SeriesSink*> _sinks;
+        std::vector<std::vector<int>> _sinkColumns; // per sink, indexed by MetricId, -1 if not looked up yet, -2 if not recorded
+        std::vector<std::pair<int, MetricValue>> _sinkCells;
+
+        // Self monitoring, in microseconds, only registered if the dump is the one written
+        MetricId _renderMetric, _writeMetric, _errorMetric;
+        long long _renderLatency, _writeLatency;
+        unsigned long long _errors;
+
+        MetricId registerMetric(const std::string& family, const std::string& suffix, const std::string& labels, MetricType type, const std::string& help);
+
+        MetricId indexKey(MetricId id, const std::string& identifier, const std::string& key);
+
+        /**
+         * Name mode only, drop characters that are not valid in a metric name (e.g. dashes in VM names)
+         */
+        static std::string sanitizeName(const std::string& name);
+
+        static std::string escapeLabel(const std::string& value);
 
-        void addMetric(std::string key, std::string value);
+        void renderValue(MetricId id);
+
+        void record();
+
+        void render();
+
+        bool write();
 
         public:
 
-        Dump(std::string prefix, std::string file);
+        /**
+         * An empty file disables the textfile output. If sync is set, the temporary file is flushed with fdatasync before being renamed over file
+         * If labels is set, VMs are exposed as labels instead of being part of metric names
+         * Without self monitoring, no dump_* series are registered (dumps of collectors, appended to the main one)
+         */
+        Dump(std::string prefix, std::string file, bool sync = false, bool labels = false, bool self = true);
+
+        /**
+         * Render registered series followed by the given snapshots and write them to file, if any
+         * Snapshots must not share a family with this dump or with each other
+         */
+        void dump(const std::vector<SnapshotBuffer*>& snapshots = {});
+
+        /**
+         * Write the series of each following dump to sink, it must outlive the dump
+         */
+        void addSink(SeriesSink* sink);
 
-        void dump();
+        /**
+         * Output of the last dump
+         */
+        const std::string& getBuffer();
 
+        /**
+         * Exchange the output of the last dump with buffer, so that it is published without a copy
+         */
+        void swapBuffer(std::string* buffer);
+
+        /**
+         * Start a new cycle, series that are not set again will not be dumped
+         */
         void clear();
 
-        void addGlobalMetric(std::string key, int value);
+        MetricId registerGlobalMetric(const std::string& key, MetricType type = GAUGE, const std::string& help = "");
+
+        /**
+         * Global series with a label, only its value is appended to the name in name mode (prefix_global_[key]_[value])
+         */
+        MetricId registerGlobalMetric(const std::string& key, const std::string& label, const std::string& value,
+            MetricType type = GAUGE, const std::string& help = "");
+
+        /**
+         * Identifier is the raw VM name, it is sanitized or escaped depending on the mode
+         */
+        MetricId registerSpecificMetric(const std::string& identifier, const std::string& key, MetricType type = GAUGE, const std::string& help = "");
+
+        /**
+         * Same with an additional label, only its value is appended to the name in name mode (prefix_domain_[vm]_[key]_[value])
+         */
+        MetricId registerSpecificMetric(const std::string& identifier, const std::string& key, const std::string& label,
+            const std::string& value, MetricType type = GAUGE, const std::string& help = "");
 
-        void addGlobalMetric(std::string key, long long value);
-    
-        void addGlobalMetric(std::string key, unsigned long value);
+        /**
+         * Register the series of a histogram, global if identifier is empty, with an optional additional label
+         * In name mode the bucket bound is part of the name (prefix_global_[key]_bucket_[bound]), so prefer integer bounds
+         */
+        void registerHistogram(const std::string& identifier, const std::string& key, const std::vector<double>& bounds,
+            const std::string& help, MetricHistogram* histogram, const std::string& label = "", const std::string& value = "");
 
-        void addGlobalMetric(std::string key, unsigned long long value);
+        void set(const MetricHistogram& histogram);
 
-        void addGlobalMetric(std::string key, std::string value);
+        void releaseHistogram(MetricHistogram* histogram);
 
-        void addSpecificMetric(std::string identifier, std::string key, std::string value);
+        /**
+         * Release a registered series, its id may be reused by a later registration
+         */
+        void releaseMetric(MetricId id);
 
-        void addSpecificMetric(std::string identifier, std::string key, unsigned short value);
+        /**
+         * Series registered without label, by identifier ("" for global series) then key
+         */
+        const std::map<std::string, std::unordered_map<std::string, MetricId>>& getKeys();
 
-        void addSpecificMetric(std::string identifier, std::string key, int value);
+        MetricType getType(MetricId id);
 
-        void addSpecificMetric(std::string identifier, std::string key, long long value);
+        /**
+         * Value of a series, false if it was not set during the current cycle
+         */
+        bool get(MetricId id, double* value);
 
-        void addSpecificMetric(std::string identifier, std::string key, unsigned long value);
+        template <typename T>
+        void set(MetricId id, T value) {
+            MetricValue& v = _values[id];
+            if constexpr (std::is_floating_point<T>::value) {
+                v.type = MetricValue::REAL;
+                v.d = value;
+            } else if constexpr (std::is_signed<T>::value) {
+                v.type = MetricValue::SIGNED;
+                v.i = value;
+            } else {
+                v.type = MetricValue::UNSIGNED;
+                v.u = value;
+            }
+            _cycles[id] = _cycle;
+        }
 
-        void addSpecificMetric(std::string identifier, std::string key, unsigned long long value);
+        /**
+         * Convenience for the few host wide series, looked up by key at each call
+         */
+        template <typename T>
+        void addGlobalMetric(const std::string& key, T value) {
+            auto it = _globalIds.find(key);
+            if (it == _globalIds.end())
+                it = _globalIds.insert({key, registerGlobalMetric(key)}).first;
+            set(it->second, value);
+        }
 
     };
 
-}
\ No newline at end of file
+}
@@ -0,0 +1,151 @@
+#include "export.hpp"
+#include <algorithm>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "utils/log.hpp"
+
+namespace server {
+
+    SegmentExport::SegmentExport() : _segmentSize(0), _fd(-1), _written(0), _ids(0), _rowNumber(0), _rowTimestamp(0) {}
+
+    SegmentExport::~SegmentExport() {
+        exportClose();
+    }
+
+    bool SegmentExport::exportOpen(const std::string& directory, size_t segmentSize) {
+        struct stat st;
+        if(stat(directory.c_str(), &st) < 0 || !S_ISDIR(st.st_mode)){
+            utils::logging::error("SegmentExport::exportOpen", directory, "is not a directory");
+            return false;
+        }
+        _mutex.lock();
+        _directory = directory;
+        _segmentSize = std::max((size_t) 1, segmentSize);
+        _mutex.unlock();
+        utils::logging::info("Binary export of all series in", directory, "segments of", _segmentSize >> 20, "MB");
+        return true;
+    }
+
+    bool SegmentExport::openSegment(int64_t timestamp) {
+        std::string path = _directory + "/vmprobe-" + std::to_string(timestamp) + ".seg";
+        _fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+        if(_fd < 0){
+            utils::logging::error("SegmentExport::openSegment cannot open", path, strerror(errno));
+            return false;
+        }
+        _written = 0;
+        _encoder.encoderReset(&_buffer);
+        return true;
+    }
+
+    void SegmentExport::closeSegment() {
+        if(_fd >= 0)
+            close(_fd);
+        _fd = -1;
+    }
+
+    void SegmentExport::flushRow() {
+        _cells.clear();
+        for(size_t id = 0; id < _rowSet.size(); id++)
+            if(_rowSet[id] == _rowNumber)
+                _cells.push_back({(int) id, _row[id]});
+        if(_cells.empty())
+            return;
+        _buffer.clear();
+        if(_fd < 0 && !openSegment(_rowTimestamp))
+            return;
+        _encoder.encoderBlock(_rowTimestamp, _cells, &_buffer);
+        for(size_t done = 0; done < _buffer.size();){
+            ssize_t count = write(_fd, _buffer.data() + done, _buffer.size() - done);
+            if(count < 0 && errno == EINTR)
+                continue;
+            if(count < 0){
+                // The block may be partially written, the segment is ended there and the next row starts a new one
+                utils::logging::error("SegmentExport::flushRow write failed", strerror(errno));
+                closeSegment();
+                return;
+            }
+            done += count;
+        }
+        _written += _buffer.size();
+        if(_written >= _segmentSize)
+            closeSegment();
+    }
+
+    void SegmentExport::sinkBeginRow(int64_t timestamp) {
+        _mutex.lock();
+        if(_directory.empty()){
+            _mutex.unlock();
+            return;
+        }
+        if(_rowNumber > 0)
+            flushRow();
+        _free.insert(_free.end(), _released.begin(), _released.end());
+        _released.clear();
+        _rowNumber++;
+        _rowTimestamp = timestamp;
+        _mutex.unlock();
+    }
+
+    int SegmentExport::sinkColumn(const std::string& name) {
+        _mutex.lock();
+        if(_directory.empty()){
+            _mutex.unlock();
+            return -1;
+        }
+        int id;
+        if(!_free.empty()){
+            id = _free.back();
+            _free.pop_back();
+        }
+        else{
+            id = _ids++;
+            _row.emplace_back();
+            _rowSet.push_back(0);
+        }
+        _rowSet[id] = 0;
+        _encoder.encoderDefine(id, name);
+        _mutex.unlock();
+        return id;
+    }
+
+    void SegmentExport::sinkRelease(int column) {
+        if(column < 0)
+            return;
+        _mutex.lock();
+        if(!_directory.empty())
+            _released.push_back(column);
+        _mutex.unlock();
+    }
+
+    void SegmentExport::sinkWrite(const std::vector<std::pair<int, MetricValue>>& cells) {
+        _mutex.lock();
+        if(_directory.empty() || _rowNumber == 0){
+            _mutex.unlock();
+            return;
+        }
+        for(const auto& cell : cells){
+            _row[cell.first] = cell.second;
+            _rowSet[cell.first] = _rowNumber;
+        }
+        _mutex.unlock();
+    }
+
+    void SegmentExport::exportClose() {
+        _mutex.lock();
+        if(_directory.empty()){
+            _mutex.unlock();
+            return;
+        }
+        if(_rowNumber > 0)
+            flushRow();
+        _rowNumber = 0;
+        closeSegment();
+        _directory.clear();
+        _mutex.unlock();
+    }
+
+}
@@ -0,0 +1,74 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include "sink.hpp"
+#include "segment.hpp"
+#include "utils/mutex.hpp"
+
+namespace server {
+
+	/**
+	 * Binary export of every series produced, one block per read session appended to rotating segment files
+	 * Cells written by the dumps during a session are kept in a row, encoded and written with a single syscall when the next one begins
+	 * Segments are named vmprobe-[epoch_ms].seg after their first block, a new one is started once segmentSize bytes are written
+	 */
+	class SegmentExport : public SeriesSink {
+
+		private:
+
+		std::string _directory;
+		size_t _segmentSize;
+		int _fd; // -1 between two segments
+		size_t _written; // in the current segment
+		SegmentEncoder _encoder;
+		std::vector<uint8_t> _buffer;
+
+		utils::mutex _mutex; // protect the directory, the row and the ids, dumps are rendered by several threads
+		int _ids; // allocated
+		std::vector<int> _released; // ids of series released during the current row, their last cells are still to be written
+		std::vector<int> _free; // ids of released series whose last row was written
+		std::vector<MetricValue> _row; // by id
+		std::vector<uint64_t> _rowSet; // by id, last row it was written in
+		uint64_t _rowNumber; // 0 before the first row
+		int64_t _rowTimestamp;
+		std::vector<std::pair<int, MetricValue>> _cells;
+
+		bool openSegment(int64_t timestamp);
+
+		void closeSegment();
+
+		/**
+		 * Encode and write the current row, the mutex is held
+		 */
+		void flushRow();
+
+		public:
+
+		SegmentExport();
+
+		~SegmentExport();
+
+		/**
+		 * Segments are written in directory, which must exist, segmentSize in bytes
+		 */
+		bool exportOpen(const std::string& directory, size_t segmentSize);
+
+		void sinkBeginRow(int64_t timestamp) override;
+
+		int sinkColumn(const std::string& name) override;
+
+		/**
+		 * The id is reused once the current row is written, so that the last cell of the series is kept
+		 */
+		void sinkRelease(int column) override;
+
+		void sinkWrite(const std::vector<std::pair<int, MetricValue>>& cells) override;
+
+		/**
+		 * Write the pending row and close the current segment
+		 */
+		void exportClose();
+	};
+
+}
@@ -0,0 +1,171 @@
+#include "history.hpp"
+#include <cmath>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "utils/log.hpp"
+
+namespace server {
+
+    static size_t pageAlign(size_t size) {
+        return (size + HISTORY_PAGE - 1) / HISTORY_PAGE * HISTORY_PAGE;
+    }
+
+    size_t History::indexOffset() {
+        return HISTORY_PAGE;
+    }
+
+    size_t History::timestampsOffset(uint64_t columns) {
+        return pageAlign(indexOffset() + columns * sizeof(HistorySeries));
+    }
+
+    size_t History::valuesOffset(uint64_t rows, uint64_t columns) {
+        return pageAlign(timestampsOffset(columns) + rows * sizeof(int64_t));
+    }
+
+    History::History() : _fd(-1), _map(nullptr), _size(0), _header(nullptr), _series(nullptr), _timestamps(nullptr), _values(nullptr),
+        _row(0), _full(false) {}
+
+    History::~History() {
+        historyClose();
+    }
+
+    bool History::historyOpen(const std::string& path, int hours, int delay, int series) {
+        uint64_t rows = std::max(1LL, (long long) hours * 3600 * 1000 / std::max(1, delay));
+        uint64_t columns = std::max(1, series);
+        _size = valuesOffset(rows, columns) + rows * columns * sizeof(double);
+        _fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if(_fd < 0){
+            utils::logging::error("History::historyOpen cannot open", path, strerror(errno));
+            return false;
+        }
+        // Keep the history of a previous run if the geometry did not change
+        HistoryHeader previous;
+        struct stat st;
+        bool reuse = fstat(_fd, &st) == 0 && (size_t) st.st_size == _size && pread(_fd, &previous, sizeof(previous), 0) == sizeof(previous)
+            && previous.magic == HISTORY_MAGIC && previous.version == HISTORY_VERSION && previous.rows == rows && previous.columns == columns
+            && previous.delay == (uint64_t) delay;
+        if(!reuse && (ftruncate(_fd, 0) < 0 || ftruncate(_fd, _size) < 0)){ // sparse, pages are allocated as rows are written
+            utils::logging::error("History::historyOpen cannot size", path, "to", _size, "bytes", strerror(errno));
+            historyClose();
+            return false;
+        }
+        _map = (uint8_t*) mmap(nullptr, _size, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+        if(_map == MAP_FAILED){
+            _map = nullptr;
+            utils::logging::error("History::historyOpen cannot map", path, strerror(errno));
+            historyClose();
+            return false;
+        }
+        _header = (HistoryHeader*) _map;
+        _series = (HistorySeries*) (_map + indexOffset());
+        _timestamps = (int64_t*) (_map + timestampsOffset(columns));
+        _values = (double*) (_map + valuesOffset(rows, columns));
+        _claimed.assign(columns, false);
+        if(reuse){
+            for(uint64_t c = 0; c < columns; c++)
+                if(_series[c].name[0] != '\0')
+                    _columns[std::string(_series[c].name, strnlen(_series[c].name, HISTORY_NAME_SIZE))] = c;
+        }
+        else{
+            _header->magic = HISTORY_MAGIC;
+            _header->version = HISTORY_VERSION;
+            _header->rows = rows;
+            _header->columns = columns;
+            _header->delay = delay;
+            _header->head = 0;
+        }
+        _row = _header->head;
+        utils::logging::info("History of", rows, "rows and", columns, "series in", path, "(" + std::to_string(_size >> 20) + " MB)",
+            reuse ? "resumed at row " + std::to_string(_header->head) : "created");
+        return true;
+    }
+
+    void History::sinkBeginRow(int64_t timestamp) {
+        if(_map == nullptr)
+            return;
+        uint64_t rows = _header->rows;
+        _mutex.lock();
+        _row = _header->head;
+        uint64_t row = _row % rows;
+        _timestamps[row] = timestamp;
+        for(uint64_t c = 0; c < _header->columns; c++)
+            _values[c * rows + row] = NAN;
+        // Published once its cells are reset, readers never see values of the row it overwrites
+        __atomic_store_n(&_header->head, _row + 1, __ATOMIC_RELEASE);
+        _mutex.unlock();
+    }
+
+    int History::sinkColumn(const std::string& name) {
+        if(_map == nullptr)
+            return -1;
+        if(name.size() >= HISTORY_NAME_SIZE){ // a truncated name could be confused with another series
+            utils::logging::error("History::sinkColumn", name, "is not recorded, history names are limited to", HISTORY_NAME_SIZE - 1, "characters");
+            return -1;
+        }
+        _mutex.lock();
+        int column = -1;
+        auto it = _columns.find(name);
+        if(it != _columns.end() && !_claimed[it->second])
+            column = it->second; // resumed from a previous run, or released then registered again
+        else{
+            for(uint64_t c = 0; c < _header->columns && column < 0; c++){
+                HistorySeries& series = _series[c];
+                bool expired = series.name[0] != '\0' && !_claimed[c] && series.last + _header->rows < _header->head;
+                if(series.name[0] == '\0' || expired){
+                    if(expired)
+                        _columns.erase(std::string(series.name, strnlen(series.name, HISTORY_NAME_SIZE)));
+                    memset(series.name, 0, HISTORY_NAME_SIZE);
+                    memcpy(series.name, name.data(), name.size());
+                    series.since = _row;
+                    series.last = _row;
+                    column = c;
+                    _columns[name] = c;
+                }
+            }
+            if(column < 0 && !_full){
+                utils::logging::warn("History::sinkColumn all", _header->columns, "columns are in use, increase historyseries to record", name);
+                _full = true;
+            }
+        }
+        if(column >= 0)
+            _claimed[column] = true;
+        _mutex.unlock();
+        return column;
+    }
+
+    void History::sinkRelease(int column) {
+        if(_map == nullptr || column < 0)
+            return;
+        _mutex.lock();
+        _claimed[column] = false;
+        _mutex.unlock();
+    }
+
+    void History::sinkWrite(const std::vector<std::pair<int, MetricValue>>& cells) {
+        if(_map == nullptr || _header->head == 0)
+            return;
+        uint64_t rows = _header->rows;
+        _mutex.lock();
+        uint64_t row = _row % rows;
+        for(const auto& cell : cells){
+            const MetricValue& v = cell.second;
+            _values[cell.first * rows + row] = v.type == MetricValue::SIGNED ? (double) v.i : v.type == MetricValue::UNSIGNED ? (double) v.u : v.d;
+            _series[cell.first].last = _row;
+        }
+        _mutex.unlock();
+    }
+
+    void History::historyClose() {
+        if(_map != nullptr)
+            munmap(_map, _size);
+        if(_fd >= 0)
+            close(_fd);
+        _map = nullptr;
+        _fd = -1;
+    }
+
+}
@@ -0,0 +1,102 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <stdint.h>
+#include "sink.hpp"
+#include "utils/mutex.hpp"
+
+#define HISTORY_MAGIC 0x48504d56 // VMPH
+#define HISTORY_VERSION 1
+#define HISTORY_PAGE 4096
+#define HISTORY_NAME_SIZE 240
+
+namespace server {
+
+	/**
+	 * First page of a history file
+	 */
+	struct HistoryHeader {
+		uint32_t magic;
+		uint32_t version;
+		uint64_t rows; // capacity of the ring
+		uint64_t columns; // capacity of the series index
+		uint64_t delay; // in ms, between two rows
+		uint64_t head; // rows written since the file was created, row r is stored at r % rows
+	};
+
+	/**
+	 * Entry of the series index, an empty name is a free column
+	 */
+	struct HistorySeries {
+		char name[HISTORY_NAME_SIZE];
+		uint64_t since; // first row written by this series, older rows of the column belong to a previous one
+		uint64_t last; // last row written by this series
+	};
+
+	/**
+	 * Fixed-size columnar ring of every series produced, memory-mapped from a file
+	 * Layout : header page, series index, then timestamps (one per row) and one column of rows values per series, page aligned
+	 * A row is opened at each read session with all its cells set to NaN, then filled by the dumps as they are rendered
+	 * Writes are plain stores to the mapping, the kernel writes pages back, the file survives restarts with the same geometry
+	 */
+	class History : public SeriesSink {
+
+		private:
+
+		int _fd;
+		uint8_t* _map;
+		size_t _size;
+		HistoryHeader* _header;
+		HistorySeries* _series;
+		int64_t* _timestamps;
+		double* _values;
+
+		utils::mutex _mutex; // protect the current row and the index, dumps are rendered by several threads
+		uint64_t _row; // current row, as a global index
+		std::unordered_map<std::string, int> _columns; // id = series name
+		std::vector<bool> _claimed; // columns of series still registered in a dump, never reused
+		bool _full;
+
+		public:
+
+		History();
+
+		~History();
+
+		/**
+		 * Map the file, created (or recreated if its geometry changed) with room for the given duration and number of series
+		 */
+		bool historyOpen(const std::string& path, int hours, int delay, int series);
+
+		void sinkBeginRow(int64_t timestamp) override;
+
+		/**
+		 * -1 if the index is full or the name too long
+		 * Columns whose series has been released and whose rows all expired are reused
+		 */
+		int sinkColumn(const std::string& name) override;
+
+		/**
+		 * Its column may be reused once its rows expire
+		 */
+		void sinkRelease(int column) override;
+
+		/**
+		 * Values are stored as doubles
+		 */
+		void sinkWrite(const std::vector<std::pair<int, MetricValue>>& cells) override;
+
+		void historyClose();
+
+		/**
+		 * Offsets of each part of a file, shared with the reader
+		 */
+		static size_t indexOffset();
+
+		static size_t timestampsOffset(uint64_t columns);
+
+		static size_t valuesOffset(uint64_t rows, uint64_t columns);
+	};
+
+}
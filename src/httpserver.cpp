@@ -0,0 +1,329 @@
+#include "httpserver.hpp"
+#include <algorithm>
+#include <vector>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <zlib.h>
+#include "utils/log.hpp"
+
+#define HTTP_MAX_EVENTS 64
+#define HTTP_MAX_REQUEST_SIZE 8192
+#define HTTP_READ_SIZE 4096
+#define HTTP_CONTENT_TYPE "text/plain; version=0.0.4; charset=utf-8"
+
+namespace server {
+
+    HttpServer::HttpServer(std::string address, int port, bool gzip, int timeout, int maxConnections) : _address(address), _port(port), _gzip(gzip),
+        _timeout(timeout), _maxConnections(std::max(maxConnections, 1)), _saturated(false), _listenFd(-1), _epollFd(-1), _wakeFd(-1), _running(false), _snapshot(std::make_shared<HttpSnapshot>()) {}
+
+    bool HttpServer::httpStart() {
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(_port);
+        if(inet_pton(AF_INET, _address.c_str(), &addr.sin_addr) != 1){
+            utils::logging::error("HttpServer::httpStart invalid address", _address);
+            return false;
+        }
+        _listenFd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        int enable = 1;
+        setsockopt(_listenFd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+        if(bind(_listenFd, (sockaddr*) &addr, sizeof(addr)) < 0 || listen(_listenFd, SOMAXCONN) < 0){
+            utils::logging::error("HttpServer::httpStart unable to listen on", _address + ":" + std::to_string(_port), strerror(errno));
+            close(_listenFd);
+            _listenFd = -1;
+            return false;
+        }
+        socklen_t length = sizeof(addr);
+        if(getsockname(_listenFd, (sockaddr*) &addr, &length) == 0)
+            _port = ntohs(addr.sin_port);
+        _epollFd = epoll_create1(EPOLL_CLOEXEC);
+        _wakeFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        epoll_event event;
+        event.events = EPOLLIN;
+        event.data.fd = _listenFd;
+        epoll_ctl(_epollFd, EPOLL_CTL_ADD, _listenFd, &event);
+        event.data.fd = _wakeFd;
+        epoll_ctl(_epollFd, EPOLL_CTL_ADD, _wakeFd, &event);
+        _running = true;
+        _thread = std::thread(&HttpServer::serve, this);
+        utils::logging::success("Serving metrics on", "http://" + _address + ":" + std::to_string(_port) + "/metrics");
+        return true;
+    }
+
+    int HttpServer::getPort() const {
+        return _port;
+    }
+
+    void HttpServer::publish(std::string* body) {
+        auto snapshot = std::make_shared<HttpSnapshot>();
+        snapshot->body.swap(*body);
+        _mutex.lock();
+        std::shared_ptr<HttpSnapshot> previous = _snapshot;
+        _snapshot = snapshot;
+        _mutex.unlock();
+        // Connections only take the current snapshot, once replaced nothing else can get a new reference on it
+        if(previous.use_count() == 1){
+            std::atomic_thread_fence(std::memory_order_acquire); // pairs with the release of the last connection reference
+            body->swap(previous->body);
+        }
+        else
+            body->clear();
+    }
+
+    void HttpServer::serve() {
+        epoll_event events[HTTP_MAX_EVENTS];
+        int timeout = -1;
+        while(_running){
+            int count = epoll_wait(_epollFd, events, HTTP_MAX_EVENTS, timeout);
+            if(count < 0 && errno != EINTR){
+                utils::logging::error("HttpServer::serve epoll_wait failed", strerror(errno));
+                break;
+            }
+            for(int i = 0; i < count; i++){
+                int fd = events[i].data.fd;
+                if(fd == _wakeFd)
+                    continue;
+                if(fd == _listenFd){
+                    accept();
+                    continue;
+                }
+                auto connection = _connections.find(fd);
+                if(connection == _connections.end())
+                    continue;
+                if(events[i].events & (EPOLLERR | EPOLLHUP)){
+                    closeConnection(fd);
+                    continue;
+                }
+                if((events[i].events & EPOLLOUT) && !send(&connection->second))
+                    continue; // closed
+                receive(&connection->second); // also answers requests pipelined behind a response that was pending
+            }
+            timeout = expire();
+        }
+        while(!_connections.empty())
+            closeConnection(_connections.begin()->first);
+    }
+
+    void HttpServer::accept() {
+        while(true){
+            int fd = accept4(_listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if(fd < 0){
+                if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                    utils::logging::warn("HttpServer::accept failed", strerror(errno));
+                return;
+            }
+            if(_connections.size() >= _maxConnections){ // accepted and closed at once, so that it does not wait in the backlog
+                close(fd);
+                if(!_saturated)
+                    utils::logging::warn("HttpServer::accept", _maxConnections, "connections open, new ones are refused");
+                _saturated = true;
+                continue;
+            }
+            _saturated = false;
+            int enable = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+            epoll_event event;
+            event.events = EPOLLIN;
+            event.data.fd = fd;
+            epoll_ctl(_epollFd, EPOLL_CTL_ADD, fd, &event);
+            HttpConnection& connection = _connections[fd];
+            connection.fd = fd;
+            connection.lastActivity = monotonicMilliseconds();
+        }
+    }
+
+    void HttpServer::receive(HttpConnection* connection) {
+        char buffer[HTTP_READ_SIZE];
+        while(true){
+            ssize_t size = read(connection->fd, buffer, sizeof(buffer));
+            if(size == 0 || (size < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)){
+                closeConnection(connection->fd);
+                return;
+            }
+            if(size < 0)
+                break;
+            connection->lastActivity = monotonicMilliseconds();
+            connection->request.append(buffer, size);
+            if(connection->request.size() > 4 * HTTP_MAX_REQUEST_SIZE){ // flooding while a response is pending
+                closeConnection(connection->fd);
+                return;
+            }
+        }
+        // Answer pipelined requests one at a time, the next ones wait until the current response is sent
+        while(connection->snapshot == nullptr && connection->header.empty()){
+            size_t end = connection->request.find("\r\n\r\n");
+            if(end == std::string::npos){
+                if(connection->request.size() > HTTP_MAX_REQUEST_SIZE){
+                    connection->close = true;
+                    connection->header = "HTTP/1.1 431 Request Header Fields Too Large\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+                    send(connection);
+                }
+                return;
+            }
+            std::string request = connection->request.substr(0, end);
+            connection->request.erase(0, end + 4);
+            respond(connection, request);
+            if(!send(connection))
+                return;
+        }
+    }
+
+    void HttpServer::respond(HttpConnection* connection, const std::string& request) {
+        std::string lower = request;
+        std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+        size_t line = request.find("\r\n");
+        std::string requestLine = request.substr(0, line);
+        connection->close = requestLine.find(" HTTP/1.1") == std::string::npos || lower.find("\r\nconnection: close") != std::string::npos;
+        std::string connectionHeader = connection->close ? "Connection: close\r\n" : "";
+
+        bool get = requestLine.rfind("GET ", 0) == 0;
+        bool head = requestLine.rfind("HEAD ", 0) == 0;
+        size_t target = requestLine.find(' ') + 1;
+        std::string path = requestLine.substr(target, requestLine.find(' ', target) - target);
+        if(!get && !head){
+            connection->header = "HTTP/1.1 405 Method Not Allowed\r\nAllow: GET, HEAD\r\nContent-Length: 0\r\n" + connectionHeader + "\r\n";
+            return;
+        }
+        if(path != "/metrics" && path.rfind("/metrics?", 0) != 0){
+            connection->header = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n" + connectionHeader + "\r\n";
+            return;
+        }
+        _mutex.lock();
+        connection->snapshot = _snapshot;
+        _mutex.unlock();
+        size_t encoding = lower.find("\r\naccept-encoding:");
+        bool gzip = _gzip && encoding != std::string::npos && lower.find("gzip", encoding) < lower.find("\r\n", encoding + 2);
+        HttpSnapshot* snapshot = connection->snapshot.get();
+        if(gzip && !snapshot->compressed){ // the first gzip request on this snapshot compresses it, the next ones reuse it
+            snapshot->compressed = true;
+            if(!compress(snapshot->body, &snapshot->gzip))
+                snapshot->gzip.clear();
+        }
+        gzip = gzip && !snapshot->gzip.empty();
+        connection->body = gzip ? &connection->snapshot->gzip : &connection->snapshot->body;
+        connection->header = "HTTP/1.1 200 OK\r\nContent-Type: " HTTP_CONTENT_TYPE "\r\n"
+            + std::string(gzip ? "Content-Encoding: gzip\r\n" : "") + "Vary: Accept-Encoding\r\n"
+            + "Content-Length: " + std::to_string(connection->body->size()) + "\r\n" + connectionHeader + "\r\n";
+        if(head)
+            connection->body = nullptr;
+    }
+
+    bool HttpServer::send(HttpConnection* connection) {
+        size_t bodySize = connection->body != nullptr ? connection->body->size() : 0;
+        size_t total = connection->header.size() + bodySize;
+        while(connection->sent < total){
+            iovec iov[2];
+            int count = 0;
+            if(connection->sent < connection->header.size()){
+                iov[count].iov_base = (void*) (connection->header.data() + connection->sent);
+                iov[count++].iov_len = connection->header.size() - connection->sent;
+            }
+            if(bodySize > 0){
+                size_t offset = connection->sent > connection->header.size() ? connection->sent - connection->header.size() : 0;
+                iov[count].iov_base = (void*) (connection->body->data() + offset);
+                iov[count++].iov_len = bodySize - offset;
+            }
+            ssize_t size = writev(connection->fd, iov, count);
+            if(size < 0 && errno == EINTR)
+                continue;
+            if(size < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){ // wait for the socket to drain
+                epoll_event event;
+                event.events = EPOLLIN | EPOLLOUT;
+                event.data.fd = connection->fd;
+                epoll_ctl(_epollFd, EPOLL_CTL_MOD, connection->fd, &event);
+                return true;
+            }
+            if(size < 0){
+                closeConnection(connection->fd);
+                return false;
+            }
+            connection->sent += size;
+            connection->lastActivity = monotonicMilliseconds();
+        }
+        if(connection->close){
+            closeConnection(connection->fd);
+            return false;
+        }
+        epoll_event event;
+        event.events = EPOLLIN;
+        event.data.fd = connection->fd;
+        epoll_ctl(_epollFd, EPOLL_CTL_MOD, connection->fd, &event);
+        connection->header.clear();
+        connection->snapshot.reset();
+        connection->body = nullptr;
+        connection->sent = 0;
+        return true;
+    }
+
+    void HttpServer::closeConnection(int fd) {
+        epoll_ctl(_epollFd, EPOLL_CTL_DEL, fd, nullptr);
+        close(fd);
+        _connections.erase(fd);
+    }
+
+    int HttpServer::expire() {
+        if(_connections.empty())
+            return -1;
+        long long now = monotonicMilliseconds();
+        long long next = -1;
+        std::vector<int> expired;
+        for(auto& x : _connections){
+            long long remaining = x.second.lastActivity + _timeout - now;
+            if(remaining <= 0)
+                expired.push_back(x.first);
+            else if(next < 0 || remaining < next)
+                next = remaining;
+        }
+        for(int fd : expired)
+            closeConnection(fd);
+        return next;
+    }
+
+    long long HttpServer::monotonicMilliseconds() {
+        timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+    }
+
+    bool HttpServer::compress(const std::string& input, std::string* output) {
+        z_stream stream;
+        memset(&stream, 0, sizeof(stream));
+        // 15 + 16 : default window with a gzip wrapper
+        if(deflateInit2(&stream, Z_BEST_SPEED, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            return false;
+        output->resize(deflateBound(&stream, input.size()));
+        stream.next_in = (Bytef*) input.data();
+        stream.avail_in = input.size();
+        stream.next_out = (Bytef*) &(*output)[0];
+        stream.avail_out = output->size();
+        int result = deflate(&stream, Z_FINISH);
+        output->resize(stream.total_out);
+        deflateEnd(&stream);
+        return result == Z_STREAM_END;
+    }
+
+    void HttpServer::httpStop() {
+        if(!_running)
+            return;
+        _running = false;
+        unsigned long long wake = 1;
+        write(_wakeFd, &wake, sizeof(wake));
+        _thread.join();
+        close(_listenFd);
+        close(_wakeFd);
+        close(_epollFd);
+        utils::logging::info("Http server stopped");
+    }
+
+}
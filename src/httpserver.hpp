@@ -0,0 +1,107 @@
+#pragma once
+#include <string>
+#include <memory>
+#include <unordered_map>
+#include <thread>
+#include <atomic>
+#include "utils/mutex.hpp"
+
+namespace server {
+
+	/**
+	 * A rendered exposition, its body is immutable once published
+	 * Connections keep a reference on the snapshot they are sending, so a new one can be published meanwhile
+	 */
+	struct HttpSnapshot {
+		std::string body;
+		// Compressed by the server thread for the first scraper asking for gzip, only used by that thread
+		std::string gzip; // empty if compression failed
+		bool compressed = false;
+	};
+
+	struct HttpConnection {
+		int fd;
+		std::string request; // bytes received and not yet answered
+		std::string header;
+		std::shared_ptr<HttpSnapshot> snapshot; // held until the response is sent
+		const std::string* body = nullptr; // body or gzip of snapshot, nullptr for error responses
+		size_t sent = 0; // header then body
+		bool close = false;
+		long long lastActivity; // milliseconds on the monotonic clock of the last bytes received or sent
+	};
+
+	/**
+	 * Minimal HTTP/1.1 server exposing the last snapshot on /metrics
+	 * A single thread multiplexes all scrapers with epoll on non-blocking sockets,
+	 * the collection loop only pays for publish()
+	 * Connections idle for longer than the timeout are closed and their count is capped, so that scrapers
+	 * cannot hold the file descriptors the perf counters need
+	 */
+	class HttpServer {
+
+		private:
+
+		std::string _address;
+		int _port;
+		bool _gzip;
+		int _timeout; // milliseconds
+		size_t _maxConnections;
+		bool _saturated; // the last connection was refused, warned once until one is accepted again
+
+		int _listenFd;
+		int _epollFd;
+		int _wakeFd;
+		std::atomic<bool> _running;
+		std::thread _thread;
+
+		utils::mutex _mutex; // protect _snapshot
+		std::shared_ptr<HttpSnapshot> _snapshot;
+
+		std::unordered_map<int, HttpConnection> _connections; // id = fd, only used by the server thread
+
+		void serve();
+
+		void accept();
+
+		void receive(HttpConnection* connection);
+
+		void respond(HttpConnection* connection, const std::string& request);
+
+		/**
+		 * Send as much as possible of the pending response, return false if the connection must be closed
+		 */
+		bool send(HttpConnection* connection);
+
+		void closeConnection(int fd);
+
+		/**
+		 * Close the connections idle for longer than the timeout, return the epoll_wait timeout until the next one expires
+		 */
+		int expire();
+
+		static long long monotonicMilliseconds();
+
+		static bool compress(const std::string& input, std::string* output);
+
+		public:
+
+		HttpServer(std::string address, int port, bool gzip, int timeout, int maxConnections);
+
+		/**
+		 * Bind the socket and start the server thread, return false if the address cannot be bound
+		 * With port 0, an ephemeral port is chosen, see getPort
+		 */
+		bool httpStart();
+
+		int getPort() const;
+
+		/**
+		 * Replace the exposed snapshot with body, taken by swap, called once per read session
+		 * body gets the one of the previous snapshot if no scraper still holds it, so that its capacity is reused
+		 */
+		void publish(std::string* body);
+
+		void httpStop();
+	};
+
+}
@@ -6,13 +6,78 @@
 #include <stdio.h>
 #include <string.h>
 #include <algorithm>
+#include <string_view>
 #include "utils/log.hpp"
 #include "error.hpp"
 #include "utils/config.hpp"
 
 namespace server {
 
-    LibvirtClient::LibvirtClient (const char * uri) :_conn (nullptr), _uri (uri){
+    // Indexed by DomainMetricIndex
+    static const char* domainKeys[DOMAIN_METRICS] = {
+        "memory_swapin", "memory_swapout", "memory_majorfault", "memory_minorfault", "memory_unused",
+        "memory_available", "memory_alloc", "memory_rss", "memory_usable", "memory_last_update",
+        "memory_diskcaches", "memory_hugetlbpgalloc", "memory_hugetlb_pgfail", "memory_max",
+        "cpu_alloc", "cpu_current", "cpu_cputime", "cpu_usertime", "cpu_systemtime",
+        "vcpu_time", "vcpu_wait", "vcpu_delay", "state"
+    };
+    static const char* domainHelp[DOMAIN_METRICS] = {
+        "Memory swapped in by the guest, in kB", "Memory swapped out by the guest, in kB", "Major page faults in the guest",
+        "Minor page faults in the guest", "Memory left unused by the guest, in kB", "Memory usable by the guest, in kB",
+        "Current balloon size, in kB", "Resident set size of the VM process, in kB", "Memory reclaimable by the guest without swapping, in kB",
+        "Timestamp of the last guest memory statistics update, in s", "Memory used by guest disk caches, in kB",
+        "Successful huge page allocations in the guest", "Failed huge page allocations in the guest", "Maximum balloon size, in kB",
+        "vCPUs allocated to the domain", "vCPUs online in the domain", "Cpu time of the domain, in ns", "User time of the domain, in ns",
+        "System time of the domain, in ns", "Time spent running by the vCPUs, in ns", "Time spent waiting on I/O by the vCPUs, in ns",
+        "Time spent by the vCPUs waiting on a host runqueue, in ns", "Domain state, as virDomainState (1 = running)"
+    };
+    static const MetricType domainTypes[DOMAIN_METRICS] = {
+        COUNTER, COUNTER, COUNTER, COUNTER, GAUGE, GAUGE, GAUGE, GAUGE, GAUGE, GAUGE, GAUGE, COUNTER, COUNTER, GAUGE,
+        GAUGE, GAUGE, COUNTER, COUNTER, COUNTER,
+        COUNTER, COUNTER, COUNTER, GAUGE
+    };
+
+    // Typed parameters of virConnectGetAllDomainStats, see https://libvirt.org/html/libvirt-libvirt-domain.html#virConnectGetAllDomainStats
+    static const std::unordered_map<std::string_view, int> domainFields = {
+        {"state.state", DOMAIN_STATE},
+        {"cpu.time", DOMAIN_CPU_CPUTIME}, {"cpu.user", DOMAIN_CPU_USERTIME}, {"cpu.system", DOMAIN_CPU_SYSTEMTIME},
+        {"balloon.current", DOMAIN_MEMORY_ALLOC}, {"balloon.maximum", DOMAIN_MEMORY_MAX},
+        {"balloon.swap_in", DOMAIN_MEMORY_SWAPIN}, {"balloon.swap_out", DOMAIN_MEMORY_SWAPOUT},
+        {"balloon.major_fault", DOMAIN_MEMORY_MAJORFAULT}, {"balloon.minor_fault", DOMAIN_MEMORY_MINORFAULT},
+        {"balloon.unused", DOMAIN_MEMORY_UNUSED}, {"balloon.available", DOMAIN_MEMORY_AVAILABLE},
+        {"balloon.rss", DOMAIN_MEMORY_RSS}, {"balloon.usable", DOMAIN_MEMORY_USABLE},
+        {"balloon.last-update", DOMAIN_MEMORY_LAST_UPDATE}, {"balloon.disk_caches", DOMAIN_MEMORY_DISKCACHES},
+        {"balloon.hugetlb_pgalloc", DOMAIN_MEMORY_HUGETLBPGALLOC}, {"balloon.hugetlb_pgfail", DOMAIN_MEMORY_HUGETLB_PGFAIL},
+        {"vcpu.current", DOMAIN_CPU_CURRENT}, {"vcpu.maximum", DOMAIN_CPU_ALLOC}
+    };
+    // vcpu.<n>.<field>, summed over vCPUs
+    static const std::unordered_map<std::string_view, int> vcpuFields = {
+        {"time", DOMAIN_VCPU_TIME}, {"wait", DOMAIN_VCPU_WAIT}, {"delay", DOMAIN_VCPU_DELAY}
+    };
+
+    static bool setTypedParameter(Dump* dump, MetricId id, const virTypedParameter& param) {
+        switch (param.type) {
+            case VIR_TYPED_PARAM_INT:
+                dump->set(id, (long long) param.value.i);
+                return true;
+            case VIR_TYPED_PARAM_UINT:
+                dump->set(id, (unsigned long long) param.value.ui);
+                return true;
+            case VIR_TYPED_PARAM_LLONG:
+                dump->set(id, param.value.l);
+                return true;
+            case VIR_TYPED_PARAM_ULLONG:
+                dump->set(id, param.value.ul);
+                return true;
+            case VIR_TYPED_PARAM_DOUBLE:
+                dump->set(id, param.value.d);
+                return true;
+        }
+        return false;
+    }
+
+    LibvirtClient::LibvirtClient (const char * uri) :_conn (nullptr), _uri (uri), _eventsRunning (false), _eventCallback (-1), _eventTimer (-1),
+        _generation (0){
         if (getuid()) {
             utils::logging::error ("you are not root. This program will only work if run as root.");
             exit(1);
@@ -29,6 +94,14 @@ namespace server {
     void LibvirtClient::connect () {
         // First disconnect, maybe it was connected to something
         this-> disconnect ();
+
+        // The event implementation must be registered before opening the connection
+        static bool eventImpl = false;
+        if (utils::Config::Get().libvirtEvents && !eventImpl) {
+            if (virEventRegisterDefaultImpl () < 0)
+                utils::logging::warn ("LibvirtClient::connect unable to register the default event implementation");
+            eventImpl = true;
+        }
         
         // We need an auth connection to have write access to the domains
         this-> _conn = virConnectOpenAuth (this-> _uri, virConnectAuthPtrDefault, 0);
@@ -41,6 +114,7 @@ namespace server {
     }
 
     void LibvirtClient::disconnect () {
+        this-> stopEvents ();
         if (this-> _conn != nullptr) {
         virConnectClose (this-> _conn);
         this-> _conn = nullptr;
@@ -48,72 +122,122 @@ namespace server {
         }
     }
 
-    void LibvirtClient::addAllDomainsMetrics(Dump* dump) {
-        virDomainPtr * domains = nullptr;  
-        auto num_domains = virConnectListAllDomains (this-> _conn, &domains, VIR_CONNECT_LIST_DOMAINS_ACTIVE);
-        for (int i = 0 ; i < num_domains ; i++) {
-            virDomainPtr dom = domains [i];
-            addDomainCPUMetrics(dump, dom);
-            addDomainMemoryMetrics(dump, dom);
-            virDomainFree(dom);
+    bool LibvirtClient::startEvents (std::function<void(const std::string&, bool)> handler) {
+        if (!utils::Config::Get().libvirtEvents || this-> _conn == nullptr)
+            return false;
+        this-> _lifecycleHandler = handler;
+        this-> _eventCallback = virConnectDomainEventRegisterAny (this-> _conn, nullptr, VIR_DOMAIN_EVENT_ID_LIFECYCLE,
+            VIR_DOMAIN_EVENT_CALLBACK (lifecycleCallback), this, nullptr);
+        if (this-> _eventCallback < 0) {
+            utils::logging::warn ("LibvirtClient::startEvents unable to register lifecycle events on", this-> _uri);
+            return false;
         }
-        free (domains);
+        // Without any event the loop would block forever, the timer lets it notice stopEvents
+        this-> _eventTimer = virEventAddTimeout (1000, [](int, void*){}, nullptr, nullptr);
+        this-> _eventsRunning = true;
+        this-> _eventThread = std::thread ([this]{
+            while (this-> _eventsRunning)
+                if (virEventRunDefaultImpl () < 0)
+                    utils::logging::error ("LibvirtClient::startEvents event loop failed");
+        });
+        utils::logging::success ("Listening to domain lifecycle events on", this-> _uri);
+        return true;
+    }
+
+    void LibvirtClient::stopEvents () {
+        if (!this-> _eventsRunning)
+            return;
+        virConnectDomainEventDeregisterAny (this-> _conn, this-> _eventCallback);
+        this-> _eventsRunning = false;
+        this-> _eventThread.join ();
+        virEventRemoveTimeout (this-> _eventTimer);
+        this-> _eventCallback = -1;
+        this-> _eventTimer = -1;
+    }
+
+    int LibvirtClient::lifecycleCallback (virConnectPtr /*conn*/, virDomainPtr dom, int event, int /*detail*/, void* opaque) {
+        LibvirtClient* client = (LibvirtClient*) opaque;
+        if (event == VIR_DOMAIN_EVENT_STARTED)
+            client-> _lifecycleHandler (virDomainGetName (dom), true);
+        else if (event == VIR_DOMAIN_EVENT_STOPPED)
+            client-> _lifecycleHandler (virDomainGetName (dom), false);
+        return 0;
     }
 
-    void LibvirtClient::addDomainMemoryMetrics(Dump* dump, virDomainPtr dom) {    
-        std::string name = virDomainGetName (dom);
-        findAndReplaceAll(name, "-", "");
-        virDomainMemoryStatPtr minfo =  (virDomainMemoryStatPtr) calloc(VIR_DOMAIN_MEMORY_STAT_NR, sizeof(*minfo));
-        if (minfo == NULL) {
-            utils::logging::error ("LibvirtClient::addDomainMemoryMetrics failed (failed calloc):", this-> _uri, name);
-            throw ProbeError ("LibvirtClient::addDomainMemoryMetrics failed\n");
+    /**
+     * One RPC for all running domains, whatever their number
+     */
+    void LibvirtClient::addAllDomainsMetrics(Dump* dump) {
+        this-> _generation++;
+        unsigned int stats = VIR_DOMAIN_STATS_STATE | VIR_DOMAIN_STATS_CPU_TOTAL | VIR_DOMAIN_STATS_BALLOON | VIR_DOMAIN_STATS_VCPU | VIR_DOMAIN_STATS_PERF;
+        virDomainStatsRecordPtr *records = NULL;
+        if (virConnectGetAllDomainStats(this-> _conn, stats, &records, VIR_CONNECT_GET_ALL_DOMAINS_STATS_ACTIVE) < 0) {
+            utils::logging::warn ("LibvirtClient::addAllDomainsMetrics virConnectGetAllDomainStats failed:", this-> _uri);
+            return; // series are kept until the next successful call
         }
-        int mem_stats = virDomainMemoryStats(dom, minfo, VIR_DOMAIN_MEMORY_STAT_NR, 0);
-        for (int i = 0; i < mem_stats; i++) {
-            switch (minfo[i].tag) {
-                case VIR_DOMAIN_MEMORY_STAT_SWAP_IN:
-                    dump->addSpecificMetric(name, "memory_swapin", minfo[i].val);
-                    break;
-                case VIR_DOMAIN_MEMORY_STAT_SWAP_OUT:
-                    dump->addSpecificMetric(name, "memory_swapout", minfo[i].val);
-                    break;
-                case VIR_DOMAIN_MEMORY_STAT_MAJOR_FAULT:
-                    dump->addSpecificMetric(name, "memory_majorfault", minfo[i].val);
-                    break;
-                case VIR_DOMAIN_MEMORY_STAT_MINOR_FAULT:
-                    dump->addSpecificMetric(name, "memory_minorfault", minfo[i].val);
-                    break;
-                case VIR_DOMAIN_MEMORY_STAT_UNUSED:
-                    dump->addSpecificMetric(name, "memory_unused", minfo[i].val);
-                    break;
-                case VIR_DOMAIN_MEMORY_STAT_AVAILABLE:
-                    dump->addSpecificMetric(name, "memory_available", minfo[i].val);
-                    break;
-                case VIR_DOMAIN_MEMORY_STAT_ACTUAL_BALLOON:
-                    dump->addSpecificMetric(name, "memory_alloc", minfo[i].val);
-                    break;
-                case VIR_DOMAIN_MEMORY_STAT_RSS:
-                    dump->addSpecificMetric(name, "memory_rss", minfo[i].val);
-                    break;
-                case VIR_DOMAIN_MEMORY_STAT_USABLE:
-                    dump->addSpecificMetric(name, "memory_usable", minfo[i].val);
-                    break;
-                case VIR_DOMAIN_MEMORY_STAT_LAST_UPDATE:
-                    dump->addSpecificMetric(name, "memory_last_update", minfo[i].val);
-                    break;
-                case VIR_DOMAIN_MEMORY_STAT_DISK_CACHES:
-                    dump->addSpecificMetric(name, "memory_diskcaches", minfo[i].val);
-                    break;
-                case  VIR_DOMAIN_MEMORY_STAT_HUGETLB_PGALLOC:
-                    dump->addSpecificMetric(name, "memory_hugetlbpgalloc", minfo[i].val);
-                    break;
-                case VIR_DOMAIN_MEMORY_STAT_HUGETLB_PGFAIL:
-                    dump->addSpecificMetric(name, "memory_hugetlb_pgfail", minfo[i].val);
-                    break;
+        for (virDomainStatsRecordPtr *next = records; *next; ++next)
+            addDomainRecord(dump, *next);
+        virDomainStatsRecordListFree(records);
+        // Release series of domains which stopped since the previous call (a failed call returned above and keeps them)
+        for (auto it = this-> _domainMetrics.begin(); it != this-> _domainMetrics.end();) {
+            if (it->second.generation == this-> _generation) {
+                ++it;
+                continue;
             }
+            for (auto id : it->second.ids)
+                dump->releaseMetric(id);
+            for (auto& perf : it->second.perf)
+                dump->releaseMetric(perf.second);
+            it = this-> _domainMetrics.erase(it);
         }
     }
 
+    DomainMetrics& LibvirtClient::domainMetrics(Dump* dump, const std::string& name) {
+        DomainMetrics& domain = this-> _domainMetrics[name];
+        if (domain.ids.empty())
+            for (int i = 0; i < DOMAIN_METRICS; i++)
+                domain.ids.push_back(dump->registerSpecificMetric(name, domainKeys[i], domainTypes[i], domainHelp[i]));
+        domain.generation = this-> _generation;
+        return domain;
+    }
+
+    void LibvirtClient::addDomainRecord(Dump* dump, virDomainStatsRecordPtr record) {
+        std::string name = virDomainGetName (record->dom); // no RPC, the name is cached in the domain object
+        DomainMetrics& domain = domainMetrics(dump, name);
+        unsigned long long vcpus[DOMAIN_METRICS] = {0};
+        bool vcpuSeen[DOMAIN_METRICS] = {false};
+        for (int i = 0; i < record->nparams; i++) {
+            const virTypedParameter& param = record->params[i];
+            std::string_view field = param.field;
+            auto known = domainFields.find(field);
+            if (known != domainFields.end()) {
+                setTypedParameter(dump, domain.ids[known->second], param);
+                continue;
+            }
+            if (field.rfind("vcpu.", 0) == 0 && param.type == VIR_TYPED_PARAM_ULLONG) {
+                auto vcpu = vcpuFields.find(field.substr(field.find_last_of('.') + 1));
+                if (vcpu != vcpuFields.end()) {
+                    vcpus[vcpu->second] += param.value.ul;
+                    vcpuSeen[vcpu->second] = true;
+                }
+                continue;
+            }
+            if (field.rfind("perf.", 0) == 0) { // only present when perf events are enabled on the domain
+                auto perf = domain.perf.find(field);
+                if (perf == domain.perf.end()) {
+                    std::string key (field.substr(strlen("perf.")));
+                    key.erase(remove(key.begin(), key.end(), '_'), key.end());
+                    perf = domain.perf.emplace(std::string(field), dump->registerSpecificMetric(name, "libvirt_perf_" + key, COUNTER,
+                        "Perf event " + std::string(field.substr(strlen("perf."))) + " enabled by libvirt on the domain")).first;
+                }
+                setTypedParameter(dump, perf->second, param);
+            }
+        }
+        for (int i = 0; i < DOMAIN_METRICS; i++)
+            if (vcpuSeen[i])
+                dump->set(domain.ids[i], vcpus[i]);
+    }
+
     void LibvirtClient::addNodeMemoryMetrics(Dump* dump) {
         int nparams = 0;
         virNodeMemoryStatsPtr params;
@@ -148,42 +272,6 @@ namespace server {
         }
     }
 
-    void LibvirtClient::addDomainCPUMetrics(Dump* dump, virDomainPtr dom) {
-        std::string name = virDomainGetName (dom);
-        findAndReplaceAll(name, "-", "");
-        dump->addSpecificMetric(name, "cpu_alloc", virDomainGetMaxVcpus(dom));
-        int nparams = virDomainGetCPUStats(dom, NULL, 0, -1, 1, 0);
-        if (nparams <= 0) {
-            utils::logging::info ("LibvirtClient::get_domain_cpu_stats failed (invalid nparams) domain probably died:", this-> _uri, name);
-            return;
-        }
-        virTypedParameterPtr params;
-        if ((params = (virTypedParameterPtr) malloc(sizeof(virTypedParameter) * nparams)) == NULL){
-            utils::logging::error ("LibvirtClient::get_domain_cpu_stats failed (failed alloc):", this-> _uri);
-            throw ProbeError ("LibvirtClient::get_domain_cpu_stats failed\n");
-        }
-        memset(params, 0, sizeof(virTypedParameter) * nparams);
-        nparams = virDomainGetCPUStats(dom, params, nparams, -1, 1, 0);
-        for (int i = 0; i < nparams; i++) {
-            if(params[i].type != VIR_TYPED_PARAM_ULLONG){
-                utils::logging::error ("LibvirtClient::get_domain_cpu_stats failed (type error):", this-> _uri);
-                throw ProbeError ("LibvirtClient::get_domain_cpu_stats failed\n");
-            }
-            switch (params[i].field[0]) {
-                    case 'c':
-                        dump->addSpecificMetric(name, "cpu_cputime", params[i].value.ul);
-                        break;
-                    case 'u':
-                        dump->addSpecificMetric(name, "cpu_usertime", params[i].value.ul);
-                        break;
-                    case 's':
-                        dump->addSpecificMetric(name, "cpu_systemtime", params[i].value.ul);
-                        break;
-                }
-        }
-        free(params);
-    }
-
     // Check src/util/virperf.h
     void LibvirtClient::togglePerfEvents(virDomainPtr domain, bool status) {
         unsigned int flags = VIR_DOMAIN_AFFECT_CURRENT;
@@ -212,36 +300,6 @@ namespace server {
         virTypedParamsFree(params, nparams);
     }
 
-    void LibvirtClient::addDomainsPerfInfo(Dump* dump) {
-        int flags = 0;
-        unsigned int stats = 0;
-        stats |= VIR_DOMAIN_STATS_PERF;
-        virDomainStatsRecordPtr *next;
-        virDomainStatsRecordPtr *records = NULL;
-        if ((virConnectGetAllDomainStats(this->_conn, stats, &records, flags)) < 0){
-            utils::logging::warn ("LibvirtClient::addDomainsPerfInfo virConnectGetAllDomainStats failed rc");
-            return;
-        }
-
-        next = records;
-        while (*next) {
-            std::string name = virDomainGetName((*next)->dom);
-            findAndReplaceAll(name, "-", "");
-            for (int i = 0; i < (*next)->nparams; i++) {
-                if((*next)->params[i].type != VIR_TYPED_PARAM_ULLONG){
-                    utils::logging::error ("LibvirtClient::addDomainPerfInfo failed (type error):", this-> _uri, (*next)->params[i].field);
-                    continue;
-                }
-                std::string field = (*next)->params[i].field;
-                field.erase(remove(field.begin(), field.end(), '_'), field.end());
-                std::replace(field.begin(), field.end(), '.', '_');
-                dump->addSpecificMetric(name, field, (*next)->params[i].value.ul);
-            }
-            ++next;
-        }
-        virDomainStatsRecordListFree(records);
-    }
-
     void LibvirtClient::addNodeCPUMetrics(Dump* dump) {
         // Dynamic nparams https://libvirt.org/html/libvirt-libvirt-host.html#virNodeGetCPUStats
         int nparams = 0;
@@ -1,9 +1,33 @@
 #pragma once
 #include <libvirt/libvirt.h>
 #include <filesystem>
+#include <unordered_map>
+#include <map>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <functional>
 #include "dump.hpp"
 
 namespace server {
+
+	enum DomainMetricIndex {
+		DOMAIN_MEMORY_SWAPIN, DOMAIN_MEMORY_SWAPOUT, DOMAIN_MEMORY_MAJORFAULT, DOMAIN_MEMORY_MINORFAULT, DOMAIN_MEMORY_UNUSED,
+		DOMAIN_MEMORY_AVAILABLE, DOMAIN_MEMORY_ALLOC, DOMAIN_MEMORY_RSS, DOMAIN_MEMORY_USABLE, DOMAIN_MEMORY_LAST_UPDATE,
+		DOMAIN_MEMORY_DISKCACHES, DOMAIN_MEMORY_HUGETLBPGALLOC, DOMAIN_MEMORY_HUGETLB_PGFAIL, DOMAIN_MEMORY_MAX,
+		DOMAIN_CPU_ALLOC, DOMAIN_CPU_CURRENT, DOMAIN_CPU_CPUTIME, DOMAIN_CPU_USERTIME, DOMAIN_CPU_SYSTEMTIME,
+		DOMAIN_VCPU_TIME, DOMAIN_VCPU_WAIT, DOMAIN_VCPU_DELAY, DOMAIN_STATE,
+		DOMAIN_METRICS
+	};
+
+	/**
+	 * Series of a domain, registered when it is first seen and released when it is no longer listed
+	 */
+	struct DomainMetrics {
+		std::vector<MetricId> ids; // indexed by DomainMetricIndex
+		std::map<std::string, MetricId, std::less<>> perf; // id = perf.* field, registered when first reported
+		unsigned long long generation = 0; // last listing the domain was seen in
+	};
 	
 	/**
 	 * The libvirt client is used to retreive VM domains
@@ -19,6 +43,22 @@ namespace server {
 
 	    /// The uri of the qemu system
 	    const char * _uri;
+
+	    /// Lifecycle events, dispatched by a dedicated thread running the default libvirt event loop
+	    std::thread _eventThread;
+	    std::atomic<bool> _eventsRunning;
+	    int _eventCallback;
+	    int _eventTimer;
+	    std::function<void(const std::string&, bool)> _lifecycleHandler;
+
+	    static int lifecycleCallback(virConnectPtr conn, virDomainPtr dom, int event, int detail, void* opaque);
+
+	    std::unordered_map<std::string, DomainMetrics> _domainMetrics; // id = domain name
+	    unsigned long long _generation;
+
+	    DomainMetrics& domainMetrics(Dump* dump, const std::string& name);
+
+	    void addDomainRecord(Dump* dump, virDomainStatsRecordPtr record);
 	    
 		public:
 	    LibvirtClient (const char * uri);
@@ -45,6 +85,15 @@ namespace server {
 	     */
 	    void disconnect ();
 
+	    /**
+	     * Call handler(name, running) from the event thread as soon as a domain is started or stopped
+	     * @info: the client must be connected, with libvirtevents enabled
+	     * @return: false if events cannot be received, the caller should then poll
+	     */
+	    bool startEvents (std::function<void(const std::string&, bool)> handler);
+
+	    void stopEvents ();
+
         /**
          * ================================================================================
          * ================================================================================
@@ -54,22 +103,13 @@ namespace server {
          */
 
 	    /**
-	     * @TEMP
-	     * @DEBUG
-	     * Print the list of domains on the machine
+	     * Add state, cpu, balloon, vcpu and perf statistics of all running domains
+	     * They are retrieved with a single virConnectGetAllDomainStats call
 	     */	    
 	    void addAllDomainsMetrics(Dump* dump);
 
-		void addDomainInfo(Dump* dump, virDomainPtr dom) ;
-
-		void addDomainMemoryMetrics(Dump* dump, virDomainPtr domain) ;
-
-		void addDomainCPUMetrics(Dump* dump, virDomainPtr domain) ;
-
 		void togglePerfEvents(virDomainPtr domain, bool status) ;
 
-		void addDomainsPerfInfo(Dump* dump) ;
-
 		/**
          * ================================================================================
          * ================================================================================
@@ -1,21 +1,38 @@
 #include <iostream>
 #include <signal.h>
+#include <string.h>
+#include <string>
 #include "daemon.hpp"
+#include "query.hpp"
+#include "decode.hpp"
 #include "utils/parser.hpp"
 #include "utils/config.hpp"
 
 server::Daemon* daem = NULL;
 utils::Parser parser("config.yaml");
 
+// Only flag the daemon, it is closed by main once its loop returned
 void terminateSigHandler (int) {
     if(daem != NULL)
-        daem->kill ();
-    exit (0);
+        daem->stop ();
 }
 
-int main () {
+int main (int argc, char** argv) {
+    if(argc > 1 && std::string(argv[1]) == "query")
+        return server::queryMain(argc - 2, argv + 2);
+    if(argc > 1 && std::string(argv[1]) == "decode")
+        return server::decodeMain(argc - 2, argv + 2);
     parser.parse();
     daem = new server::Daemon();
-    signal(SIGINT, &terminateSigHandler);
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = &terminateSigHandler; // no SA_RESTART, the wait for the next deadline is interrupted
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, nullptr);
     daem->start ();
+    daem->kill ();
+    server::Daemon* stopped = daem;
+    daem = NULL;
+    delete stopped;
+    return 0;
 }
@@ -1,7 +1,6 @@
 #include "perfcli.hpp"
 #include <sstream>
 #include <fstream>
-#include <fts.h>
 #include "utils/log.hpp"
 #include "utils/config.hpp"
 #include "error.hpp"
@@ -11,14 +10,40 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <algorithm>
+#include <dirent.h>
 
-// Use cgroup v1 as v2 doesn't support perf_event yet
-#define DEFAULT_CGROUP_VM_BASEPATH "/sys/fs/cgroup/perf_event/machine.slice/"
+// Stack buffers used to read procfs, large files are read by chunks
+#define PROCFS_BUFFER_SIZE 16384
+#define PROCFS_LINE_SIZE 1024
+
+// procfs series, registered after the perf ones
+static const char* const vmProcfsKeys[] = {"stat_minflt", "stat_cminflt", "stat_majflt", "stat_cmajflt", "stat_vsize", "stat_rss", "stat_rsslim",
+    "sched_runtime", "sched_waittime", "sched_timeslices"};
+static const char* const vmProcfsHelp[] = {"Minor faults of the VM processes", "Minor faults of the waited-for children of the VM processes",
+    "Major faults of the VM processes", "Major faults of the waited-for children of the VM processes", "Virtual memory size of the VM processes, in bytes",
+    "Resident set size of the VM processes, in pages", "Soft limit on the resident set size of the VM processes, in bytes",
+    "Time spent on cpu by the VM processes, in ns", "Time spent waiting on a runqueue by the VM processes, in ns", "Timeslices run by the VM processes"};
+static const server::MetricType vmProcfsTypes[] = {server::COUNTER, server::COUNTER, server::COUNTER, server::COUNTER, server::GAUGE, server::GAUGE,
+    server::GAUGE, server::COUNTER, server::COUNTER, server::COUNTER};
+enum { VM_STAT_MINFLT, VM_STAT_CMINFLT, VM_STAT_MAJFLT, VM_STAT_CMAJFLT, VM_STAT_VSIZE, VM_STAT_RSS, VM_STAT_RSSLIM,
+    VM_SCHED_RUNTIME, VM_SCHED_WAITTIME, VM_SCHED_TIMESLICES, VM_PROCFS_KEYS };
+static const char* const hostProcfsKeys[] = {"memory_total", "memory_free", "memory_buffers", "memory_cached", "memory_available"};
+static const char* const hostProcfsHelp[] = {"Host MemTotal, in kB", "Host MemFree, in kB", "Host Buffers, in kB", "Host Cached, in kB", "Host MemAvailable, in kB"};
+static const server::MetricType hostProcfsTypes[] = {server::GAUGE, server::GAUGE, server::GAUGE, server::GAUGE, server::GAUGE};
+enum { HOST_MEMORY_TOTAL, HOST_MEMORY_FREE, HOST_MEMORY_BUFFERS, HOST_MEMORY_CACHED, HOST_MEMORY_AVAILABLE, HOST_PROCFS_KEYS };
+// /proc/schedstat series, read on their own so that they can be sampled more often than the other procfs files
+static const char* const hostSchedKeys[] = {"sched_runtime", "sched_waittime", "sched_timeslices"};
+static const char* const hostSchedHelp[] = {"Time spent on cpu by tasks, summed over cpus, in ns", "Time spent waiting on a runqueue, summed over cpus, in ns",
+    "Timeslices run, summed over cpus"};
+enum { HOST_SCHED_RUNTIME, HOST_SCHED_WAITTIME, HOST_SCHED_TIMESLICES, HOST_SCHED_KEYS };
 
 namespace server {
 
-    PerfClient::PerfClient(){
-        _numCPU = sysconf(_SC_NPROCESSORS_ONLN);
+    PerfClient::PerfClient() : _procRoot(utils::Config::Get().procRoot), _sysRoot(utils::Config::Get().sysRoot), _readerCycle(0), _readerPending(0),
+        _readerStop(false), _enabled(false), _monotonic(false), _sampled(false), _pidGeneration(0) {
+        // Online cpus as seen by sysfs, so that a relocated sysfs root describes the host
+        _cpus = utils::onlineCpus(_sysRoot);
+        _numCPU = _cpus.size();
         utils::logging::info(_numCPU, "cpu(s) found");
         rlimit rl;
 	    getrlimit(RLIMIT_NOFILE, &rl);
@@ -32,49 +57,319 @@ namespace server {
         }
     }
 
-    void PerfClient::perfInit() {
-        perfSetCounters(&_fdGlobalCounters, -1, 0); // -1 for system wide counters and no specific flags
+    void PerfClient::perfInit(bool sampled) {
+        _monotonic = utils::Config::Get().perfMonotonic;
+        _sampled = sampled;
+        perfLoadEvents();
+        perfLoadTopology();
+        perfSetCounters(&_globalCounters, -1, 0); // -1 for system wide counters and no specific flags
         perfRefreshVMs();
-        utils::logging::success("Perf counters initalized");
+        if(utils::Config::Get().perfReaders != "none")
+            perfStartReaders(utils::Config::Get().perfReaders);
+        utils::logging::success("Perf counters initalized", utils::Config::Get().perfGroup ? "(grouped)" : "", _monotonic ? "(monotonic)" : "");
+    }
+
+    void PerfClient::perfLoadEvents() {
+        _events.clear();
+        for(const auto& event : utils::Config::Get().perfEventHardware)
+            _events.push_back({event, PERF_TYPE_HARDWARE, perfHwId.find(event)->second, ""});
+        for(const auto& event : utils::Config::Get().perfEventHardwareCache)
+            _events.push_back({event, PERF_TYPE_HW_CACHE, perfHwCacheId.find(event)->second, ""});
+        for(const auto& event : utils::Config::Get().perfEventSoftware)
+            _events.push_back({event, PERF_TYPE_SOFTWARE, perfSwId.find(event)->second, ""});
+        for(const auto& event : utils::Config::Get().perfEventTracepoint)
+            _events.push_back({event, PERF_TYPE_TRACEPOINT, std::stoi(event), ""});
+        for(auto& event : _events){
+            std::string key = event.name;
+            if(!is_number(key)){
+                key.erase(0,11); // remove PERF_COUNT_
+                key.erase(remove(key.begin(), key.end(), '_'), key.end());
+            }
+            event.metric = "perf_" + to_lower(key);
+        }
+        _buffer.reset(1, _events.size());
     }
 
-    void PerfClient::perfSetCounters(std::unordered_map<std::string ,std::vector<int> >* fdMap, int pid, int flag) {
-        for(int i=0;i<_numCPU;i++){
-            for(const auto& event : utils::Config::Get().perfEventHardware){
-                (*fdMap)[event].push_back(fdStart(pid, i, flag, PERF_TYPE_HARDWARE, perfHwId.find(event)->second));
+    void PerfClient::perfLoadTopology() {
+        _breakdowns.clear();
+        for(const auto& level : utils::Config::Get().perfBreakdown){
+            if(level != "socket" && level != "node" && level != "cpu"){
+                utils::logging::warn("PerfClient::perfLoadTopology unknown breakdown", level, "expecting socket, node or cpu");
+                continue;
             }
-            for(const auto& event : utils::Config::Get().perfEventHardwareCache){
-                (*fdMap)[event].push_back(fdStart(pid, i, flag, PERF_TYPE_HW_CACHE, perfHwCacheId.find(event)->second));
+            PerfBreakdown breakdown;
+            breakdown.label = level;
+            std::vector<int> cpuIds(_numCPU, 0); // sysfs id of the socket, node or cpu of each cpu
+            for(int cpu=0;cpu<_numCPU;cpu++){
+                cpuIds[cpu] = _cpus[cpu];
+                if(level == "socket"){
+                    std::ifstream package(_sysRoot + "/devices/system/cpu/cpu" + std::to_string(_cpus[cpu]) + "/topology/physical_package_id");
+                    if(!(package >> cpuIds[cpu]))
+                        cpuIds[cpu] = 0;
+                }
             }
-            for(const auto& event : utils::Config::Get().perfEventSoftware){
-                (*fdMap)[event].push_back(fdStart(pid, i, flag, PERF_TYPE_SOFTWARE, perfSwId.find(event)->second));
+            if(level == "node"){
+                std::fill(cpuIds.begin(), cpuIds.end(), 0); // no NUMA information, a single node
+                for(auto& node : perfLoadNodes())
+                    for(auto cpu : node.second)
+                        if(perfCpuPosition(cpu) >= 0)
+                            cpuIds[perfCpuPosition(cpu)] = node.first;
             }
-            for(const auto& event : utils::Config::Get().perfEventTracepoint){
-                (*fdMap)[event].push_back(fdStart(pid, i, flag, PERF_TYPE_TRACEPOINT, std::stoi(event)));
+            for(int cpu=0;cpu<_numCPU;cpu++){
+                auto group = std::find(breakdown.ids.begin(), breakdown.ids.end(), cpuIds[cpu]);
+                breakdown.groups.push_back(group - breakdown.ids.begin());
+                if(group == breakdown.ids.end())
+                    breakdown.ids.push_back(cpuIds[cpu]);
+            }
+            utils::logging::info("Host perf counters broken down by", level, "in", breakdown.ids.size(), "group(s)");
+            _breakdowns.push_back(breakdown);
+        }
+    }
+
+    std::map<int, std::vector<int>> PerfClient::perfLoadNodes() {
+        std::map<int, std::vector<int>> nodes;
+        std::ifstream online(_sysRoot + "/devices/system/node/online");
+        std::string list;
+        if(!std::getline(online, list))
+            return nodes;
+        for(auto node : utils::parseCPUList(list)){ // same format as cpu lists
+            std::ifstream cpulist(_sysRoot + "/devices/system/node/node" + std::to_string(node) + "/cpulist");
+            std::string cpus;
+            nodes[node] = std::getline(cpulist, cpus) ? utils::parseCPUList(cpus) : std::vector<int>();
+        }
+        return nodes;
+    }
+
+    int PerfClient::perfCpuPosition(int cpu) {
+        auto it = std::lower_bound(_cpus.begin(), _cpus.end(), cpu); // sysfs lists are sorted
+        return it != _cpus.end() && *it == cpu ? it - _cpus.begin() : -1;
+    }
+
+    void PerfReadBuffer::reset(size_t targets, size_t events) {
+        values.assign(targets * events, 0);
+        enabled.assign(targets * events, 0);
+        running.assign(targets * events, 0);
+        totals.assign(targets * events, 0);
+        group.resize(3 + 2*events); // nr, time_enabled, time_running, then {value, id} per member
+    }
+
+    // One loop per array, so that each one is vectorized
+    void PerfReadBuffer::addRow(size_t to, size_t from, size_t events) {
+        long long* toValues = values.data() + to * events;
+        const long long* fromValues = values.data() + from * events;
+        for(size_t e=0;e<events;e++)
+            toValues[e] += fromValues[e];
+        unsigned long long* toEnabled = enabled.data() + to * events;
+        const unsigned long long* fromEnabled = enabled.data() + from * events;
+        for(size_t e=0;e<events;e++)
+            toEnabled[e] += fromEnabled[e];
+        unsigned long long* toRunning = running.data() + to * events;
+        const unsigned long long* fromRunning = running.data() + from * events;
+        for(size_t e=0;e<events;e++)
+            toRunning[e] += fromRunning[e];
+        unsigned long long* toTotals = totals.data() + to * events;
+        const unsigned long long* fromTotals = totals.data() + from * events;
+        for(size_t e=0;e<events;e++)
+            toTotals[e] += fromTotals[e];
+    }
+
+    void PerfClient::perfSetCounters(PerfCounters* counters, int pid, int flag, bool perThread) {
+        bool grouped = utils::Config::Get().perfGroup;
+        counters->assign(perThread ? 1 : _numCPU, std::vector<PerfGroup>());
+        for(int c=0;c<(int)counters->size();c++){
+            std::vector<PerfGroup>& groups = counters->at(c);
+            int i = perThread ? -1 : _cpus[c];
+            for(size_t e=0;e<_events.size();e++){
+                const PerfEvent& event = _events[e];
+                int fd = -1;
+                if(grouped && !groups.empty()){
+                    fd = fdStart(pid, i, flag, event.type, event.config, groups.back().fds[0]);
+                    if(fd == -1)
+                        utils::logging::info("PerfClient::perfSetCounters", event.name, "cannot be co-scheduled with its group on core", i, "opening a new group");
+                }
+                if(fd == -1){
+                    fd = fdStart(pid, i, flag, event.type, event.config, -1);
+                    if(fd == -1)
+                        continue; // event skipped on this core, already logged
+                    groups.emplace_back();
+                }
+                unsigned long long id = 0;
+                ioctl(fd, PERF_EVENT_IOC_ID, &id);
+                groups.back().fds.push_back(fd);
+                groups.back().events.push_back(e);
+                groups.back().ids.push_back(id);
+                if(_monotonic){
+                    groups.back().last.push_back(0);
+                    groups.back().totals.push_back(0);
+                }
             }
         }
     }
 
     void PerfClient::perfRefreshVMs () {
-        std::unordered_map<std::string, std::string> cgroups = retrieveCgroupsVM();
+        std::unordered_map<std::string, std::string> cgroups = _cgroups.retrieveCgroupsVM();
+        std::lock_guard<std::mutex> guard(_vmMutex);
         std::list<std::string> toBeDeleted;
-        for(auto x : cgroups)
-            if (_fdVMCounters.find(x.first) == _fdVMCounters.end()){ // New key
+        for(auto& x : cgroups)
+            if (_vmCounters.find(x.first) == _vmCounters.end()){ // New key
                 utils::logging::info("New VM detected", x.first, "with cgroup", x.second);
                 perfInitVM(x.first, x.second);
             }
         // Check if a VM disappeared
-        for(auto x : _fdVMCounters)
-            if (cgroups.find(x.first) == cgroups.end()){
-                perfCloseSpecific(&x.second);
+        for(auto& x : _vmCounters)
+            if (cgroups.find(x.first) == cgroups.end())
                 toBeDeleted.push_back(x.first);
+        for(auto& x : toBeDeleted)
+            perfDetachVM(x);
+        // cgroup.procs files and pids are resolved again at the next procfs read, a pid may have been reused by another VM
+        _vmProcs.clear();
+        _vcpuMissing.clear();
+        for(auto& x : _pidFiles)
+            x.second.generation = 0;
+        for(auto& x : _vmCounters)
+            if(perfVcpuEnabled(x.first))
+                perfRefreshVcpus(x.first);
+    }
+
+    void PerfClient::perfStartVM(const std::string& vmname) {
+        std::unordered_map<std::string, std::string> cgroups = _cgroups.retrieveCgroupsVM();
+        auto cgroup = cgroups.find(vmname);
+        if(cgroup == cgroups.end()){
+            utils::logging::warn("PerfClient::perfStartVM no cgroup found for", vmname, "it will be retried at the next rescan");
+            return;
+        }
+        std::lock_guard<std::mutex> guard(_vmMutex);
+        if(_vmCounters.find(vmname) != _vmCounters.end())
+            return;
+        utils::logging::info("VM", vmname, "started with cgroup", cgroup->second);
+        perfInitVM(vmname, cgroup->second);
+    }
+
+    void PerfClient::perfStopVM(const std::string& vmname) {
+        std::lock_guard<std::mutex> guard(_vmMutex);
+        if(_vmCounters.find(vmname) != _vmCounters.end())
+            perfDetachVM(vmname);
+    }
+
+    // Counters of a stopped VM are kept until the next read, so that its last values are not lost
+    void PerfClient::perfDetachVM(const std::string& vmname) {
+        _stoppedVMs.push_back({vmname, std::move(_vmCounters[vmname]), std::get<0>(_fdVmCgroup[vmname]), std::move(_vcpuCounters[vmname])});
+        _vmCounters.erase(vmname);
+        _vcpuCounters.erase(vmname);
+        _vmProcs.erase(vmname);
+        _vcpuMissing.erase(vmname);
+        _fdVmCgroup.erase(vmname);
+        utils::logging::info("VM", vmname, "is no longer active, counters will be cleared after the next dump");
+    }
+
+    void PerfClient::perfReleaseStopped(Dump* dump) {
+        for(auto& vm : _stoppedVMs){
+            if(!vm.read)
+                continue;
+            perfCloseSpecific(&vm.counters);
+            perfCloseVcpus(&vm.vcpus);
+            close(vm.cgroupFd);
+            // Ids may be reused by other series, their session sums are dropped
+            for(auto id : _vmMetrics[vm.name]){
+                dump->releaseMetric(id);
+                if((size_t) id < _sessionSums.size())
+                    _sessionSums[id] = PerfSessionSum();
             }
-        for(auto x : toBeDeleted){
-            _fdVMCounters.erase(x);
-            close(std::get<0>(_fdVmCgroup[x]));
-            _fdVmCgroup.erase(x);
-            utils::logging::info("VM", x, "is no longer active, counters cleared");
+            _vmMetrics.erase(vm.name);
+            for(auto& vcpu : _vcpuMetrics[vm.name])
+                for(auto id : vcpu.second){
+                    dump->releaseMetric(id);
+                    if((size_t) id < _sessionSums.size())
+                        _sessionSums[id] = PerfSessionSum();
+                }
+            _vcpuMetrics.erase(vm.name);
         }
+        _stoppedVMs.erase(std::remove_if(_stoppedVMs.begin(), _stoppedVMs.end(), [](const StoppedVM& vm){ return vm.read; }), _stoppedVMs.end());
+    }
+
+    bool PerfClient::perfVcpuEnabled(const std::string& vmname) {
+        const auto& vms = utils::Config::Get().perfVcpu;
+        return std::find(vms.begin(), vms.end(), vmname) != vms.end() || std::find(vms.begin(), vms.end(), "all") != vms.end();
+    }
+
+    void PerfClient::perfRefreshVcpus(const std::string& vmname) {
+        // vCPU threads live in the QEMU process, already known from the cgroup.procs of the VM
+        std::map<int, int> threads; // id : vcpu index = tid
+        char path[PROCFS_LINE_SIZE];
+        char comm[PROCFS_LINE_SIZE];
+        bool scanned = false;
+        for(const auto& x : _vmPids){
+            if(x.second != vmname)
+                continue;
+            scanned = true;
+            snprintf(path, sizeof(path), "%s/%d/task", _procRoot.c_str(), x.first);
+            DIR* tasks = opendir(path);
+            if(tasks == nullptr)
+                continue;
+            while(dirent* task = readdir(tasks)){
+                int vcpu;
+                int tid = atoi(task->d_name);
+                if(tid <= 0)
+                    continue;
+                snprintf(path, sizeof(path), "%s/%d/task/%d/comm", _procRoot.c_str(), x.first, tid);
+                utils::ProcFile file;
+                if(file.open(path) && file.read(comm, sizeof(comm)) > 0 && sscanf(comm, "CPU %d/", &vcpu) == 1)
+                    threads[vcpu] = tid;
+            }
+            closedir(tasks);
+        }
+        if(threads.empty() && scanned) // not a QEMU process or guest not started, no need to list its threads at each read
+            _vcpuMissing.insert(vmname);
+        else
+            _vcpuMissing.erase(vmname);
+        VcpusCounters& vcpus = _vcpuCounters[vmname];
+        for(auto it = vcpus.begin(); it != vcpus.end();){
+            auto thread = threads.find(it->first);
+            if(thread == threads.end() || thread->second != it->second.tid){
+                perfCloseSpecific(&it->second.counters);
+                it = vcpus.erase(it);
+            }
+            else
+                ++it;
+        }
+        for(const auto& thread : threads){
+            if(vcpus.find(thread.first) != vcpus.end())
+                continue;
+            VcpuCounters& vcpu = vcpus[thread.first];
+            vcpu.tid = thread.second;
+            perfSetCounters(&vcpu.counters, thread.second, 0, true);
+            if(_enabled)
+                perfEnableSpecific(&vcpu.counters);
+            utils::logging::info("vCPU", thread.first, "of", vmname, "found as thread", thread.second);
+        }
+    }
+
+    void PerfClient::perfReadVcpus(const std::string& vmname, VcpusCounters* vcpus, Dump* dump) {
+        std::map<int, std::vector<MetricId>>& vmMetrics = _vcpuMetrics[vmname];
+        for(auto& x : *vcpus){
+            std::vector<MetricId>& metrics = vmMetrics[x.first];
+            if(metrics.empty()){
+                std::string vcpu = std::to_string(x.first);
+                for(auto& event : _events){
+                    metrics.push_back(dump->registerSpecificMetric(vmname, event.metric, "vcpu", vcpu, GAUGE,
+                        "Perf event " + event.name + " over the last read session, scaled by time_enabled/time_running"));
+                    metrics.push_back(dump->registerSpecificMetric(vmname, event.metric + "_multiplex", "vcpu", vcpu, GAUGE,
+                        "Share of the last read session perf event " + event.name + " was counting"));
+                    if(_monotonic)
+                        metrics.push_back(dump->registerSpecificMetric(vmname, event.metric + "_total", "vcpu", vcpu, COUNTER,
+                            "Perf event " + event.name + " since its counters were opened, scaled by time_enabled/time_running"));
+                }
+            }
+            _buffer.reset(1, _events.size());
+            perfReadCPU(&x.second.counters, 0, &_buffer, 0, false);
+            perfDumpValues(metrics, &_buffer, 0, dump);
+        }
+    }
+
+    void PerfClient::perfCloseVcpus(VcpusCounters* vcpus) {
+        for(auto& x : *vcpus)
+            perfCloseSpecific(&x.second.counters);
+        vcpus->clear();
     }
 
     void PerfClient::perfInitVM(std::string vmname, std::string vmCgroupPath) {
@@ -86,113 +381,407 @@ namespace server {
             utils::logging::error("cannot open cgroup dir path=", vmCgroupPath, "for vm", vmname, "errno=", errno);
             return;
         }
-        perfSetCounters(&_fdVMCounters[vmname], cgroup_fd, perf_flags);
-        _fdVmCgroup[vmname] = std::make_tuple(cgroup_fd, vmCgroupPath); // Keep track of fd (to properly close them) and procfs
-    }
-
-    std::unordered_map<std::string, std::string>  PerfClient::retrieveCgroupsVM () {
-        std::unordered_map<std::string, std::string> vmCgroups;
-        const char *path[] = { DEFAULT_CGROUP_VM_BASEPATH, NULL };
-        FTS *file_system = NULL;
-        FTSENT *node = NULL;
-        file_system = fts_open((char * const *)path, FTS_LOGICAL | FTS_NOCHDIR, NULL);
-        if (!file_system){
-            utils::logging::error("Error while(*fdMap) opening", DEFAULT_CGROUP_VM_BASEPATH);
-            return vmCgroups;
-        }
-        for (node = fts_read(file_system); node; node = fts_read(file_system)) {
-            /*
-            * Filtering the directoriesf having 2 hard links leading to them to only get leaves directories.
-            * The cgroup subsystems does not support hard links, so this will always work.
-            */
-            if (node->fts_info == FTS_D && node->fts_statp->st_nlink == 2) {
-                std::string vmname(node->fts_path);
-                size_t found_first = vmname.find("\\x2d");
-                // format is /sys/fs/cgroup/perf_event/machine.slice/machine-qemu\x2d{id}\x2d{name which may contains \x2d}.scope
-                if (found_first != std::string::npos) {
-                    std::string vmname_start_at_id = vmname.substr(found_first+4);
-                    size_t found_second = vmname_start_at_id.find("\\x2d");
-                    if (found_second != std::string::npos) {
-                        std::string vmname_start_at_name = vmname_start_at_id.substr(found_second+4);
-                        size_t found_scope = vmname_start_at_name.find_last_of('.');
-                        if (found_scope != std::string::npos) // remove .scope
-                            vmname_start_at_name.erase(found_scope);
-                        findAndReplaceAll(vmname_start_at_name, "\\x2d", "");
-                        vmCgroups[vmname_start_at_name] = node->fts_path;
-                    }
-                } // else : not a VM, probably a podman container
+        // Restarted before its last values were read, the series are shared with the new counters and must not be written twice
+        for(auto it = _stoppedVMs.begin(); it != _stoppedVMs.end();){
+            if(it->name != vmname){
+                ++it;
+                continue;
             }
+            perfCloseSpecific(&it->counters);
+            perfCloseVcpus(&it->vcpus);
+            close(it->cgroupFd);
+            it = _stoppedVMs.erase(it);
         }
-        fts_close(file_system);
-        return vmCgroups;
+        _vcpuMissing.erase(vmname);
+        perfSetCounters(&_vmCounters[vmname], cgroup_fd, perf_flags);
+        _fdVmCgroup[vmname] = std::make_tuple(cgroup_fd, vmCgroupPath); // Keep track of fd (to properly close them) and procfs
+        if(_enabled) // VM started after perfEnable
+            perfEnableSpecific(&_vmCounters[vmname]);
     }
 
     void PerfClient::perfEnable () {
-        perfEnableSpecific(&_fdGlobalCounters);
-        for(auto& x : _fdVMCounters)
+        std::lock_guard<std::mutex> guard(_vmMutex);
+        _enabled = true;
+        perfEnableSpecific(&_globalCounters);
+        for(auto& x : _vmCounters)
             perfEnableSpecific(&x.second);
+        for(auto& x : _vcpuCounters)
+            for(auto& vcpu : x.second)
+                perfEnableSpecific(&vcpu.second.counters);
     }
 
-    void PerfClient::perfEnableSpecific(std::unordered_map<std::string ,std::vector<int> >* fdMap) {
-        for (auto& it: (*fdMap))
-            for(int i=0;i<_numCPU;i++)
-                ioctl(it.second.at(i), PERF_EVENT_IOC_ENABLE, 0);
+    void PerfClient::perfEnableSpecific(PerfCounters* counters) {
+        for (auto& cpu: (*counters))
+            for (auto& group: cpu)
+                ioctl(group.fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
     }
 
     void PerfClient::perfReset() {
-        perfResetSpecific(&_fdGlobalCounters);
-        for(auto& x : _fdVMCounters)
+        if(_monotonic)
+            return;
+        std::lock_guard<std::mutex> guard(_vmMutex);
+        for(auto& x : _vcpuCounters) // never handed to readers
+            for(auto& vcpu : x.second)
+                perfResetSpecific(&vcpu.second.counters);
+        if(!_readers.empty())
+            return; // already done by each reader right after its read
+        perfResetSpecific(&_globalCounters);
+        for(auto& x : _vmCounters)
             perfResetSpecific(&x.second);
     }
 
-    void PerfClient::perfResetSpecific (std::unordered_map<std::string ,std::vector<int> >* fdMap) {
-        for (auto& it: (*fdMap))
-            for(int i=0;i<_numCPU;i++)
-                ioctl(it.second.at(i), PERF_EVENT_IOC_RESET, 0);
+    void PerfClient::perfResetSpecific (PerfCounters* counters) {
+        for (auto& cpu: (*counters))
+            for (auto& group: cpu)
+                ioctl(group.fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
     } 
 
+    // Return the series of a VM (or of the host if vmname is empty), registered at first use
+    std::vector<MetricId>* PerfClient::perfMetrics(Dump* dump, const std::string& vmname){
+        std::vector<MetricId>* metrics = vmname.empty() ? &_globalMetrics : &_vmMetrics[vmname];
+        if(!metrics->empty())
+            return metrics;
+        auto add = [&](const std::string& key, MetricType type, const std::string& help){
+            metrics->push_back(vmname.empty() ? dump->registerGlobalMetric(key, type, help) : dump->registerSpecificMetric(vmname, key, type, help));
+        };
+        for(auto& event : _events){
+            add(event.metric, GAUGE, "Perf event " + event.name + " over the last read session, scaled by time_enabled/time_running");
+            add(event.metric + "_multiplex", GAUGE, "Share of the last read session perf event " + event.name + " was counting");
+            if(_monotonic)
+                add(event.metric + "_total", COUNTER, "Perf event " + event.name + " since its counters were opened, scaled by time_enabled/time_running");
+        }
+        return metrics;
+    }
+
+    std::vector<MetricId>* PerfClient::procfsMetrics(Dump* dump, const std::string& vmname){
+        std::vector<MetricId>* metrics = vmname.empty() ? &_globalProcfsMetrics : &_vmProcfsMetrics[vmname];
+        if(!metrics->empty())
+            return metrics;
+        auto add = [&](const std::string& key, MetricType type, const std::string& help){
+            metrics->push_back(vmname.empty() ? dump->registerGlobalMetric(key, type, help) : dump->registerSpecificMetric(vmname, key, type, help));
+        };
+        if(vmname.empty())
+            for(int i=0;i<HOST_PROCFS_KEYS;i++)
+                add(hostProcfsKeys[i], hostProcfsTypes[i], hostProcfsHelp[i]);
+        else
+            for(int i=0;i<VM_PROCFS_KEYS;i++)
+                add(vmProcfsKeys[i], vmProcfsTypes[i], vmProcfsHelp[i]);
+        return metrics;
+    }
+
     void PerfClient::perfRead(Dump* dump){
-        perfRefreshVMs(); 
-        perfReadSpecific("", &_fdGlobalCounters, dump);
-        for(auto& x : _fdVMCounters)
-            perfReadSpecific(x.first, &x.second, dump);
-    }
-
-    void PerfClient::perfReadSpecific(std::string qualifier, std::unordered_map<std::string ,std::vector<int> >* fdMap, Dump* dump){
-        for (auto& it: (*fdMap)) {
-            std::string key = it.first;
-            long long value = 0;
-            for(int i=0;i<_numCPU;i++){
-                value+= fdRead(it.second.at(i));
+        std::lock_guard<std::mutex> guard(_vmMutex);
+        perfReleaseStopped(dump); // read at the previous session
+        // vCPU threads only exist once the guest is started, resolve them until found
+        for(auto& x : _vmCounters)
+            if(perfVcpuEnabled(x.first) && _vcpuCounters[x.first].empty() && _vcpuMissing.count(x.first) == 0)
+                perfRefreshVcpus(x.first);
+        if(_readers.empty()){
+            if(_breakdowns.empty())
+                perfReadSpecific("", &_globalCounters, dump);
+            else
+                perfReadGlobal(dump);
+            for(auto& x : _vmCounters)
+                perfReadSpecific(x.first, &x.second, dump);
+            for(auto& vm : _stoppedVMs)
+                perfReadSpecific(vm.name, &vm.counters, dump);
+        }
+        else
+            perfReadWithReaders(dump);
+        for(auto& x : _vcpuCounters)
+            perfReadVcpus(x.first, &x.second, dump);
+        for(auto& vm : _stoppedVMs){
+            perfReadVcpus(vm.name, &vm.vcpus, dump);
+            vm.read = true;
+        }
+    }
+
+    void PerfClient::perfReadWithReaders(Dump* dump){
+        // Hand the targets to the readers, each one reads and resets its own cpus
+        _readerTargets.clear();
+        _readerTargets.push_back(&_globalCounters);
+        for(auto& x : _vmCounters)
+            _readerTargets.push_back(&x.second);
+        for(auto& vm : _stoppedVMs)
+            _readerTargets.push_back(&vm.counters);
+        std::unique_lock<std::mutex> lock(_readerMutex);
+        _readerPending = _readers.size();
+        _readerCycle++;
+        _readerWake.notify_all();
+        _readerDone.wait(lock, [this]{ return _readerPending == 0; });
+        lock.unlock();
+        // Reduce once per session, per-cpu rows of host counters are written by a single reader each
+        size_t cpuRows = _breakdowns.empty() ? 0 : _numCPU;
+        size_t size = (_readerTargets.size() + cpuRows) * _events.size();
+        _buffer.reset(_readerTargets.size() + cpuRows, _events.size());
+        for(auto& reader : _readerBuffers)
+            for(size_t i=0;i<size;i++){
+                _buffer.values[i] += reader.values[i];
+                _buffer.enabled[i] += reader.enabled[i];
+                _buffer.running[i] += reader.running[i];
+                _buffer.totals[i] += reader.totals[i];
             }
-            if(!is_number(key)){
-                key.erase(0,11); // remove PERF_COUNT_
-                key.erase(remove(key.begin(), key.end(), '_'), key.end());
+        if(!_breakdowns.empty()){
+            for(int cpu=0;cpu<_numCPU;cpu++)
+                _buffer.addRow(0, _readerTargets.size() + cpu, _events.size());
+            perfDumpBreakdowns(&_buffer, _readerTargets.size(), dump);
+        }
+        perfDumpSpecific("", &_buffer, 0, dump);
+        size_t target = 1;
+        for(auto& x : _vmCounters)
+            perfDumpSpecific(x.first, &_buffer, target++, dump);
+        for(auto& vm : _stoppedVMs)
+            perfDumpSpecific(vm.name, &_buffer, target++, dump);
+    }
+
+    void PerfClient::perfReadGlobal(Dump* dump){
+        _buffer.reset(1 + _numCPU, _events.size());
+        for (int cpu=0;cpu<(int)_globalCounters.size();cpu++){
+            perfReadCPU(&_globalCounters, cpu, &_buffer, 1 + cpu, false);
+            _buffer.addRow(0, 1 + cpu, _events.size());
+        }
+        perfDumpSpecific("", &_buffer, 0, dump);
+        perfDumpBreakdowns(&_buffer, 1, dump);
+    }
+
+    /**
+     * Rows of a cpu are added to the row of its group, rows are contiguous so that the event loop is vectorized
+     */
+    void PerfClient::perfDumpBreakdowns(PerfReadBuffer* buffer, size_t cpuRow, Dump* dump){
+        size_t events = _events.size();
+        for(auto& breakdown : _breakdowns){
+            if(breakdown.metrics.empty())
+                for(auto id : breakdown.ids)
+                    for(auto& event : _events)
+                        breakdown.metrics.push_back(dump->registerGlobalMetric(event.metric + "_" + breakdown.label, breakdown.label, std::to_string(id),
+                            GAUGE, "Perf event " + event.name + " over the last read session, scaled by time_enabled/time_running, per " + breakdown.label));
+            breakdown.values.assign(breakdown.ids.size() * events, 0);
+            for(int cpu=0;cpu<_numCPU;cpu++){
+                const long long* row = buffer->values.data() + (cpuRow + cpu) * events;
+                long long* group = breakdown.values.data() + breakdown.groups[cpu] * events;
+                for(size_t e=0;e<events;e++)
+                    group[e] += row[e];
             }
-            if(qualifier.empty())
-                dump->addGlobalMetric("perf_" + to_lower(key), value);
-            else
-                dump->addSpecificMetric(qualifier, "perf_" + to_lower(key), value);
+            for(size_t i=0;i<breakdown.metrics.size();i++){
+                dump->set(breakdown.metrics[i], breakdown.values[i]);
+                if(_sampled)
+                    perfSessionAdd(breakdown.metrics[i], -1, breakdown.values[i], 0, 0);
+            }
+        }
+    }
+
+    void PerfClient::perfReadSpecific(const std::string& qualifier, PerfCounters* counters, Dump* dump){
+        _buffer.reset(1, _events.size());
+        for (int cpu=0;cpu<(int)counters->size();cpu++)
+            perfReadCPU(counters, cpu, &_buffer, 0, false);
+        perfDumpSpecific(qualifier, &_buffer, 0, dump);
+    }
+
+    void PerfClient::perfReadCPU(PerfCounters* counters, int cpu, PerfReadBuffer* buffer, size_t target, bool reset){
+        for (auto& group: counters->at(cpu)){
+            perfReadGroup(&group, buffer, target);
+            if(reset)
+                ioctl(group.fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        }
+    }
+
+    void PerfClient::perfDumpSpecific(const std::string& qualifier, PerfReadBuffer* buffer, size_t target, Dump* dump){
+        perfDumpValues(*perfMetrics(dump, qualifier), buffer, target, dump);
+    }
+
+    void PerfClient::perfDumpValues(const std::vector<MetricId>& metrics, PerfReadBuffer* buffer, size_t target, Dump* dump){
+        size_t offset = target * _events.size();
+        size_t series = _monotonic ? 3 : 2;
+        for(size_t e=0;e<_events.size();e++){
+            long long value = buffer->values[offset + e];
+            // Share of the period the event was really counting, 1 if it was never multiplexed
+            // A counter that was not enabled during the period (e.g. a cgroup with no task scheduled) has nothing to compensate
+            double multiplex = buffer->enabled[offset + e] ? (double) buffer->running[offset + e] / buffer->enabled[offset + e] : 1;
+            dump->set(metrics[series*e], value);
+            dump->set(metrics[series*e+1], multiplex);
+            if(_monotonic)
+                dump->set(metrics[series*e+2], buffer->totals[offset + e]);
+            if(_sampled)
+                perfSessionAdd(metrics[series*e], metrics[series*e+1], value, buffer->enabled[offset + e], buffer->running[offset + e]);
+        }
+    }
+
+    void PerfClient::perfSessionAdd(MetricId id, MetricId multiplex, long long value, unsigned long long enabled, unsigned long long running){
+        if((size_t) id >= _sessionSums.size())
+            _sessionSums.resize(id + 1);
+        PerfSessionSum& sum = _sessionSums[id];
+        sum.value += value;
+        sum.enabled += enabled;
+        sum.running += running;
+        sum.multiplex = multiplex;
+        sum.set = true;
+    }
+
+    void PerfClient::perfSessionEnd(Dump* dump){
+        std::lock_guard<std::mutex> guard(_vmMutex);
+        for(size_t id=0;id<_sessionSums.size();id++){
+            PerfSessionSum& sum = _sessionSums[id];
+            if(!sum.set)
+                continue;
+            dump->set((MetricId) id, sum.value);
+            if(sum.multiplex >= 0)
+                dump->set(sum.multiplex, sum.enabled ? (double) sum.running / sum.enabled : 1);
+            sum = PerfSessionSum();
+        }
+    }
+
+    /**
+     * Read all members of a group with a single syscall and accumulate them in the buffer
+     * Values are scaled by time_enabled/time_running over the last period to compensate multiplexing
+     * In monotonic mode the raw values keep growing, the delta with the previous read is used instead
+     */
+    void PerfClient::perfReadGroup(PerfGroup* group, PerfReadBuffer* buffer, size_t target){
+        unsigned long long* data = buffer->group.data();
+        size_t size = (3 + 2*group->fds.size()) * sizeof(unsigned long long);
+        if(read(group->fds[0], data, size) != (ssize_t) size){
+            utils::logging::warn("PerfClient::perfReadGroup failed to read group led by", _events[group->events[0]].name, strerror(errno));
+            return;
+        }
+        unsigned long long nr = data[0];
+        // Times keep growing across resets, only their progress since the last read is relevant
+        unsigned long long enabled = data[1] - group->enabled;
+        unsigned long long running = data[2] - group->running;
+        group->enabled = data[1];
+        group->running = data[2];
+        size_t offset = target * _events.size();
+        for(unsigned long long k=0;k<nr && k<group->ids.size();k++){
+            unsigned long long value = data[3+2*k];
+            unsigned long long id = data[4+2*k];
+            size_t member = k;
+            if(group->ids[member] != id) // members are expected in creation order, search otherwise
+                member = std::find(group->ids.begin(), group->ids.end(), id) - group->ids.begin();
+            if(member >= group->ids.size())
+                continue;
+            size_t event = offset + group->events[member];
+            if(_monotonic){
+                unsigned long long raw = value;
+                value = raw - group->last[member];
+                group->last[member] = raw;
+            }
+            if(running > 0 && running < enabled)
+                value = (unsigned long long) ((double) value * enabled / running);
+            else if(running == 0)
+                value = 0; // group was never scheduled during the period
+            buffer->values[event] += value;
+            buffer->enabled[event] += enabled;
+            buffer->running[event] += running;
+            if(_monotonic){
+                group->totals[member] += value;
+                buffer->totals[event] += group->totals[member];
+            }
+        }
+    }
+
+    /**
+     * Spawn one reader per cpu, or per NUMA node, pinned on the cpus it reads
+     * Reading a counter from its own cpu avoids the IPI needed to read it remotely
+     */
+    void PerfClient::perfStartReaders(std::string mode) {
+        _readerCpus.clear();
+        if(mode == "node"){
+            for(auto& node : perfLoadNodes()){
+                std::vector<int> positions;
+                for(auto cpu : node.second)
+                    if(perfCpuPosition(cpu) >= 0)
+                        positions.push_back(perfCpuPosition(cpu));
+                if(!positions.empty())
+                    _readerCpus.push_back(positions);
+            }
+            if(_readerCpus.empty())
+                utils::logging::warn("PerfClient::perfStartReaders no NUMA node found, using one reader per cpu");
+        }
+        else if(mode != "cpu")
+            utils::logging::warn("PerfClient::perfStartReaders unknown mode", mode, "using one reader per cpu");
+        if(_readerCpus.empty())
+            for(int i=0;i<_numCPU;i++)
+                _readerCpus.push_back({i});
+        _readerBuffers.resize(_readerCpus.size());
+        for(size_t i=0;i<_readerCpus.size();i++){
+            _readers.emplace_back(&PerfClient::perfReaderLoop, this, i);
+            cpu_set_t cpuset;
+            CPU_ZERO(&cpuset);
+            for(auto cpu : _readerCpus[i])
+                CPU_SET(_cpus[cpu], &cpuset);
+            if(pthread_setaffinity_np(_readers.back().native_handle(), sizeof(cpu_set_t), &cpuset) != 0)
+                utils::logging::warn("PerfClient::perfStartReaders cannot pin reader", i);
         }
+        utils::logging::info(_readers.size(), "perf reader(s) started");
+    }
+
+    void PerfClient::perfReaderLoop(int reader) {
+        unsigned long long cycle = 0;
+        PerfReadBuffer* buffer = &_readerBuffers[reader];
+        while(true){
+            {
+                std::unique_lock<std::mutex> lock(_readerMutex);
+                _readerWake.wait(lock, [this, cycle]{ return _readerStop || _readerCycle != cycle; });
+                if(_readerStop)
+                    return;
+                cycle = _readerCycle;
+            }
+            size_t targets = _readerTargets.size();
+            buffer->reset(targets + (_breakdowns.empty() ? 0 : _numCPU), _events.size());
+            for(size_t target=0;target<targets;target++)
+                for(auto cpu : _readerCpus[reader])
+                    if(cpu < (int)_readerTargets[target]->size()) // host counters go to their per-cpu row when broken down
+                        perfReadCPU(_readerTargets[target], cpu, buffer, target == 0 && !_breakdowns.empty() ? targets + cpu : target, !_monotonic);
+            std::lock_guard<std::mutex> lock(_readerMutex);
+            if(--_readerPending == 0)
+                _readerDone.notify_one();
+        }
+    }
+
+    void PerfClient::perfStopReaders() {
+        {
+            std::lock_guard<std::mutex> lock(_readerMutex);
+            _readerStop = true;
+        }
+        _readerWake.notify_all();
+        for(auto& reader : _readers)
+            reader.join();
+        _readers.clear();
     }
 
     void PerfClient::perfClose() {
-        perfResetSpecific(&_fdGlobalCounters);
-        for(auto& x : _fdVMCounters){
-            perfResetSpecific(&x.second);
+        perfStopReaders();
+        std::lock_guard<std::mutex> guard(_vmMutex);
+        perfCloseSpecific(&_globalCounters);
+        for(auto& x : _vmCounters){
+            perfCloseSpecific(&x.second);
             close(std::get<0>(_fdVmCgroup[x.first]));
             _fdVmCgroup.erase(x.first);
         }
+        for(auto& x : _vcpuCounters)
+            perfCloseVcpus(&x.second);
+        _vcpuCounters.clear();
+        for(auto& vm : _stoppedVMs){
+            perfCloseSpecific(&vm.counters);
+            perfCloseVcpus(&vm.vcpus);
+            close(vm.cgroupFd);
+        }
+        _stoppedVMs.clear();
         utils::logging::info("Perf counters closed");
     }
 
-    void PerfClient::perfCloseSpecific(std::unordered_map<std::string ,std::vector<int> >* fdMap) {
-        for (auto& it: (*fdMap))
-            for(int i=0;i<_numCPU;i++)
-                fdClose(it.second.at(i));
+    void PerfClient::perfCloseSpecific(PerfCounters* counters) {
+        for (auto& cpu: (*counters))
+            for (auto& group: cpu){
+                ioctl(group.fds[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+                for (auto fd: group.fds)
+                    close(fd);
+            }
     }
 
-    int PerfClient::fdStart(int pid, int cpu, int perf_flags, perf_type_id type, int event) {
+    /**
+     * Open a counter, as a standalone leader if group_fd is -1, as a group member otherwise
+     * Returns -1 on failure, only logged for leaders as failing to join a group is recovered by the caller
+     */
+    int PerfClient::fdStart(int pid, int cpu, int perf_flags, perf_type_id type, int event, int group_fd) {
         struct perf_event_attr pe;
         int fd;
         perf_flags |= PERF_FLAG_FD_CLOEXEC;
@@ -200,73 +789,75 @@ namespace server {
         pe.type = type;
         pe.size = sizeof(pe);
         pe.config = event;
-        pe.disabled = 1;
+        pe.disabled = (group_fd == -1); // members follow their leader
+        pe.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_ID | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
 	    pe.exclude_user = 0;
 		pe.exclude_kernel = 0;
 		pe.exclude_hv = 0;
 		pe.exclude_idle = 0;
 
-        try
-        {
-            fd = perfEventOpen(&pe, pid, cpu, -1, perf_flags);
-        }
-        catch (std::exception& e)
-        {
-            std::cerr << "Exception caught : " << e.what() << std::endl;
-        }
-        
-        if (fd == -1) {
+        fd = perfEventOpen(&pe, pid, cpu, group_fd, perf_flags);
+
+        if (fd == -1 && group_fd == -1) {
             utils::logging::error ("PerfClient::fdStart Failed to initialize a counter, eventtype", type, "eventcode", event, "on core", cpu);
             utils::logging::error ("Errno", strerror(errno));
-            throw ProbeError("PerfClient::fdStart failed\n");
         }
         return fd;
     }
 
-    const long long PerfClient::fdRead(int fd){
-        long long count;
-        read(fd, &count, sizeof(count));
-        return count;
-    }
-
-    void PerfClient::fdClose (int fd) {
-        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
-        close(fd);
-    }
-
     long PerfClient::perfEventOpen(struct perf_event_attr *hw_event, pid_t pid, int cpu, int group_fd, unsigned long flags){
         int ret;
         ret = syscall(__NR_perf_event_open, hw_event, pid, cpu, group_fd, flags);
         return ret;
     }
 
-    void PerfClient::readSchedStat(Dump* dump){
-        readNodeSchedStat(dump);
-        readVmSchedStat(dump);
-    }
-
     void PerfClient::readVmSchedStat(Dump* dump){
-        for(auto x : _fdVMCounters)
+        std::lock_guard<std::mutex> guard(_vmMutex);
+        _pidGeneration++;
+        for(auto& x : _vmCounters)
             readVmStatSpecific(dump, x.first, std::get<1>(_fdVmCgroup[x.first]));
+        // Release series of stopped VMs
+        for(auto it = _vmProcfsMetrics.begin(); it != _vmProcfsMetrics.end();){
+            if(_vmCounters.find(it->first) == _vmCounters.end()){
+                for(auto id : it->second)
+                    dump->releaseMetric(id);
+                it = _vmProcfsMetrics.erase(it);
+            }
+            else
+                ++it;
+        }
+        // Forget processes which were not seen during this session
+        for(auto it = _pidFiles.begin(); it != _pidFiles.end();){
+            if(it->second.generation != _pidGeneration){
+                _vmPids.erase(it->first);
+                it = _pidFiles.erase(it);
+            }
+            else
+                ++it;
+        }
     }
 
     void PerfClient::readNodeSchedStat(Dump* dump){
-        std::ifstream schedstat ("/proc/schedstat");
-        std::string schedstatline;
         unsigned long long runtime = 0;
         unsigned long long waittime = 0;
         unsigned long long timeslices = 0;
-        while (std::getline(schedstat, schedstatline))
-            if (schedstatline.rfind("cpu", 0) == 0) // filter lines
-                readSchedStatLine(schedstatline, &runtime, &waittime, &timeslices);
-        dump->addGlobalMetric("sched_runtime", runtime);
-        dump->addGlobalMetric("sched_waittime", waittime);
-        dump->addGlobalMetric("sched_timeslices", timeslices);
+        char buffer[PROCFS_BUFFER_SIZE];
+        if(!_schedstatFile.isOpen())
+            _schedstatFile.open((_procRoot + "/schedstat").c_str());
+        _schedstatFile.forEachLine(buffer, sizeof(buffer), [&](const char* line, const char* end){
+            if (end - line > 3 && strncmp(line, "cpu", 3) == 0) // filter lines
+                readSchedStatLine(line, end, &runtime, &waittime, &timeslices);
+        });
+        if(_globalSchedMetrics.empty())
+            for(int i=0;i<HOST_SCHED_KEYS;i++)
+                _globalSchedMetrics.push_back(dump->registerGlobalMetric(hostSchedKeys[i], COUNTER, hostSchedHelp[i]));
+        MetricId* metrics = _globalSchedMetrics.data();
+        dump->set(metrics[HOST_SCHED_RUNTIME], runtime);
+        dump->set(metrics[HOST_SCHED_WAITTIME], waittime);
+        dump->set(metrics[HOST_SCHED_TIMESLICES], timeslices);
     }
 
-    void PerfClient::readVmStatSpecific(Dump* dump, std::string vmname, std::string vmCgroupFs){
-        std::ifstream cgroupfile (vmCgroupFs + "/cgroup.procs");
-        std::string strpid;
+    void PerfClient::readVmStatSpecific(Dump* dump, const std::string& vmname, const std::string& vmCgroupFs){
         // Metrics to be retrieved
         unsigned long long runtime = 0;
         unsigned long long waittime = 0;
@@ -278,106 +869,142 @@ namespace server {
         unsigned long vsize= 0;
         unsigned long rss = 0;
         unsigned long rsslim = 0;
-        std::string schedstatline;
-        std::string statline;
-        // Iterate through pids of a given VM and sum its poi
-        while (std::getline(cgroupfile, strpid)){
-            std::ifstream stat("/proc/" + strpid + "/stat");
-            if(std::getline(stat, statline)){
-                readStatLine(statline, &minflt, &cminflt, &majflt, &cmajflt, &vsize, &rss, &rsslim);
-            }
-            stat.close();
-            std::ifstream schedstat("/proc/" + strpid + "/schedstat");
-            if(std::getline(schedstat, schedstatline)){
-                readSchedStatLine(schedstatline, &runtime, &waittime, &timeslices);
+        char buffer[PROCFS_BUFFER_SIZE];
+        char line[PROCFS_LINE_SIZE];
+        std::vector<utils::ProcFile>& procs = _vmProcs[vmname];
+        if(procs.empty()) // sub-cgroups may appear after the VM was detected
+            for(const auto& path : _cgroups.retrieveProcsFiles(vmCgroupFs)){
+                procs.emplace_back();
+                procs.back().open(path.c_str());
             }
-            schedstat.close();
-        }
-        cgroupfile.close();
-        dump->addSpecificMetric(vmname, "stat_minflt", minflt);
-        dump->addSpecificMetric(vmname, "stat_cminflt", cminflt);
-        dump->addSpecificMetric(vmname, "stat_majflt", majflt);
-        dump->addSpecificMetric(vmname, "stat_cmajflt", cmajflt);
-        dump->addSpecificMetric(vmname, "stat_vsize", vsize); // in bytes
-        dump->addSpecificMetric(vmname, "stat_rss", rss); // in pages
-        dump->addSpecificMetric(vmname, "stat_rsslim", rsslim); // in bytes
-        dump->addSpecificMetric(vmname, "sched_runtime", runtime);
-        dump->addSpecificMetric(vmname, "sched_waittime", waittime);
-        dump->addSpecificMetric(vmname, "sched_timeslices", timeslices);
-    }
-
-    void PerfClient::readSchedStatLine(std::string schedstatline, unsigned long long* runtime, unsigned long long* waittime, unsigned long long* timeslices){
-        size_t size;
-        std::vector<std::string> datasched = readLine(schedstatline, &size);
+        bool found = false;
+        // Iterate through pids of a given VM and sum its poi
+        for(auto& procsFile : procs)
+            procsFile.forEachLine(buffer, sizeof(buffer), [&](const char* strpid, const char* end){
+                unsigned long long pid;
+                if(utils::scanU64(strpid, end, &pid) == strpid)
+                    return;
+                found = true;
+                PidFiles& files = _pidFiles[pid];
+                if(files.generation == 0 || files.vmname != vmname){ // new process, rescan or pid reused by another VM
+                    snprintf(line, sizeof(line), "%s/%llu/stat", _procRoot.c_str(), pid);
+                    files.stat.open(line);
+                    snprintf(line, sizeof(line), "%s/%llu/schedstat", _procRoot.c_str(), pid);
+                    files.schedstat.open(line);
+                    files.vmname = vmname;
+                    _vmPids[pid] = vmname;
+                }
+                files.generation = _pidGeneration;
+                ssize_t size = files.stat.read(line, sizeof(line));
+                if(size > 0)
+                    readStatLine(line, line + size, &minflt, &cminflt, &majflt, &cmajflt, &vsize, &rss, &rsslim);
+                size = files.schedstat.read(line, sizeof(line));
+                if(size > 0)
+                    readSchedStatLine(line, line + size, &runtime, &waittime, &timeslices);
+            });
+        if(!found)
+            procs.clear(); // resolved again at next session
+        MetricId* metrics = procfsMetrics(dump, vmname)->data();
+        dump->set(metrics[VM_STAT_MINFLT], minflt);
+        dump->set(metrics[VM_STAT_CMINFLT], cminflt);
+        dump->set(metrics[VM_STAT_MAJFLT], majflt);
+        dump->set(metrics[VM_STAT_CMAJFLT], cmajflt);
+        dump->set(metrics[VM_STAT_VSIZE], vsize); // in bytes
+        dump->set(metrics[VM_STAT_RSS], rss); // in pages
+        dump->set(metrics[VM_STAT_RSSLIM], rsslim); // in bytes
+        dump->set(metrics[VM_SCHED_RUNTIME], runtime);
+        dump->set(metrics[VM_SCHED_WAITTIME], waittime);
+        dump->set(metrics[VM_SCHED_TIMESLICES], timeslices);
+    }
+
+    void PerfClient::readSchedStatLine(const char* schedstatline, const char* end, unsigned long long* runtime, unsigned long long* waittime, unsigned long long* timeslices){
+        //format is "[...] <timerun> <timewait> <timslicesrun>", keep the last three fields
+        const char* fields[3] = {nullptr, nullptr, nullptr};
+        int size = 0;
+        const char* p = schedstatline;
+        while(true){
+            while(p < end && (*p == ' ' || *p == '\n'))
+                p++;
+            if(p == end)
+                break;
+            fields[0] = fields[1];
+            fields[1] = fields[2];
+            fields[2] = p;
+            size++;
+            while(p < end && *p != ' ' && *p != '\n')
+                p++;
+        }
         if(size<3){
-            utils::logging::warn("Unexpected schedstat format encountered : ", schedstatline);
+            utils::logging::warn("Unexpected schedstat format encountered : ", std::string(schedstatline, end));
             return;
         }
-        //format is "[...] <timerun> <timewait> <timslicesrun>"
-        *runtime+=std::stoul(datasched[size-3].c_str());
-        *waittime+=std::stoul(datasched[size-2].c_str());
-        *timeslices+=std::stoul(datasched[size-1].c_str());
+        unsigned long long value;
+        utils::scanU64(fields[0], end, &value);
+        *runtime+=value;
+        utils::scanU64(fields[1], end, &value);
+        *waittime+=value;
+        utils::scanU64(fields[2], end, &value);
+        *timeslices+=value;
     }
 
-    void PerfClient::readStatLine(std::string stat, unsigned long* minflt, unsigned long* cminflt, unsigned long* majflt, 
+    void PerfClient::readStatLine(const char* stat, const char* end, unsigned long* minflt, unsigned long* cminflt, unsigned long* majflt, 
                                 unsigned long* cmajflt, unsigned long* vsize, unsigned long* rss, unsigned long* rsslim){
-        size_t size;
-        std::vector<std::string> datastat = readLine(stat, &size);
-        if(size<20){
-            utils::logging::warn("Unexpected schedstat format encountered : ", stat);
+        //From /proc/[pid]/stat : https://man7.org/linux/man-pages/man5/proc.5.html
+        // comm (2) may contain spaces and parenthesis, fields are counted from the last ')'
+        const char* p = end;
+        while(p > stat && *(p-1) != ')')
+            p--;
+        if(p == stat){
+            utils::logging::warn("Unexpected stat format encountered : ", std::string(stat, end));
             return;
         }
-        //From /proc/[pid]/stat : https://man7.org/linux/man-pages/man5/proc.5.html
-        *minflt+= std::stoul(datastat[10-1].c_str());
-        *cminflt+= std::stoul(datastat[11-1].c_str());
-        *majflt+= std::stoul(datastat[12-1].c_str());
-        *cmajflt+= std::stoul(datastat[13-1].c_str());
-        *vsize+= std::stoul(datastat[23-1].c_str());
-        *rss+= std::stoul(datastat[24-1].c_str()); // reported as inaccurate
-        *rsslim+= std::stoul(datastat[25-1].c_str());
-    }
-
-    // Return a procfs file in an array format
-    std::vector<std::string> PerfClient::readLine(std::string statline, size_t* size){
-        *size = std::count(statline.begin(), statline.end(), ' ')+1;
-        std::vector<std::string> arr(*size);
-        int i = 0;
-        std::stringstream ssin(statline);
-        while (ssin.good() && i < *size){
-            ssin >> arr[i];
-            ++i;
+        unsigned long long values[4];
+        p = utils::skipFields(p, end, 7); // state (3) to flags (9)
+        for(int i=0;i<4;i++) // minflt (10) to cmajflt (13)
+            p = utils::scanU64(p, end, &values[i]);
+        p = utils::skipFields(p, end, 9); // utime (14) to starttime (22)
+        if(p == end){
+            utils::logging::warn("Unexpected stat format encountered : ", std::string(stat, end));
+            return;
         }
-        return arr;
+        *minflt+= values[0];
+        *cminflt+= values[1];
+        *majflt+= values[2];
+        *cmajflt+= values[3];
+        for(int i=0;i<3;i++) // vsize (23), rss (24) and rsslim (25)
+            p = utils::scanU64(p, end, &values[i]);
+        *vsize+= values[0];
+        *rss+= values[1]; // reported as inaccurate
+        *rsslim+= values[2];
     }
 
     const long long PerfClient::readCPUFrequency () {
-	    if (this-> _cpuPath.size () != (size_t)this-> _numCPU ) {
+        char buffer[PROCFS_LINE_SIZE];
+        unsigned long long freq;
+	    if (this-> _cpuFreqFiles.size () != (size_t)this-> _numCPU ) {
+            this-> _cpuFreqFiles.resize(this-> _numCPU);
             for (int i = 0 ; i < this-> _numCPU; i++) {
-                std::stringstream path;
-                path << "/sys/devices/system/cpu/cpu" << i << "/cpufreq/scaling_cur_freq";
-                this-> _cpuPath.push_back (path.str ());
+                snprintf(buffer, sizeof(buffer), "%s/devices/system/cpu/cpu%d/cpufreq/scaling_cur_freq", _sysRoot.c_str(), _cpus[i]);
+                this-> _cpuFreqFiles[i].open(buffer);
             }
-            std::ifstream f0 ("/sys/devices/system/cpu/cpu0/cpufreq/cpuinfo_max_freq");
-            std::stringstream buffer;
-            buffer << f0.rdbuf();
-            buffer >> _maxFreqCPU;
-            f0.close();
-            buffer.str("");
-            buffer.clear();
-            std::ifstream f1 ("/sys/devices/system/cpu/cpu0/cpufreq/cpuinfo_min_freq");
-            buffer << f1.rdbuf();
-            buffer >> _minFreqCPU;
-            f1.close();
+            utils::ProcFile f;
+            std::string cpufreq = _sysRoot + "/devices/system/cpu/cpu" + std::to_string(_cpus[0]) + "/cpufreq/";
+            f.open((cpufreq + "cpuinfo_max_freq").c_str());
+            ssize_t size = f.read(buffer, sizeof(buffer));
+            utils::scanU64(buffer, buffer + (size > 0 ? size : 0), &freq);
+            _maxFreqCPU = freq;
+            f.open((cpufreq + "cpuinfo_min_freq").c_str());
+            size = f.read(buffer, sizeof(buffer));
+            utils::scanU64(buffer, buffer + (size > 0 ? size : 0), &freq);
+            _minFreqCPU = freq;
 	    }
 
         long long sum = 0;
-        unsigned int freq;
 	    for (int i = 0 ; i < this-> _numCPU; i++) {
-            std::ifstream f (this-> _cpuPath[i]);
-            std::stringstream buffer;
-            buffer << f.rdbuf();
-            buffer >> freq;
-            f.close();
+            ssize_t size = this-> _cpuFreqFiles[i].read(buffer, sizeof(buffer));
+            if (size <= 0)
+                continue;
+            utils::scanU64(buffer, buffer + size, &freq);
             sum+=freq;
 	    }
 
@@ -386,41 +1013,40 @@ namespace server {
 
     const void PerfClient::addHostMemoryUsage(Dump* dump){
         // We don't use sysinfo as memAvailable is not directly exposed
-        unsigned long memTotal, memAvailable, memFree, buffers, cached;
-        std::ifstream infile("/proc/meminfo");
-
-        infile.ignore(18, ' '); 
-        infile >> memTotal;
-        infile.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
-
-        infile.ignore(18, ' '); 
-        infile >> memFree;
-        infile.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+        unsigned long long memTotal = 0, memAvailable = 0, memFree = 0, buffers = 0, cached = 0;
+        char buffer[PROCFS_BUFFER_SIZE];
+        if(!_meminfoFile.isOpen())
+            _meminfoFile.open((_procRoot + "/meminfo").c_str());
+        // Lines are formatted as "MemTotal:       16318720 kB"
+        _meminfoFile.forEachLine(buffer, sizeof(buffer), [&](const char* line, const char* end){
+            if (strncmp(line, "MemTotal:", 9) == 0)
+                utils::scanU64(line + 9, end, &memTotal);
+            else if (strncmp(line, "MemFree:", 8) == 0)
+                utils::scanU64(line + 8, end, &memFree);
+            else if (strncmp(line, "MemAvailable:", 13) == 0)
+                utils::scanU64(line + 13, end, &memAvailable);
+            else if (strncmp(line, "Buffers:", 8) == 0)
+                utils::scanU64(line + 8, end, &buffers);
+            else if (strncmp(line, "Cached:", 7) == 0)
+                utils::scanU64(line + 7, end, &cached);
+        });
 
-        infile.ignore(18, ' '); 
-        infile >> memAvailable;
-        infile.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
-        
-        infile.ignore(18, ' ');
-        infile >> buffers;
-        infile.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
-        
-        infile.ignore(18, ' '); 
-        infile >> cached;
-
-        infile.close();
-
-        dump->addGlobalMetric("memory_total", memTotal);
-        dump->addGlobalMetric("memory_free", memFree);
-        dump->addGlobalMetric("memory_buffers", buffers);
-        dump->addGlobalMetric("memory_cached", cached);
-        dump->addGlobalMetric("memory_available", memAvailable);
+        MetricId* metrics = procfsMetrics(dump, "")->data();
+        dump->set(metrics[HOST_MEMORY_TOTAL], memTotal);
+        dump->set(metrics[HOST_MEMORY_FREE], memFree);
+        dump->set(metrics[HOST_MEMORY_BUFFERS], buffers);
+        dump->set(metrics[HOST_MEMORY_CACHED], cached);
+        dump->set(metrics[HOST_MEMORY_AVAILABLE], memAvailable);
     }
 
     const int PerfClient::getVCPUs() {
         return _numCPU;
     }
 
+    const std::unordered_map<int, std::string>& PerfClient::getVmPids() {
+        return _vmPids;
+    }
+
     const int PerfClient::getMaxFreq() {
         return _maxFreqCPU;
     }
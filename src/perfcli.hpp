@@ -8,9 +8,15 @@
 #include <asm/unistd.h>
 #include <vector>
 #include "dump.hpp"
+#include "cgroup.hpp"
+#include "utils/procfs.hpp"
 #include <unordered_map>
+#include <unordered_set>
 #include <bits/stdc++.h>
 #include <tuple>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 namespace server {
 	/**
@@ -54,45 +60,282 @@ namespace server {
 		{"PERF_COUNT_SW_BPF_OUTPUT", perf_sw_ids::PERF_COUNT_SW_BPF_OUTPUT}
 	};
 
+	/**
+	 * An event to be opened on every target, as read from the configuration
+	 */
+	struct PerfEvent {
+		std::string name;
+		perf_type_id type;
+		int config;
+		std::string metric; // dump key, computed once
+	};
+
+	/**
+	 * Counters sharing a leader, read at once with PERF_FORMAT_GROUP
+	 * Without grouping, each event is opened as a group of one
+	 */
+	struct PerfGroup {
+		std::vector<int> fds; // fds[0] is the leader
+		std::vector<int> events; // index in _events of each member, in read order
+		std::vector<unsigned long long> ids; // kernel id of each member (PERF_FORMAT_ID)
+		unsigned long long enabled = 0; // time_enabled at last read, not cleared by resets
+		unsigned long long running = 0; // time_running at last read, not cleared by resets
+		// Monotonic mode only, per member : raw value at last read and sum of the scaled deltas since the group was opened
+		std::vector<unsigned long long> last;
+		std::vector<unsigned long long> totals;
+	};
+
+	typedef std::vector<std::vector<PerfGroup>> PerfCounters; // [cpu][group]
+
+	#define CACHE_LINE_SIZE 64
+
+	/**
+	 * Allocations start on a cache line and are padded to a whole number of cache lines
+	 */
+	template <typename T>
+	struct CacheLineAllocator {
+		typedef T value_type;
+
+		CacheLineAllocator() = default;
+
+		template <typename U>
+		CacheLineAllocator(const CacheLineAllocator<U>&) {}
+
+		T* allocate(size_t n) {
+			size_t size = (n * sizeof(T) + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+			return static_cast<T*>(::operator new(size, std::align_val_t(CACHE_LINE_SIZE)));
+		}
+
+		void deallocate(T* p, size_t) {
+			::operator delete(p, std::align_val_t(CACHE_LINE_SIZE));
+		}
+
+		template <typename U>
+		bool operator==(const CacheLineAllocator<U>&) const { return true; }
+
+		template <typename U>
+		bool operator!=(const CacheLineAllocator<U>&) const { return false; }
+	};
+
+	template <typename T>
+	using CacheLineVector = std::vector<T, CacheLineAllocator<T>>;
+
+	/**
+	 * Accumulators for one read session, laid out as [target * events + event]
+	 * Reader threads each own one, its arrays are on cache lines of their own so that two threads never write to the same line
+	 */
+	struct PerfReadBuffer {
+		CacheLineVector<long long> values;
+		CacheLineVector<unsigned long long> enabled; // time enabled during the last period, summed over cpus
+		CacheLineVector<unsigned long long> running; // time running during the last period, summed over cpus
+		CacheLineVector<unsigned long long> totals; // monotonic mode only, scaled counts since the counters were opened, summed over cpus
+		CacheLineVector<unsigned long long> group; // PERF_FORMAT_GROUP layout, sized for the largest group
+
+		void reset(size_t targets, size_t events);
+
+		/**
+		 * Add row from to row to (e.g. a per-cpu row to its target), rows are contiguous so that this loop is vectorized
+		 */
+		void addRow(size_t to, size_t from, size_t events);
+	};
+
+	/**
+	 * Host counters summed by topology level (socket, node or cpu), from the per-cpu rows of a read buffer
+	 */
+	struct PerfBreakdown {
+		std::string label; // socket, node or cpu
+		std::vector<int> groups; // index of the group of each cpu
+		std::vector<int> ids; // id of each group, as named by sysfs
+		std::vector<long long> values; // [group * events + event]
+		std::vector<MetricId> metrics; // same layout
+	};
+
+	/**
+	 * procfs files of a VM process, generation tells the last session it was seen in (0 to open them again)
+	 */
+	struct PidFiles {
+		utils::ProcFile stat;
+		utils::ProcFile schedstat;
+		std::string vmname;
+		unsigned long long generation = 0;
+	};
+
+	/**
+	 * Counters attached to the thread of a vCPU, following it across cpus (a single [cpu] entry opened on any cpu)
+	 */
+	struct VcpuCounters {
+		int tid;
+		PerfCounters counters;
+	};
+
+	typedef std::map<int, VcpuCounters> VcpusCounters; // id : vcpu index
+
+	/**
+	 * Sum of a perf series over the samples of a read session, when counters are sampled several times per session
+	 */
+	struct PerfSessionSum {
+		long long value = 0;
+		unsigned long long enabled = 0;
+		unsigned long long running = 0;
+		MetricId multiplex = -1; // ratio series of the event, -1 if it has none (breakdowns)
+		bool set = false;
+	};
+
+	/**
+	 * Counters of a VM that stopped since the last read, read one last time then closed
+	 * Its series are released at the following read, once the last values were dumped
+	 */
+	struct StoppedVM {
+		std::string name;
+		PerfCounters counters;
+		int cgroupFd;
+		VcpusCounters vcpus;
+		bool read = false;
+	};
+
     class PerfClient {
 
 		private:
 		
         int _numCPU;
+		std::vector<int> _cpus; // ids of the online cpus, per-cpu rows and counters are indexed by position in this list
+		std::string _procRoot;
+		std::string _sysRoot;
 		int _minFreqCPU;
 		int _maxFreqCPU;
+
+		std::vector<PerfEvent> _events;
+		PerfReadBuffer _buffer; // reused at each read
+
+		// Optional reader threads, each pinned on a cpu or a NUMA node and reading only the counters of its cpus
+		std::vector<std::thread> _readers;
+		std::vector<std::vector<int>> _readerCpus; // positions in _cpus
+		std::vector<PerfReadBuffer> _readerBuffers;
+		std::vector<PerfCounters*> _readerTargets; // targets of the current read session, global first
+		std::mutex _readerMutex;
+		std::condition_variable _readerWake;
+		std::condition_variable _readerDone;
+		unsigned long long _readerCycle;
+		int _readerPending;
+		bool _readerStop;
 		
-		std::unordered_map<std::string, std::vector<int> > _fdGlobalCounters; // id = event_name
-		std::unordered_map<std::string, std::unordered_map<std::string ,std::vector<int> >> _fdVMCounters; // id=vmname
+		// Protect VM counters and their files, VMs may be started or stopped by the libvirt event thread
+		std::mutex _vmMutex;
+		bool _enabled;
+		bool _monotonic; // counters are never reset, deltas are computed from the values of the previous read
+		bool _sampled; // read several times per session, series are set to the sums of the session by perfSessionEnd
+		std::vector<PerfSessionSum> _sessionSums; // indexed by MetricId of the value series
+
+		PerfCounters _globalCounters;
+		// Optional breakdown of host counters, their per-cpu values are then kept as rows after the targets of the read buffers
+		std::vector<PerfBreakdown> _breakdowns;
+		std::unordered_map<std::string, PerfCounters> _vmCounters; // id=vmname
+		std::unordered_map<std::string, VcpusCounters> _vcpuCounters; // id=vmname, only VMs opted in with perfvcpu
+		std::unordered_set<std::string> _vcpuMissing; // VMs whose processes have no vCPU thread, searched again at the next rescan
+		std::vector<StoppedVM> _stoppedVMs;
 		std::unordered_map<std::string, std::tuple<int, std::string>> _fdVmCgroup; // id : vmname = tuple<fd, procfspath>
+		std::unordered_map<int, std::string> _vmPids; // id : pid = vmname, refreshed by readVmSchedStat
 
-	    std::vector <std::string> _cpuPath;
+		// Registered dump series, value and multiplex ratio of each perf event, followed by its total in monotonic mode
+		std::vector<MetricId> _globalMetrics;
+		std::unordered_map<std::string, std::vector<MetricId>> _vmMetrics; // id : vmname
+		// procfs series, they may be registered in another dump than the perf ones (collector threads)
+		std::vector<MetricId> _globalProcfsMetrics;
+		std::unordered_map<std::string, std::vector<MetricId>> _vmProcfsMetrics; // id : vmname
+		std::vector<MetricId> _globalSchedMetrics; // host /proc/schedstat, its own collector
+		std::unordered_map<std::string, std::map<int, std::vector<MetricId>>> _vcpuMetrics; // id : vmname, then vcpu index
 
-		int fdStart(int pid, int cpu, int perf_flags, perf_type_id type, int event);
+		// procfs and sysfs files are kept open and re-read with pread
+		std::unordered_map<std::string, std::vector<utils::ProcFile>> _vmProcs; // id : vmname = cgroup.procs of each of its cgroups
+		std::unordered_map<int, PidFiles> _pidFiles; // id : pid
+		unsigned long long _pidGeneration;
+		utils::ProcFile _schedstatFile;
+		utils::ProcFile _meminfoFile;
+	    std::vector <utils::ProcFile> _cpuFreqFiles;
 
-		const long long fdRead(int fd);
+		CgroupClient _cgroups;
 
-		void fdClose(int fd);
+		int fdStart(int pid, int cpu, int perf_flags, perf_type_id type, int event, int group_fd);
 
 		long perfEventOpen(struct perf_event_attr *hw_event, pid_t pid, int cpu, int group_fd, unsigned long flags);
 
-		void perfRefreshVMs();
+		void perfLoadEvents();
+
+		std::vector<MetricId>* perfMetrics(Dump* dump, const std::string& vmname);
+
+		std::vector<MetricId>* procfsMetrics(Dump* dump, const std::string& vmname);
 
 		void perfInitVM(std::string vmName, std::string vmCgroupPath);
 
-		void perfEnableSpecific(std::unordered_map<std::string ,std::vector<int> >* fdMap);
+		void perfDetachVM(const std::string& vmname);
+
+		bool perfVcpuEnabled(const std::string& vmname);
+
+		/**
+		 * Match the threads of a VM named "CPU n/KVM" by QEMU and open a counter set on each of them
+		 * Counters of vCPUs whose thread changed (unplug, restart) are closed
+		 */
+		void perfRefreshVcpus(const std::string& vmname);
+
+		void perfReadVcpus(const std::string& vmname, VcpusCounters* vcpus, Dump* dump);
+
+		void perfCloseVcpus(VcpusCounters* vcpus);
+
+		void perfReleaseStopped(Dump* dump);
+
+		void perfEnableSpecific(PerfCounters* counters);
+
+		void perfResetSpecific(PerfCounters* counters);
+
+		void perfCloseSpecific(PerfCounters* counters);
+
+		void perfReadSpecific(const std::string& qualifier, PerfCounters* counters, Dump* dump);
+
+		void perfReadWithReaders(Dump* dump);
+
+		/**
+		 * Host counters when they are broken down, per-cpu rows start at cpuRow
+		 */
+		void perfReadGlobal(Dump* dump);
+
+		void perfLoadTopology();
+
+		/**
+		 * Cpus of each online NUMA node, by node id (node ids may have gaps), empty without NUMA information
+		 */
+		std::map<int, std::vector<int>> perfLoadNodes();
+
+		/**
+		 * Position of cpu in _cpus, -1 if it is not online
+		 */
+		int perfCpuPosition(int cpu);
+
+		void perfDumpBreakdowns(PerfReadBuffer* buffer, size_t cpuRow, Dump* dump);
+
+		void perfReadCPU(PerfCounters* counters, int cpu, PerfReadBuffer* buffer, size_t target, bool reset);
 
-		void perfResetSpecific(std::unordered_map<std::string ,std::vector<int> >* fdMap);
+		void perfReadGroup(PerfGroup* group, PerfReadBuffer* buffer, size_t target);
 
-		void perfCloseSpecific(std::unordered_map<std::string ,std::vector<int> >* fdMap);
+		void perfDumpSpecific(const std::string& qualifier, PerfReadBuffer* buffer, size_t target, Dump* dump);
 
-		void perfReadSpecific(std::string qualifier, std::unordered_map<std::string ,std::vector<int> >* fdMap, Dump* dump);
+		void perfDumpValues(const std::vector<MetricId>& metrics, PerfReadBuffer* buffer, size_t target, Dump* dump);
 
-		void perfSetCounters(std::unordered_map<std::string ,std::vector<int> >* fdMap, int pid, int flag);
+		void perfSessionAdd(MetricId id, MetricId multiplex, long long value, unsigned long long enabled, unsigned long long running);
 
-		std::vector<std::string> readLine(std::string line, size_t* size);
+		void perfStartReaders(std::string mode);
 
-		std::unordered_map<std::string, std::string> retrieveCgroupsVM();
+		void perfReaderLoop(int reader);
+
+		void perfStopReaders();
+
+		/**
+		 * Open all events on each cpu for pid (a cgroup fd with PERF_FLAG_PID_CGROUP, -1 for the whole system)
+		 * With perThread, pid is a thread followed on any cpu and a single [cpu] entry is opened
+		 */
+		void perfSetCounters(PerfCounters* counters, int pid, int flag, bool perThread=false);
+
+		// Microbenchmarks of the read path (bench/bench_perf.cpp)
+		friend class PerfBench;
 
 		public: 
 		
@@ -100,28 +343,58 @@ namespace server {
 
 		/**
 		 * Start the different part of the daemon
+		 * When sampled, perfRead is called several times per read session and perfSessionEnd once at its end
 		 */
-		void perfInit();
+		void perfInit(bool sampled = false);
 
 		void perfEnable();
 
+		/**
+		 * Look for started and stopped VMs in the cgroup hierarchy and open or close their counters
+		 * Without libvirt events it must be called before perfRead at each read session, otherwise it is a slower consistency check
+		 */
+		void perfRefreshVMs();
+
+		/**
+		 * Open counters of a VM as soon as it started, may be called from another thread
+		 */
+		void perfStartVM(const std::string& vmname);
+
+		/**
+		 * Detach counters of a stopped VM, they are read one last time and closed at the next read session
+		 * May be called from another thread
+		 */
+		void perfStopVM(const std::string& vmname);
+
+		/**
+		 * Reset all counters after a read, does nothing in monotonic mode
+		 */
 		void perfReset();
 
+		/**
+		 * Series are set to the values of the last read, and also summed over the session when sampled
+		 */
 		void perfRead(Dump* dump);
 
-		void perfClose();
+		/**
+		 * Set the series read during the session to their sums (multiplex ratios to the share of the whole session) and start a new session
+		 */
+		void perfSessionEnd(Dump* dump);
 
-		void readSchedStat(Dump* dump);
+		void perfClose();
 
 		void readVmSchedStat(Dump* dump);
 
 		void readNodeSchedStat(Dump* dump);
 
-		void readVmStatSpecific(Dump* dump, std::string vmname, std::string vmcgroupfs);
+		void readVmStatSpecific(Dump* dump, const std::string& vmname, const std::string& vmcgroupfs);
 
-		void readSchedStatLine(std::string schedstatline, unsigned long long* runtime, unsigned long long* waittime, unsigned long long* timeslices);
+		/**
+		 * Parsers of procfs lines, values are added to the given accumulators
+		 */
+		void readSchedStatLine(const char* schedstatline, const char* end, unsigned long long* runtime, unsigned long long* waittime, unsigned long long* timeslices);
 
-		void readStatLine(std::string stat, unsigned long* minflt, unsigned long* cminflt, unsigned long* majflt, 
+		void readStatLine(const char* stat, const char* end, unsigned long* minflt, unsigned long* cminflt, unsigned long* majflt, 
                                 unsigned long* cmajflt, unsigned long* vsize, unsigned long* rss, unsigned long* rsslim);
 
 		const long long readCPUFrequency();
@@ -130,6 +403,8 @@ namespace server {
 
 		const int getVCPUs();
 
+		const std::unordered_map<int, std::string>& getVmPids();
+
 		const int getMinFreq();
 
 		const int getMaxFreq();
@@ -147,18 +422,4 @@ namespace server {
 			s.end(), [](unsigned char c) { return !std::isdigit(c); }) == s.end();
 	}
 
-	static void findAndReplaceAll(std::string & data, std::string toSearch, std::string replaceStr)
-	{
-		// Get the first occurrence
-		size_t pos = data.find(toSearch);
-		// Repeat till end is reached
-		while( pos != std::string::npos)
-		{
-			// Replace this occurrence of Sub String
-			data.replace(pos, toSearch.size(), replaceStr);
-			// Get the next occurrence from the current position
-			pos =data.find(toSearch, pos + replaceStr.size());
-		}
-	}
-
 }
@@ -0,0 +1,101 @@
+#include "profiler.hpp"
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "sampler.hpp"
+#include "utils/procfs.hpp"
+#include "utils/log.hpp"
+
+#define SYSCALL_TRACEPOINT "raw_syscalls:sys_enter"
+
+namespace server {
+
+    // Indexed by ProbePhase
+    static const char* const phaseNames[PROBE_PHASES] = {"perf_refresh", "perf_read", "schedstat", "procfs", "sampler", "libvirt_node", "libvirt_domains", "dump"};
+
+    /**
+     * Counter of the calling thread, opened lazily and closed when the thread exits
+     */
+    struct ThreadSyscalls {
+        int fd = -2; // -2 not opened yet, -1 not available
+        ~ThreadSyscalls() {
+            if(fd >= 0)
+                close(fd);
+        }
+    };
+    static thread_local ThreadSyscalls threadSyscalls;
+
+    PhaseProfiler::PhaseProfiler() : _syscallConfig(-1) {}
+
+    void PhaseProfiler::profilerInit(Dump* dump) {
+        _syscallConfig = PerfSampler::tracepointId(SYSCALL_TRACEPOINT);
+        if(_syscallConfig < 0)
+            utils::logging::warn("PhaseProfiler::profilerInit syscalls will not be counted, unable to open", SYSCALL_TRACEPOINT);
+        for(int i = 0; i < PROBE_PHASES; i++){
+            PhaseStats& phase = _phases[i];
+            dump->registerHistogram("", "probe_phase_duration_us", {100, 500, 1000, 5000, 10000, 50000, 100000, 500000, 1000000, 5000000},
+                "Duration of a read session phase, in microseconds", &phase.duration, "phase", phaseNames[i]);
+            phase.syscallsMetric = dump->registerGlobalMetric("probe_phase_syscalls", "phase", phaseNames[i], COUNTER,
+                "Syscalls issued by the thread running a read session phase during it");
+        }
+        _fdsMetric = dump->registerGlobalMetric("probe_open_fds", GAUGE, "File descriptors opened by the probe");
+    }
+
+    int PhaseProfiler::openSyscalls() {
+        if(_syscallConfig < 0)
+            return -1;
+        struct perf_event_attr pe;
+        memset(&pe, 0, sizeof(pe));
+        pe.type = PERF_TYPE_TRACEPOINT;
+        pe.size = sizeof(pe);
+        pe.config = _syscallConfig;
+        return syscall(__NR_perf_event_open, &pe, 0, -1, -1, PERF_FLAG_FD_CLOEXEC); // calling thread, any cpu
+    }
+
+    unsigned long long PhaseProfiler::readSyscalls() {
+        unsigned long long value = 0;
+        if(threadSyscalls.fd >= 0 && read(threadSyscalls.fd, &value, sizeof(value)) != sizeof(value))
+            value = 0;
+        return value;
+    }
+
+    void PhaseProfiler::phaseBegin(ProbePhase id) {
+        PhaseStats& phase = _phases[id];
+        if(threadSyscalls.fd == -2) // first phase run by this thread
+            threadSyscalls.fd = openSyscalls();
+        clock_gettime(CLOCK_MONOTONIC, &phase.begin);
+        phase.syscallsBegin = readSyscalls();
+    }
+
+    void PhaseProfiler::phaseEnd(ProbePhase id) {
+        PhaseStats& phase = _phases[id];
+        unsigned long long syscalls = readSyscalls();
+        timespec end;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        _mutex.lock();
+        if(syscalls > phase.syscallsBegin)
+            phase.syscalls += syscalls - phase.syscallsBegin - 1; // the read of the counter itself
+        phase.duration.observe((end.tv_sec - phase.begin.tv_sec) * 1000000.0 + (end.tv_nsec - phase.begin.tv_nsec) / 1000.0);
+        _mutex.unlock();
+    }
+
+    void PhaseProfiler::profilerRead(Dump* dump) {
+        _mutex.lock();
+        for(auto& phase : _phases){
+            if(phase.duration.count == 0)
+                continue;
+            dump->set(phase.duration);
+            dump->set(phase.syscallsMetric, phase.syscalls);
+        }
+        _mutex.unlock();
+        dump->set(_fdsMetric, utils::countOpenFds());
+    }
+
+    void PhaseProfiler::profilerClose() {
+        if(threadSyscalls.fd >= 0)
+            close(threadSyscalls.fd);
+        threadSyscalls.fd = -1;
+    }
+
+}
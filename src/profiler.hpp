@@ -0,0 +1,65 @@
+#pragma once
+#include <time.h>
+#include "dump.hpp"
+#include "utils/mutex.hpp"
+
+namespace server {
+
+	/**
+	 * Phases of a read session, in execution order
+	 */
+	enum ProbePhase { PHASE_PERF_REFRESH, PHASE_PERF_READ, PHASE_SCHEDSTAT, PHASE_PROCFS, PHASE_SAMPLER, PHASE_LIBVIRT_NODE, PHASE_LIBVIRT_DOMAINS,
+		PHASE_DUMP, PROBE_PHASES };
+
+	struct PhaseStats {
+		timespec begin;
+		unsigned long long syscallsBegin;
+		MetricHistogram duration;
+		unsigned long long syscalls = 0; // cumulative
+		MetricId syscallsMetric;
+	};
+
+	/**
+	 * Self instrumentation of the read session, phase by phase
+	 * Syscalls are counted with a raw_syscalls:sys_enter perf counter bound to each thread running phases,
+	 * open fds are counted from /proc/self/fd once per session (process wide, collectors may overlap)
+	 * Phases may run on collector threads, each phase is always run by the same thread
+	 */
+	class PhaseProfiler {
+
+		private:
+
+		int _syscallConfig; // -1 if the tracepoint is not available
+		utils::mutex _mutex; // protect results of _phases, read by profilerRead
+		PhaseStats _phases[PROBE_PHASES];
+		MetricId _fdsMetric;
+
+		int openSyscalls();
+
+		unsigned long long readSyscalls();
+
+		public:
+
+		PhaseProfiler();
+
+		/**
+		 * Register the series, syscall counters are opened on the first phase of each thread
+		 */
+		void profilerInit(Dump* dump);
+
+		void phaseBegin(ProbePhase phase);
+
+		void phaseEnd(ProbePhase phase);
+
+		/**
+		 * Export the phases completed so far and the open fds, the dump phase is exported by the next session
+		 */
+		void profilerRead(Dump* dump);
+
+		/**
+		 * Close the syscall counter of the calling thread, counters of other threads are closed when they exit
+		 */
+		void profilerClose();
+	};
+
+}
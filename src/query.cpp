@@ -0,0 +1,249 @@
+#include "query.hpp"
+#include <cmath>
+#include <limits>
+#include <string>
+#include <regex>
+#include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "history.hpp"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define QUERY_LANES 4
+
+namespace server {
+
+    static const char* const queryKinds[] = {"min", "max", "mean", "sum", "count", "last", "raw"};
+
+    QueryAggregate::QueryAggregate() : min(std::numeric_limits<double>::infinity()), max(-std::numeric_limits<double>::infinity()),
+        last(NAN) {}
+
+    double QueryAggregate::value(int kind) const {
+        switch(kind){
+            case QUERY_MIN: return min;
+            case QUERY_MAX: return max;
+            case QUERY_MEAN: return sum / count;
+            case QUERY_SUM: return sum;
+            case QUERY_COUNT: return count;
+            default: return last;
+        }
+    }
+
+    void queryAggregate(const double* values, size_t size, QueryAggregate* aggregate) {
+        size_t i = 0;
+#ifdef __SSE2__
+        // Two pairs of lanes per iteration. minpd/maxpd return their second operand when the first one is NaN,
+        // and cmpordpd is a quiet compare, so NaN cells are skipped without branches nor FP exceptions
+        const double inf = std::numeric_limits<double>::infinity();
+        __m128d min[2] = {_mm_set1_pd(inf), _mm_set1_pd(inf)}, max[2] = {_mm_set1_pd(-inf), _mm_set1_pd(-inf)};
+        __m128d sum[2] = {_mm_setzero_pd(), _mm_setzero_pd()}, count[2] = {_mm_setzero_pd(), _mm_setzero_pd()};
+        const __m128d one = _mm_set1_pd(1);
+        for(; i + QUERY_LANES <= size; i += QUERY_LANES)
+            for(int l = 0; l < 2; l++){
+                __m128d v = _mm_loadu_pd(values + i + 2 * l);
+                __m128d valid = _mm_cmpord_pd(v, v);
+                min[l] = _mm_min_pd(v, min[l]);
+                max[l] = _mm_max_pd(v, max[l]);
+                sum[l] = _mm_add_pd(sum[l], _mm_and_pd(v, valid));
+                count[l] = _mm_add_pd(count[l], _mm_and_pd(one, valid));
+            }
+        double lanes[4][QUERY_LANES];
+        for(int l = 0; l < 2; l++){
+            _mm_storeu_pd(lanes[0] + 2 * l, min[l]);
+            _mm_storeu_pd(lanes[1] + 2 * l, max[l]);
+            _mm_storeu_pd(lanes[2] + 2 * l, sum[l]);
+            _mm_storeu_pd(lanes[3] + 2 * l, count[l]);
+        }
+        for(int l = 0; l < QUERY_LANES; l++){
+            aggregate->min = std::min(aggregate->min, lanes[0][l]);
+            aggregate->max = std::max(aggregate->max, lanes[1][l]);
+            aggregate->sum += lanes[2][l];
+            aggregate->count += (uint64_t) lanes[3][l];
+        }
+#endif
+        for(; i < size; i++){
+            double v = values[i];
+            if(v != v)
+                continue;
+            aggregate->min = std::min(aggregate->min, v);
+            aggregate->max = std::max(aggregate->max, v);
+            aggregate->sum += v;
+            aggregate->count++;
+        }
+        for(size_t r = size; r > 0; r--)
+            if(values[r - 1] == values[r - 1]){
+                aggregate->last = values[r - 1];
+                break;
+            }
+    }
+
+    /**
+     * Duration such as 90s, 30m, 2h or 1d, in ms
+     */
+    static bool parseDuration(const std::string& text, int64_t* duration) {
+        char* end;
+        double value = strtod(text.c_str(), &end);
+        std::string unit(end);
+        int64_t scale = unit == "ms" ? 1 : unit == "s" || unit.empty() ? 1000 : unit == "m" ? 60000 : unit == "h" ? 3600000 : unit == "d" ? 86400000 : 0;
+        if(end == text.c_str() || scale == 0)
+            return false;
+        *duration = (int64_t) (value * scale);
+        return true;
+    }
+
+    /**
+     * now, a negative duration relative to now (-2h) or seconds since epoch, in ms since epoch
+     */
+    static bool parseTime(const std::string& text, int64_t now, int64_t* time) {
+        if(text == "now"){
+            *time = now;
+            return true;
+        }
+        int64_t value;
+        if(!parseDuration(text, &value))
+            return false;
+        *time = text[0] == '-' ? now + value : value;
+        return true;
+    }
+
+    static int usage() {
+        std::cerr << "usage: vmprobe query [--from -1h|epoch] [--to now|epoch] [--step duration] [--agg min|max|mean|sum|count|last|raw] historyfile [pattern]"
+            << std::endl;
+        return 1;
+    }
+
+    int queryMain(int argc, char** argv) {
+        int64_t now = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+        int64_t from = now - 3600000, to = now, step = 0;
+        int kind = QUERY_MEAN;
+        std::string path, pattern = ".*";
+        int positional = 0;
+        for(int i = 0; i < argc; i++){
+            std::string arg = argv[i];
+            bool hasValue = i + 1 < argc;
+            if(arg == "--from" && hasValue){
+                if(!parseTime(argv[++i], now, &from))
+                    return usage();
+            }
+            else if(arg == "--to" && hasValue){
+                if(!parseTime(argv[++i], now, &to))
+                    return usage();
+            }
+            else if(arg == "--step" && hasValue){
+                if(!parseDuration(argv[++i], &step) || step <= 0)
+                    return usage();
+            }
+            else if(arg == "--agg" && hasValue){
+                std::string name = argv[++i];
+                kind = std::find(queryKinds, queryKinds + QUERY_RAW + 1, name) - queryKinds;
+                if(kind > QUERY_RAW)
+                    return usage();
+            }
+            else if(arg.rfind("--", 0) == 0)
+                return usage();
+            else if(positional++ == 0)
+                path = arg;
+            else
+                pattern = arg;
+        }
+        if(path.empty())
+            return usage();
+        std::regex regex;
+        try {
+            regex = std::regex(pattern);
+        } catch(const std::regex_error& e) {
+            std::cerr << "invalid pattern " << pattern << ": " << e.what() << std::endl;
+            return 1;
+        }
+
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        if(fd < 0 || fstat(fd, &st) < 0){
+            std::cerr << "cannot open history " << path << ": " << strerror(errno) << std::endl;
+            if(fd >= 0)
+                close(fd);
+            return 1;
+        }
+        if((size_t) st.st_size < HISTORY_PAGE){
+            std::cerr << path << " is not a vmprobe history" << std::endl;
+            close(fd);
+            return 1;
+        }
+        const uint8_t* map = (const uint8_t*) mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if(map == MAP_FAILED){
+            std::cerr << "cannot map history " << path << ": " << strerror(errno) << std::endl;
+            return 1;
+        }
+        const HistoryHeader* header = (const HistoryHeader*) map;
+        uint64_t rows = header->rows, columns = header->columns;
+        if(header->magic != HISTORY_MAGIC || header->version != HISTORY_VERSION
+            || History::valuesOffset(rows, columns) + rows * columns * sizeof(double) != (size_t) st.st_size){
+            std::cerr << path << " is not a vmprobe history" << std::endl;
+            munmap((void*) map, st.st_size);
+            return 1;
+        }
+        const HistorySeries* series = (const HistorySeries*) (map + History::indexOffset());
+        const int64_t* timestamps = (const int64_t*) (map + History::timestampsOffset(columns));
+        const double* values = (const double*) (map + History::valuesOffset(rows, columns));
+        uint64_t head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+        uint64_t oldest = head > rows ? head - rows : 0;
+
+        // Rows are in time order, the requested range is found by binary search on row indexes
+        auto timestamp = [&](uint64_t row){ return timestamps[row % rows]; };
+        auto lowerBound = [&](uint64_t first, uint64_t last, int64_t time){
+            while(first < last){
+                uint64_t middle = first + (last - first) / 2;
+                if(timestamp(middle) < time)
+                    first = middle + 1;
+                else
+                    last = middle;
+            }
+            return first;
+        };
+        uint64_t begin = lowerBound(oldest, head, from);
+        std::cout.precision(15); // epochs in ms and counters are printed in full
+        uint64_t end = lowerBound(begin, head, to + 1);
+
+        for(uint64_t c = 0; c < columns; c++){
+            std::string name(series[c].name, strnlen(series[c].name, HISTORY_NAME_SIZE));
+            if(name.empty() || !std::regex_search(name, regex))
+                continue;
+            const double* column = values + c * rows;
+            uint64_t first = std::max(begin, series[c].since);
+            if(kind == QUERY_RAW){
+                for(uint64_t row = first; row < end; row++)
+                    if(column[row % rows] == column[row % rows])
+                        std::cout << name << " " << column[row % rows] << " " << timestamp(row) << "\n";
+                continue;
+            }
+            // One aggregate per step (or over the whole range), each one covers contiguous rows split at most once by the ring wrap
+            for(uint64_t row = first; row < end;){
+                int64_t bucket = step > 0 ? from + (timestamp(row) - from) / step * step : from;
+                uint64_t next = step > 0 ? lowerBound(row, end, bucket + step) : end;
+                QueryAggregate aggregate;
+                uint64_t position = row % rows;
+                uint64_t size = next - row;
+                uint64_t contiguous = std::min(size, rows - position);
+                queryAggregate(column + position, contiguous, &aggregate);
+                if(contiguous < size)
+                    queryAggregate(column, size - contiguous, &aggregate);
+                if(aggregate.count > 0)
+                    std::cout << name << " " << aggregate.value(kind) << " " << bucket << "\n";
+                row = next;
+            }
+        }
+        std::cout << std::flush;
+        munmap((void*) map, st.st_size);
+        return 0;
+    }
+
+}
@@ -0,0 +1,35 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+namespace server {
+
+	/**
+	 * Aggregate of a range of history cells, NaN cells (series not set during the session) are skipped
+	 */
+	struct QueryAggregate {
+		double min;
+		double max;
+		double sum = 0;
+		uint64_t count = 0;
+		double last;
+
+		QueryAggregate();
+
+		double value(int kind) const;
+	};
+
+	enum QueryKind { QUERY_MIN, QUERY_MAX, QUERY_MEAN, QUERY_SUM, QUERY_COUNT, QUERY_LAST, QUERY_RAW };
+
+	/**
+	 * Add a contiguous span of a column to the aggregate, several cells at a time
+	 */
+	void queryAggregate(const double* values, size_t size, QueryAggregate* aggregate);
+
+	/**
+	 * vmprobe query [--from t] [--to t] [--step d] [--agg kind] historyfile [pattern]
+	 * Print the series of historyfile whose name matches pattern (a regular expression) as "name value timestamp_ms" lines
+	 */
+	int queryMain(int argc, char** argv);
+
+}
@@ -0,0 +1,327 @@
+#include "sampler.hpp"
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/eventfd.h>
+#include <asm/unistd.h>
+#include "utils/log.hpp"
+#include "utils/config.hpp"
+#include "utils/procfs.hpp"
+
+// Relative to the sysfs root
+#define DEFAULT_TRACEFS_PATH "/kernel/tracing/events/"
+#define DEFAULT_DEBUGFS_TRACING_PATH "/kernel/debug/tracing/events/"
+
+namespace server {
+
+    // Layout of a sample with PERF_SAMPLE_IDENTIFIER | PERF_SAMPLE_TID | PERF_SAMPLE_RAW
+    #define SAMPLE_ID_OFFSET 8
+    #define SAMPLE_PID_OFFSET 16
+    #define SAMPLE_RAW_SIZE_OFFSET 24
+    #define SAMPLE_RAW_OFFSET 28
+    // Layout of PERF_RECORD_LOST
+    #define LOST_COUNT_OFFSET 16
+
+    PerfSampler::PerfSampler() : _cpus(utils::onlineCpus(utils::Config::Get().sysRoot)), _wakeFd(-1), _running(false), _lost(0), _cycle(0) {}
+
+    void PerfSampler::samplerInit() {
+        std::string field = utils::Config::Get().perfSamplingField;
+        _fieldKey = field;
+        _fieldKey.erase(remove(_fieldKey.begin(), _fieldKey.end(), '_'), _fieldKey.end());
+        for(const auto& name : utils::Config::Get().perfSampling){
+            SampledTracepoint tracepoint;
+            tracepoint.name = name;
+            if(!loadTracepoint(&tracepoint, field))
+                continue;
+            _tracepoints.push_back(tracepoint);
+        }
+        if(_tracepoints.empty())
+            return;
+        _buffers.resize(_cpus.size());
+        for(size_t i=0;i<_cpus.size();i++)
+            if(!openBuffer(&_buffers[i], _cpus[i], utils::Config::Get().perfSamplingPages))
+                utils::logging::error("PerfSampler::samplerInit no sampling on core", _cpus[i]);
+        for(auto& buffer : _buffers)
+            for(auto fd : buffer.fds)
+                ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        _wakeFd = eventfd(0, EFD_CLOEXEC);
+        _running = true;
+        _thread = std::thread(&PerfSampler::drain, this);
+        utils::logging::success("Perf sampling initialized on", _tracepoints.size(), "tracepoint(s)");
+    }
+
+    int PerfSampler::tracepointId(const std::string& name, std::string* path) {
+        size_t separator = name.find(':');
+        if(separator == std::string::npos){
+            utils::logging::error("PerfSampler::tracepointId expected category:name, got", name);
+            return -1;
+        }
+        std::string event = name.substr(0, separator) + "/" + name.substr(separator+1) + "/";
+        std::string directory = utils::Config::Get().sysRoot + DEFAULT_TRACEFS_PATH + event;
+        std::ifstream file(directory + "id");
+        if(!file.is_open()){
+            directory = utils::Config::Get().sysRoot + DEFAULT_DEBUGFS_TRACING_PATH + event;
+            file.open(directory + "id");
+        }
+        int id;
+        if(!(file >> id)){
+            utils::logging::error("PerfSampler::tracepointId cannot find tracepoint", name, "in tracefs");
+            return -1;
+        }
+        if(path != nullptr)
+            *path = directory;
+        return id;
+    }
+
+    // Resolve the tracepoint id and the offset of the histogram field from tracefs
+    bool PerfSampler::loadTracepoint(SampledTracepoint* tracepoint, std::string field) {
+        std::string path;
+        tracepoint->config = tracepointId(tracepoint->name, &path);
+        if(tracepoint->config < 0)
+            return false;
+        size_t separator = tracepoint->name.find(':');
+        std::string metric = tracepoint->name.substr(separator+1);
+        metric.erase(remove(metric.begin(), metric.end(), '_'), metric.end());
+        tracepoint->metric = "sample_" + metric;
+        // Lines are formatted as "field:unsigned int exit_reason;	offset:8;	size:4;	signed:0;"
+        std::ifstream format(path + "format");
+        std::string line;
+        while(!field.empty() && std::getline(format, line)){
+            size_t declaration = line.find("field:");
+            size_t end = line.find(';');
+            if(declaration == std::string::npos || end == std::string::npos)
+                continue;
+            std::string name = line.substr(declaration, end - declaration);
+            name = name.substr(name.find_last_of(" \t") + 1);
+            if(name != field)
+                continue;
+            sscanf(line.c_str() + line.find("offset:"), "offset:%d;", &tracepoint->fieldOffset);
+            sscanf(line.c_str() + line.find("size:"), "size:%d;", &tracepoint->fieldSize);
+            if(tracepoint->fieldSize > 8)
+                tracepoint->fieldOffset = -1; // arrays are not supported
+        }
+        return true;
+    }
+
+    bool PerfSampler::openBuffer(SampleBuffer* buffer, int cpu, int pages) {
+        long pageSize = sysconf(_SC_PAGESIZE);
+        buffer->size = pages * pageSize;
+        for(size_t t=0;t<_tracepoints.size();t++){
+            struct perf_event_attr pe;
+            memset(&pe, 0, sizeof(pe));
+            pe.type = PERF_TYPE_TRACEPOINT;
+            pe.size = sizeof(pe);
+            pe.config = _tracepoints[t].config;
+            pe.sample_period = 1;
+            pe.sample_type = PERF_SAMPLE_IDENTIFIER | PERF_SAMPLE_TID | PERF_SAMPLE_RAW;
+            pe.disabled = 1;
+            pe.watermark = 1;
+            pe.wakeup_watermark = buffer->size / 2;
+            int fd = syscall(__NR_perf_event_open, &pe, -1, cpu, -1, PERF_FLAG_FD_CLOEXEC);
+            if(fd == -1){
+                utils::logging::error("PerfSampler::openBuffer cannot open", _tracepoints[t].name, "on core", cpu, strerror(errno));
+                continue;
+            }
+            if(buffer->fds.empty()){
+                void* area = mmap(NULL, (pages + 1) * pageSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+                if(area == MAP_FAILED){
+                    utils::logging::error("PerfSampler::openBuffer mmap failed on core", cpu, strerror(errno));
+                    close(fd);
+                    return false;
+                }
+                buffer->meta = (perf_event_mmap_page*) area;
+                buffer->data = (char*) area + pageSize;
+            }
+            else if(ioctl(fd, PERF_EVENT_IOC_SET_OUTPUT, buffer->fds[0]) != 0){
+                utils::logging::error("PerfSampler::openBuffer cannot redirect", _tracepoints[t].name, "on core", cpu, strerror(errno));
+                close(fd);
+                continue;
+            }
+            unsigned long long id = 0;
+            ioctl(fd, PERF_EVENT_IOC_ID, &id);
+            _eventIds[id] = t;
+            buffer->fds.push_back(fd);
+        }
+        return !buffer->fds.empty();
+    }
+
+    void PerfSampler::drain() {
+        std::vector<struct pollfd> fds;
+        for(auto& buffer : _buffers)
+            if(!buffer.fds.empty())
+                fds.push_back({buffer.fds[0], POLLIN, 0});
+        fds.push_back({_wakeFd, POLLIN, 0});
+        while(_running){
+            if(poll(fds.data(), fds.size(), -1) < 0 && errno != EINTR)
+                break;
+            _mutex.lock();
+            for(auto& buffer : _buffers)
+                drainBuffer(&buffer);
+            _mutex.unlock();
+        }
+    }
+
+    /**
+     * Consume every record between data_tail and data_head
+     * Records are decoded in place, only the few fields we need are loaded from the mapping
+     */
+    void PerfSampler::drainBuffer(SampleBuffer* buffer) {
+        if(buffer->meta == nullptr)
+            return;
+        unsigned long long head = __atomic_load_n(&buffer->meta->data_head, __ATOMIC_ACQUIRE);
+        unsigned long long tail = buffer->meta->data_tail;
+        while(tail < head){
+            struct perf_event_header header;
+            ringCopy(buffer, tail, &header, sizeof(header));
+            if(header.size == 0)
+                break;
+            if(header.type == PERF_RECORD_SAMPLE){
+                unsigned long long id;
+                unsigned int pid, rawSize;
+                ringCopy(buffer, tail + SAMPLE_ID_OFFSET, &id, sizeof(id));
+                ringCopy(buffer, tail + SAMPLE_PID_OFFSET, &pid, sizeof(pid));
+                ringCopy(buffer, tail + SAMPLE_RAW_SIZE_OFFSET, &rawSize, sizeof(rawSize));
+                auto event = _eventIds.find(id);
+                if(event != _eventIds.end()){
+                    const SampledTracepoint& tracepoint = _tracepoints[event->second];
+                    SampleStats& stats = _pidStats[pid];
+                    if(stats.counts.empty())
+                        resetStats(&stats);
+                    stats.counts[event->second]++;
+                    if(tracepoint.fieldOffset >= 0 && (unsigned int) (tracepoint.fieldOffset + tracepoint.fieldSize) <= rawSize){
+                        unsigned long long value = 0; // little endian, smaller fields fill the low bytes
+                        ringCopy(buffer, tail + SAMPLE_RAW_OFFSET + tracepoint.fieldOffset, &value, tracepoint.fieldSize);
+                        stats.histograms[event->second][value]++;
+                    }
+                }
+            }
+            else if(header.type == PERF_RECORD_LOST){
+                unsigned long long lost;
+                ringCopy(buffer, tail + LOST_COUNT_OFFSET, &lost, sizeof(lost));
+                _lost += lost;
+            }
+            tail += header.size;
+        }
+        __atomic_store_n(&buffer->meta->data_tail, tail, __ATOMIC_RELEASE);
+    }
+
+    // Load a field from the ring, the only case where bytes are split is a field crossing the end of the buffer
+    inline void PerfSampler::ringCopy(SampleBuffer* buffer, unsigned long long offset, void* dest, size_t size) {
+        unsigned long long start = offset & (buffer->size - 1);
+        if(start + size <= buffer->size){
+            memcpy(dest, buffer->data + start, size);
+            return;
+        }
+        size_t first = buffer->size - start;
+        memcpy(dest, buffer->data + start, first);
+        memcpy((char*) dest + first, buffer->data, size - first);
+    }
+
+    void PerfSampler::resetStats(SampleStats* stats) {
+        stats->counts.assign(_tracepoints.size(), 0);
+        stats->histograms.resize(_tracepoints.size());
+        for(auto& histogram : stats->histograms)
+            for(auto& bucket : histogram)
+                bucket.second = 0;
+    }
+
+    void PerfSampler::samplerRead(Dump* dump, const std::unordered_map<int, std::string>& pids) {
+        if(_tracepoints.empty())
+            return;
+        SampleStats global;
+        resetStats(&global);
+        for(auto& x : _vmStats)
+            resetStats(&x.second);
+        _cycle++;
+        for(auto& pid : pids){ // VMs with at least one process are kept
+            SampleStats& stats = _vmStats[pid.second];
+            if(stats.counts.empty())
+                resetStats(&stats);
+            stats.cycle = _cycle;
+        }
+        _mutex.lock();
+        for(auto& buffer : _buffers)
+            drainBuffer(&buffer);
+        for(auto& x : _pidStats){
+            auto vm = pids.find(x.first);
+            SampleStats* stats = vm != pids.end() ? &_vmStats[vm->second] : nullptr;
+            for(size_t t=0;t<_tracepoints.size();t++){
+                global.counts[t] += x.second.counts[t];
+                if(stats == nullptr)
+                    continue;
+                stats->counts[t] += x.second.counts[t];
+                for(auto& bucket : x.second.histograms[t])
+                    stats->histograms[t][bucket.first] += bucket.second;
+            }
+        }
+        _pidStats.clear();
+        unsigned long long lost = _lost;
+        _lost = 0;
+        _mutex.unlock();
+
+        if(_globalMetrics.empty()){
+            _globalMetrics.push_back(dump->registerGlobalMetric("sample_lost", GAUGE, "Sampled records lost on ring buffer overflow over the last read session"));
+            for(auto& tracepoint : _tracepoints)
+                _globalMetrics.push_back(dump->registerGlobalMetric(tracepoint.metric, GAUGE, "Sampled " + tracepoint.name + " records over the last read session"));
+        }
+        dump->set(_globalMetrics[0], lost);
+        for(size_t t=0;t<_tracepoints.size();t++)
+            dump->set(_globalMetrics[t+1], global.counts[t]);
+        for(auto it = _vmStats.begin(); it != _vmStats.end();){
+            SampleStats& stats = it->second;
+            if(stats.cycle != _cycle){ // VM is gone
+                for(auto id : stats.metrics)
+                    dump->releaseMetric(id);
+                for(auto& histogram : stats.bucketMetrics)
+                    for(auto& bucket : histogram)
+                        dump->releaseMetric(bucket.second);
+                it = _vmStats.erase(it);
+                continue;
+            }
+            if(stats.metrics.empty()){
+                for(auto& tracepoint : _tracepoints)
+                    stats.metrics.push_back(dump->registerSpecificMetric(it->first, tracepoint.metric, GAUGE,
+                        "Sampled " + tracepoint.name + " records over the last read session"));
+                stats.bucketMetrics.resize(_tracepoints.size());
+            }
+            for(size_t t=0;t<_tracepoints.size();t++){
+                dump->set(stats.metrics[t], stats.counts[t]);
+                for(auto& bucket : stats.histograms[t]){
+                    auto id = stats.bucketMetrics[t].find(bucket.first);
+                    if(id == stats.bucketMetrics[t].end()) // first time this value is seen for the VM
+                        id = stats.bucketMetrics[t].insert({bucket.first, dump->registerSpecificMetric(it->first,
+                            _tracepoints[t].metric + "_" + _fieldKey, _fieldKey, std::to_string(bucket.first), GAUGE,
+                            "Sampled " + _tracepoints[t].name + " records over the last read session, by " + _fieldKey)}).first;
+                    dump->set(id->second, bucket.second);
+                }
+            }
+            ++it;
+        }
+    }
+
+    void PerfSampler::samplerClose() {
+        if(!_running)
+            return;
+        _running = false;
+        unsigned long long wake = 1;
+        write(_wakeFd, &wake, sizeof(wake));
+        _thread.join();
+        long pageSize = sysconf(_SC_PAGESIZE);
+        for(auto& buffer : _buffers){
+            for(auto fd : buffer.fds)
+                ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+            if(buffer.meta != nullptr)
+                munmap(buffer.meta, buffer.size + pageSize);
+            for(auto fd : buffer.fds)
+                close(fd);
+        }
+        close(_wakeFd);
+        utils::logging::info("Perf sampling closed");
+    }
+
+}
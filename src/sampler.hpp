@@ -0,0 +1,110 @@
+#pragma once
+#include <linux/perf_event.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <thread>
+#include <atomic>
+#include "dump.hpp"
+#include "utils/mutex.hpp"
+
+namespace server {
+
+	/**
+	 * A tracepoint sampled in the ring buffers (e.g. kvm:kvm_exit)
+	 * If its format contains the configured field, a histogram of its values is built
+	 */
+	struct SampledTracepoint {
+		std::string name; // as configured, category:name
+		std::string metric; // dump key, computed once
+		int config; // tracepoint id, from tracefs
+		int fieldOffset = -1; // offset of the histogram field in the raw record, -1 if absent
+		int fieldSize = 0;
+	};
+
+	/**
+	 * A mmap ring buffer, one per cpu, shared by all sampled tracepoints of this cpu
+	 */
+	struct SampleBuffer {
+		std::vector<int> fds; // fds[0] owns the mapping, others are redirected to it
+		perf_event_mmap_page* meta = nullptr;
+		char* data = nullptr;
+		unsigned long long size = 0; // data area size, a power of two
+	};
+
+	struct SampleStats {
+		std::vector<unsigned long long> counts; // per tracepoint
+		std::vector<std::map<unsigned long long, unsigned long long>> histograms; // per tracepoint, field value -> count
+		// Only used for VMs
+		std::vector<MetricId> metrics; // per tracepoint
+		std::vector<std::map<unsigned long long, MetricId>> bucketMetrics; // per tracepoint, field value -> series
+		unsigned long long cycle = 0; // last read session the VM was seen in
+	};
+
+	/**
+	 * The perf sampler records tracepoints with PERF_SAMPLE_RAW in per-cpu ring buffers
+	 * A background thread drains them in place and attributes each record to its process,
+	 * processes are then mapped to VMs at each read session
+	 */
+	class PerfSampler {
+
+		private:
+
+		std::vector<int> _cpus; // ids of the online cpus, one buffer each
+		int _wakeFd;
+		std::atomic<bool> _running;
+		std::thread _thread;
+
+		std::vector<SampledTracepoint> _tracepoints;
+		std::vector<SampleBuffer> _buffers;
+		std::unordered_map<unsigned long long, int> _eventIds; // kernel id -> index in _tracepoints
+
+		utils::mutex _mutex; // protect _pidStats and _lost between the drain thread and readers
+		std::unordered_map<int, SampleStats> _pidStats; // id = pid (tgid)
+		unsigned long long _lost;
+
+		std::unordered_map<std::string, SampleStats> _vmStats; // id = vmname, kept to report known buckets
+		std::vector<MetricId> _globalMetrics; // lost records, then one per tracepoint
+		std::string _fieldKey;
+		unsigned long long _cycle;
+
+		bool loadTracepoint(SampledTracepoint* tracepoint, std::string field);
+
+		bool openBuffer(SampleBuffer* buffer, int cpu, int pages);
+
+		void drain();
+
+		void drainBuffer(SampleBuffer* buffer);
+
+		void ringCopy(SampleBuffer* buffer, unsigned long long offset, void* dest, size_t size);
+
+		void resetStats(SampleStats* stats);
+
+		// Tests of the ring decoding (tests/test_sampler.cpp)
+		friend class SamplerTest;
+
+		public:
+
+		PerfSampler();
+
+		/**
+		 * Resolve the id of a category:name tracepoint from tracefs (or debugfs), -1 if not found
+		 * path is set to its tracefs directory
+		 */
+		static int tracepointId(const std::string& name, std::string* path = nullptr);
+
+		/**
+		 * Open the configured tracepoints on every cpu and start the drain thread
+		 */
+		void samplerInit();
+
+		/**
+		 * Export counts and histograms since the last call, pids map processes to VM names
+		 */
+		void samplerRead(Dump* dump, const std::unordered_map<int, std::string>& pids);
+
+		void samplerClose();
+	};
+
+}
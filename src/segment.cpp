@@ -0,0 +1,333 @@
+#include "segment.hpp"
+#include <algorithm>
+#include <string.h>
+
+#define SEGMENT_MAX_IDS (1 << 24) // bound on decoded ids, a corrupted block must not allocate the world
+
+namespace server {
+
+    static uint64_t zigzag(int64_t value) {
+        return ((uint64_t) value << 1) ^ (uint64_t) (value >> 63);
+    }
+
+    static int64_t unzigzag(uint64_t value) {
+        return (int64_t) (value >> 1) ^ -(int64_t) (value & 1);
+    }
+
+    static uint64_t valueBits(const MetricValue& v) {
+        uint64_t bits;
+        if(v.type == MetricValue::REAL)
+            memcpy(&bits, &v.d, sizeof(bits));
+        else
+            bits = v.type == MetricValue::SIGNED ? (uint64_t) v.i : v.u;
+        return bits;
+    }
+
+    static void resetSeries(SegmentSeries* series) {
+        series->type = -1;
+        series->bits = 0;
+        series->leading = -1;
+        series->trailing = 0;
+    }
+
+    BitWriter::BitWriter(std::vector<uint8_t>* out) : _out(out), _used(0) {}
+
+    void BitWriter::write(uint64_t value, int bits) {
+        while(bits > 0){
+            if(_used == 0)
+                _out->push_back(0);
+            int room = 8 - _used;
+            int take = std::min(room, bits);
+            uint8_t chunk = (value >> (bits - take)) & ((1u << take) - 1);
+            _out->back() |= chunk << (room - take);
+            _used = (_used + take) & 7;
+            bits -= take;
+        }
+    }
+
+    void BitWriter::writeVarint(uint64_t value) {
+        while(value >= 0x80){
+            write((value & 0x7f) | 0x80, 8);
+            value >>= 7;
+        }
+        write(value, 8);
+    }
+
+    BitReader::BitReader(const uint8_t* data, size_t size) : _data(data), _size(size), _position(0), _overflow(false) {}
+
+    uint64_t BitReader::read(int bits) {
+        uint64_t value = 0;
+        while(bits > 0){
+            if(_position >= _size * 8){
+                _overflow = true;
+                return value << bits;
+            }
+            int offset = _position & 7;
+            int room = 8 - offset;
+            int take = std::min(room, bits);
+            uint8_t byte = _data[_position >> 3];
+            value = (value << take) | ((byte >> (room - take)) & ((1u << take) - 1));
+            _position += take;
+            bits -= take;
+        }
+        return value;
+    }
+
+    uint64_t BitReader::readVarint() {
+        uint64_t value = 0;
+        for(int shift = 0; shift < 64; shift += 7){
+            uint64_t byte = read(8);
+            value |= (byte & 0x7f) << shift;
+            if(!(byte & 0x80))
+                return value;
+        }
+        _overflow = true;
+        return value;
+    }
+
+    bool BitReader::overflow() {
+        return _overflow;
+    }
+
+    SegmentEncoder::SegmentEncoder() : _first(true), _timestamp(0), _delta(0) {}
+
+    void SegmentEncoder::encoderDefine(int id, const std::string& name) {
+        if((size_t) id >= _series.size())
+            _series.resize(id + 1);
+        _series[id] = SegmentSeries();
+        _series[id].name = name;
+        // The previous block may contain the previous series of this id, the next one lists its ids again
+        _ids.clear();
+    }
+
+    void SegmentEncoder::encoderReset(std::vector<uint8_t>* out) {
+        for(auto& series : _series){
+            series.defined = false;
+            resetSeries(&series);
+        }
+        _ids.clear();
+        _first = true;
+        _timestamp = _delta = 0;
+        uint32_t header[2] = {SEGMENT_MAGIC, SEGMENT_VERSION};
+        out->insert(out->end(), (const uint8_t*) header, (const uint8_t*) header + SEGMENT_HEADER_SIZE);
+    }
+
+    void SegmentEncoder::encoderBlock(int64_t timestamp, const std::vector<std::pair<int, MetricValue>>& cells, std::vector<uint8_t>* out) {
+        _block.clear();
+        BitWriter writer(&_block);
+        if(_first)
+            writer.write(timestamp, 64);
+        else{
+            int64_t delta = timestamp - _timestamp;
+            writer.writeVarint(zigzag(delta - _delta));
+            _delta = delta;
+        }
+        _first = false;
+        _timestamp = timestamp;
+
+        // Dictionary entries of series not yet written in this segment
+        uint64_t definitions = 0;
+        for(const auto& cell : cells)
+            if(!_series[cell.first].defined)
+                definitions++;
+        writer.writeVarint(definitions);
+        for(const auto& cell : cells){
+            SegmentSeries& series = _series[cell.first];
+            if(series.defined)
+                continue;
+            writer.writeVarint(cell.first);
+            writer.writeVarint(series.name.size());
+            for(char c : series.name)
+                writer.write((uint8_t) c, 8);
+            series.defined = true;
+        }
+
+        // The set of series rarely changes between two sessions
+        bool same = cells.size() == _ids.size();
+        for(size_t i = 0; same && i < cells.size(); i++)
+            same = cells[i].first == _ids[i];
+        writer.write(same, 1);
+        if(!same){
+            writer.writeVarint(cells.size());
+            _ids.clear();
+            int previous = -1;
+            for(const auto& cell : cells){
+                writer.writeVarint(cell.first - previous - 1);
+                previous = cell.first;
+                _ids.push_back(cell.first);
+            }
+        }
+
+        for(const auto& cell : cells){
+            SegmentSeries& series = _series[cell.first];
+            const MetricValue& v = cell.second;
+            uint64_t bits = valueBits(v);
+            if(series.type != v.type){
+                writer.write(4 | v.type, 3);
+                resetSeries(&series);
+                series.type = v.type;
+            }
+            else
+                writer.write(0, 1);
+            if(v.type != MetricValue::REAL){
+                int64_t delta = bits - series.bits;
+                if(delta == 0)
+                    writer.write(0, 1);
+                else{
+                    writer.write(1, 1);
+                    writer.writeVarint(zigzag(delta));
+                }
+            }
+            else{
+                uint64_t xored = bits ^ series.bits;
+                if(xored == 0)
+                    writer.write(0, 1);
+                else{
+                    int leading = std::min(__builtin_clzll(xored), 31);
+                    int trailing = __builtin_ctzll(xored);
+                    if(series.leading >= 0 && leading >= series.leading && trailing >= series.trailing){
+                        writer.write(2, 2);
+                        writer.write(xored >> series.trailing, 64 - series.leading - series.trailing);
+                    }
+                    else{
+                        int size = 64 - leading - trailing;
+                        writer.write(3, 2);
+                        writer.write(leading, 5);
+                        writer.write(size - 1, 6);
+                        writer.write(xored >> trailing, size);
+                        series.leading = leading;
+                        series.trailing = trailing;
+                    }
+                }
+            }
+            series.bits = bits;
+        }
+
+        uint64_t size = _block.size();
+        while(size >= 0x80){
+            out->push_back((size & 0x7f) | 0x80);
+            size >>= 7;
+        }
+        out->push_back(size);
+        out->insert(out->end(), _block.begin(), _block.end());
+    }
+
+    SegmentDecoder::SegmentDecoder() : _first(true), _timestamp(0), _delta(0) {}
+
+    bool SegmentDecoder::decoderHeader(const uint8_t* data, size_t size, size_t* offset) {
+        uint32_t header[2];
+        if(size < SEGMENT_HEADER_SIZE)
+            return false;
+        memcpy(header, data, SEGMENT_HEADER_SIZE);
+        if(header[0] != SEGMENT_MAGIC || header[1] != SEGMENT_VERSION)
+            return false;
+        _series.clear();
+        _ids.clear();
+        _first = true;
+        _timestamp = _delta = 0;
+        *offset = SEGMENT_HEADER_SIZE;
+        return true;
+    }
+
+    bool SegmentDecoder::decoderBlock(const uint8_t* data, size_t size, size_t* offset, int64_t* timestamp, std::vector<std::pair<int, MetricValue>>* cells) {
+        BitReader prefix(data + *offset, size - *offset);
+        uint64_t length = prefix.readVarint();
+        if(prefix.overflow() || length == 0)
+            return false;
+        size_t begin = *offset;
+        while(data[begin++] & 0x80);
+        if(length > size - begin)
+            return false;
+        BitReader reader(data + begin, length);
+
+        if(_first)
+            _timestamp = reader.read(64);
+        else{
+            _delta += unzigzag(reader.readVarint());
+            _timestamp += _delta;
+        }
+        _first = false;
+
+        uint64_t definitions = reader.readVarint();
+        for(uint64_t d = 0; d < definitions && !reader.overflow(); d++){
+            uint64_t id = reader.readVarint();
+            uint64_t nameSize = reader.readVarint();
+            if(id >= SEGMENT_MAX_IDS || nameSize > length)
+                return false;
+            if(id >= _series.size())
+                _series.resize(id + 1);
+            _series[id] = SegmentSeries();
+            _series[id].name.resize(nameSize);
+            for(uint64_t c = 0; c < nameSize; c++)
+                _series[id].name[c] = reader.read(8);
+        }
+
+        if(reader.read(1) == 0){
+            uint64_t count = reader.readVarint();
+            if(count > length * 8)
+                return false;
+            _ids.clear();
+            uint64_t previous = -1;
+            for(uint64_t i = 0; i < count && !reader.overflow(); i++){
+                previous += reader.readVarint() + 1;
+                if(previous >= _series.size() || _series[previous].name.empty())
+                    return false;
+                _ids.push_back(previous);
+            }
+        }
+
+        cells->clear();
+        for(int id : _ids){
+            SegmentSeries& series = _series[id];
+            if(reader.read(1) == 1){
+                int type = reader.read(2);
+                if(type > MetricValue::REAL)
+                    return false;
+                resetSeries(&series);
+                series.type = type;
+            }
+            else if(series.type < 0)
+                return false;
+            if(series.type != MetricValue::REAL){
+                if(reader.read(1) == 1)
+                    series.bits += unzigzag(reader.readVarint());
+            }
+            else if(reader.read(1) == 1){
+                uint64_t xored;
+                if(reader.read(1) == 0){
+                    if(series.leading < 0)
+                        return false;
+                    xored = reader.read(64 - series.leading - series.trailing) << series.trailing;
+                }
+                else{
+                    int leading = reader.read(5);
+                    int bits = reader.read(6) + 1;
+                    int trailing = 64 - leading - bits;
+                    if(trailing < 0)
+                        return false;
+                    xored = reader.read(bits) << trailing;
+                    series.leading = leading;
+                    series.trailing = trailing;
+                }
+                series.bits ^= xored;
+            }
+            MetricValue v;
+            v.type = (decltype(v.type)) series.type;
+            if(series.type == MetricValue::REAL)
+                memcpy(&v.d, &series.bits, sizeof(v.d));
+            else
+                v.u = series.bits;
+            cells->push_back({id, v});
+        }
+        if(reader.overflow())
+            return false;
+        *timestamp = _timestamp;
+        *offset = begin + length;
+        return true;
+    }
+
+    const std::string& SegmentDecoder::decoderName(int id) {
+        return _series[id].name;
+    }
+
+}
@@ -0,0 +1,145 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+#include "dump.hpp"
+
+#define SEGMENT_MAGIC 0x53504d56 // VMPS
+#define SEGMENT_VERSION 1
+#define SEGMENT_HEADER_SIZE 8
+
+namespace server {
+
+	/**
+	 * Append bits, most significant first, to a byte vector
+	 */
+	class BitWriter {
+
+		private:
+
+		std::vector<uint8_t>* _out;
+		int _used; // bits used in the last byte, 0 if it is full
+
+		public:
+
+		BitWriter(std::vector<uint8_t>* out);
+
+		/**
+		 * The bits lowest bits of value, bits in [0, 64]
+		 */
+		void write(uint64_t value, int bits);
+
+		/**
+		 * LEB128, 7 bits per byte
+		 */
+		void writeVarint(uint64_t value);
+	};
+
+	class BitReader {
+
+		private:
+
+		const uint8_t* _data;
+		size_t _size; // in bytes
+		size_t _position; // in bits
+		bool _overflow;
+
+		public:
+
+		BitReader(const uint8_t* data, size_t size);
+
+		/**
+		 * Reading past the end returns zeros and sets overflow
+		 */
+		uint64_t read(int bits);
+
+		uint64_t readVarint();
+
+		bool overflow();
+	};
+
+	/**
+	 * Compression state of a series within a segment, identical on both sides
+	 */
+	struct SegmentSeries {
+		std::string name; // empty if the id is unused
+		bool defined = false; // name written in the current segment
+		int type = -1; // MetricValue type of the previous value
+		uint64_t bits = 0; // previous value
+		int leading = -1; // XOR window of the previous real value, -1 if none
+		int trailing = 0;
+	};
+
+	/**
+	 * Segment file : an 8 bytes header (magic, version) then one block per read session, prefixed with its size in bytes (varint)
+	 * A block is a bit stream :
+	 * - its timestamp in ms, 64 bits for the first block of the segment then the zigzag varint of its delta of delta
+	 * - the varint count of series defined in this block, each one as varint id, varint name size and name. A series is defined
+	 *   once per segment, before its first value, and again if its id is reused by another series
+	 * - 1 if the block has the ids of the previous one, 0 followed by the varint count of ids and the varint gap to each
+	 *   previous id, in increasing order
+	 * - one value per id : 0, or 1 and 2 bits when its type changed, then for integers 0 if unchanged or 1 and the zigzag varint
+	 *   of the delta, and for reals the XOR of the previous value (Gorilla) : 0 if equal, 10 and the meaningful bits if they fit
+	 *   the previous window, or 11, 5 bits of leading zeros, 6 bits of size - 1 and the meaningful bits
+	 * Decoding a segment only needs its own blocks, a block truncated by a crash ends it
+	 */
+	class SegmentEncoder {
+
+		private:
+
+		std::vector<SegmentSeries> _series; // by id
+		std::vector<int> _ids; // of the previous block
+		std::vector<uint8_t> _block;
+		bool _first;
+		int64_t _timestamp;
+		int64_t _delta;
+
+		public:
+
+		SegmentEncoder();
+
+		/**
+		 * Name of id from now on, it is written with its next value
+		 */
+		void encoderDefine(int id, const std::string& name);
+
+		/**
+		 * Start a new segment, series states are reset and their names written again
+		 */
+		void encoderReset(std::vector<uint8_t>* out);
+
+		/**
+		 * Append the block of a read session, cells sorted by increasing id
+		 */
+		void encoderBlock(int64_t timestamp, const std::vector<std::pair<int, MetricValue>>& cells, std::vector<uint8_t>* out);
+	};
+
+	class SegmentDecoder {
+
+		private:
+
+		std::vector<SegmentSeries> _series;
+		std::vector<int> _ids;
+		bool _first;
+		int64_t _timestamp;
+		int64_t _delta;
+
+		public:
+
+		SegmentDecoder();
+
+		/**
+		 * Check the header of a segment, *offset is moved past it
+		 */
+		bool decoderHeader(const uint8_t* data, size_t size, size_t* offset);
+
+		/**
+		 * Decode the block at *offset, false at the end of the segment or on a truncated or corrupted block
+		 */
+		bool decoderBlock(const uint8_t* data, size_t size, size_t* offset, int64_t* timestamp, std::vector<std::pair<int, MetricValue>>* cells);
+
+		const std::string& decoderName(int id);
+	};
+
+}
@@ -0,0 +1,40 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include "dump.hpp"
+
+namespace server {
+
+	/**
+	 * Destination of the series set during each cycle of the dumps, besides the text exposition (history, binary export)
+	 * A row is started at each read session, dumps then write their cells as they are rendered, possibly from several threads
+	 */
+	class SeriesSink {
+
+		public:
+
+		virtual ~SeriesSink() = default;
+
+		/**
+		 * Start the row of a new read session, timestamp in ms since epoch
+		 */
+		virtual void sinkBeginRow(int64_t timestamp) = 0;
+
+		/**
+		 * Column of a series, -1 if it is not recorded
+		 */
+		virtual int sinkColumn(const std::string& name) = 0;
+
+		/**
+		 * The series of the column is no longer registered
+		 */
+		virtual void sinkRelease(int column) = 0;
+
+		/**
+		 * Write (column, value) cells in the current row
+		 */
+		virtual void sinkWrite(const std::vector<std::pair<int, MetricValue>>& cells) = 0;
+	};
+
+}
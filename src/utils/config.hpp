@@ -19,10 +19,41 @@ namespace utils {
 		int delay;
 		std::string endpoint;
 		std::string url;
+		// Filesystem roots, relocatable to run against a generated host
+		std::string procRoot = "/proc";
+		std::string sysRoot = "/sys";
+		std::string cgroupRoot; // mount point of the cgroup hierarchy, detected from mountinfo if empty
+		bool dumpSync = false;
+		bool labels = false;
+		int httpPort = 0;
+		std::string httpAddress = "127.0.0.1";
+		bool httpGzip = true;
+		int httpTimeout = 30000;
+		int httpMaxConnections = 64;
+		bool collectorThreads = true;
 		std::list<std::string> perfEventHardware;
 		std::list<std::string> perfEventSoftware;
 		std::list<std::string> perfEventHardwareCache;
 		std::list<std::string> perfEventTracepoint;
+		bool libvirtEvents = true;
+		int perfRescan = 12;
+		bool perfGroup = false;
+		bool perfMonotonic = false;
+		std::string perfReaders = "none";
+		std::list<std::string> perfVcpu;
+		std::list<std::string> perfBreakdown;
+		std::list<std::string> perfSampling;
+		std::string perfSamplingField = "exit_reason";
+		int perfSamplingPages = 64;
+		std::vector<std::pair<std::string, std::string>> derived; // name, expression
+		std::string historyFile;
+		int historyHours = 4;
+		int historySeries = 2048;
+		std::string exportDir;
+		int exportSegmentMB = 64;
+		int samplingDelay = 0;
+		int samplingSeries = 4096;
+		std::list<std::string> samplingKeys;
 	};
 
 }
\ No newline at end of file
@@ -32,6 +32,22 @@ namespace utils {
 					utils::Config::Get().endpoint = value;
 				}else if(name == "url"){
 					utils::Config::Get().url = value;
+				}else if(name == "endpointsync"){
+					utils::Config::Get().dumpSync = (value == "true");
+				}else if(name == "labels"){
+					utils::Config::Get().labels = (value == "true");
+				}else if(name == "httpport"){
+					utils::Config::Get().httpPort = std::stoi(value);
+				}else if(name == "httpaddress"){
+					utils::Config::Get().httpAddress = value;
+				}else if(name == "httpgzip"){
+					utils::Config::Get().httpGzip = (value == "true");
+				}else if(name == "httptimeout"){
+					utils::Config::Get().httpTimeout = std::stoi(value);
+				}else if(name == "httpmaxconnections"){
+					utils::Config::Get().httpMaxConnections = std::stoi(value);
+				}else if(name == "collectorthreads"){
+					utils::Config::Get().collectorThreads = (value == "true");
 				}else if(name == "perfhardware"){
 					utils::Config::Get().perfEventHardware = convertToList(value);
 				}else if(name == "perfhardwarecache"){
@@ -40,6 +56,50 @@ namespace utils {
 					utils::Config::Get().perfEventSoftware = convertToList(value);
 				}else if(name == "perftracepoint"){
 					utils::Config::Get().perfEventTracepoint = convertToList(value);
+				}else if(name == "libvirtevents"){
+					utils::Config::Get().libvirtEvents = (value == "true");
+				}else if(name == "perfrescan"){
+					utils::Config::Get().perfRescan = std::stoi(value);
+				}else if(name == "perfgroup"){
+					utils::Config::Get().perfGroup = (value == "true");
+				}else if(name == "perfmonotonic"){
+					utils::Config::Get().perfMonotonic = (value == "true");
+				}else if(name == "perfreaders"){
+					utils::Config::Get().perfReaders = value;
+				}else if(name == "perfbreakdown"){
+					utils::Config::Get().perfBreakdown = convertToList(value);
+				}else if(name == "perfvcpu"){
+					utils::Config::Get().perfVcpu = convertToList(value);
+				}else if(name == "perfsampling"){
+					utils::Config::Get().perfSampling = convertToList(value);
+				}else if(name == "perfsamplingfield"){
+					utils::Config::Get().perfSamplingField = value;
+				}else if(name == "perfsamplingpages"){
+					utils::Config::Get().perfSamplingPages = std::stoi(value);
+				}else if(name == "procroot"){
+					utils::Config::Get().procRoot = value;
+				}else if(name == "sysroot"){
+					utils::Config::Get().sysRoot = value;
+				}else if(name == "cgrouproot"){
+					utils::Config::Get().cgroupRoot = value;
+				}else if(name == "historyfile"){
+					utils::Config::Get().historyFile = value;
+				}else if(name == "historyhours"){
+					utils::Config::Get().historyHours = std::stoi(value);
+				}else if(name == "historyseries"){
+					utils::Config::Get().historySeries = std::stoi(value);
+				}else if(name == "exportdir"){
+					utils::Config::Get().exportDir = value;
+				}else if(name == "exportsegmentmb"){
+					utils::Config::Get().exportSegmentMB = std::stoi(value);
+				}else if(name == "samplingdelay"){
+					utils::Config::Get().samplingDelay = std::stoi(value);
+				}else if(name == "samplingseries"){
+					utils::Config::Get().samplingSeries = std::stoi(value);
+				}else if(name == "samplingkeys"){
+					utils::Config::Get().samplingKeys = convertToList(value);
+				}else if(name.rfind("derived.", 0) == 0){
+					utils::Config::Get().derived.emplace_back(name.substr(8), value);
 				}else{
 					utils::logging::error ("Config parser, unknown option", name);
 				}
@@ -0,0 +1,114 @@
+#include "procfs.hpp"
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/syscall.h>
+#include <fstream>
+#include <sstream>
+
+namespace utils {
+
+	ProcFile::ProcFile () : _fd (-1)
+	{}
+
+	ProcFile::ProcFile (ProcFile && other) : _fd (other._fd) {
+		other._fd = -1;
+	}
+
+	ProcFile::~ProcFile () {
+		this-> close ();
+	}
+
+	bool ProcFile::open (const char * path) {
+		this-> close ();
+		this-> _fd = ::open (path, O_RDONLY | O_CLOEXEC);
+		return this-> _fd != -1;
+	}
+
+	bool ProcFile::isOpen () const {
+		return this-> _fd != -1;
+	}
+
+	ssize_t ProcFile::read (char * buffer, size_t size, off_t offset) {
+		if (this-> _fd == -1 || size == 0)
+			return -1;
+		ssize_t n = pread (this-> _fd, buffer, size - 1, offset);
+		buffer [n < 0 ? 0 : n] = '\0';
+		return n;
+	}
+
+	void ProcFile::close () {
+		if (this-> _fd != -1) {
+			::close (this-> _fd);
+			this-> _fd = -1;
+		}
+	}
+
+	const char * scanU64 (const char * p, const char * end, unsigned long long * value) {
+		while (p < end && (*p < '0' || *p > '9'))
+			p++;
+		unsigned long long v = 0;
+		while (p < end && *p >= '0' && *p <= '9') {
+			v = v * 10 + (*p - '0');
+			p++;
+		}
+		*value = v;
+		return p;
+	}
+
+	const char * skipFields (const char * p, const char * end, int n) {
+		for (int i = 0; i < n; i++) {
+			while (p < end && (*p == ' ' || *p == '\t' || *p == '\n'))
+				p++;
+			while (p < end && *p != ' ' && *p != '\t' && *p != '\n')
+				p++;
+		}
+		return p;
+	}
+
+	long countOpenFds () {
+		int fd = ::open ("/proc/self/fd", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (fd < 0)
+			return -1;
+		char buffer [32768];
+		long count = -3; // ., .. and the directory itself
+		while (true) {
+			long n = syscall (SYS_getdents64, fd, buffer, sizeof (buffer));
+			if (n <= 0) {
+				::close (fd);
+				return n < 0 ? -1 : count;
+			}
+			for (long offset = 0; offset < n; count++)
+				offset += ((struct dirent64 *) (buffer + offset))-> d_reclen;
+		}
+	}
+
+	std::vector<int> parseCPUList (const std::string & list) {
+		std::vector<int> cpus;
+		std::stringstream ss (list);
+		std::string range;
+		while (std::getline (ss, range, ',')) {
+			size_t dash = range.find ('-');
+			if (range.empty ())
+				continue;
+			int first = std::stoi (range.substr (0, dash));
+			int last = dash == std::string::npos ? first : std::stoi (range.substr (dash + 1));
+			for (int cpu = first; cpu <= last; cpu++)
+				cpus.push_back (cpu);
+		}
+		return cpus;
+	}
+
+	std::vector<int> onlineCpus (const std::string & sysRoot) {
+		std::ifstream online (sysRoot + "/devices/system/cpu/online");
+		std::string list;
+		std::vector<int> cpus;
+		if (std::getline (online, list))
+			cpus = parseCPUList (list);
+		if (cpus.empty ())
+			for (long cpu = 0; cpu < sysconf (_SC_NPROCESSORS_ONLN); cpu++)
+				cpus.push_back (cpu);
+		return cpus;
+	}
+
+}
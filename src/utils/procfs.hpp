@@ -0,0 +1,102 @@
+#pragma once
+
+#include <sys/types.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+namespace utils {
+
+	/**
+	 * A procfs/sysfs file kept open and re-read from offset 0 at each read session
+	 * Reading never allocates, content goes to a caller buffer (usually on the stack)
+	 */
+	class ProcFile {
+
+		int _fd;
+
+		public:
+
+		ProcFile ();
+
+		ProcFile (const ProcFile &) = delete;
+		void operator= (const ProcFile &) = delete;
+
+		ProcFile (ProcFile && other);
+
+		~ProcFile ();
+
+		bool open (const char * path);
+
+		bool isOpen () const;
+
+		/**
+		 * Read up to size-1 bytes from the given offset, the buffer is NUL terminated
+		 * Return the number of bytes read, -1 on error (e.g. the process exited)
+		 */
+		ssize_t read (char * buffer, size_t size, off_t offset = 0);
+
+		/**
+		 * Call f(begin, end) on each line of the file, the newline is excluded
+		 * The file is read by chunks of the given buffer, lines larger than the buffer are truncated
+		 */
+		template <typename F>
+		bool forEachLine (char * buffer, size_t size, F f) {
+			off_t offset = 0;
+			size_t carry = 0;
+			while (true) {
+				ssize_t n = this-> read (buffer + carry, size - carry, offset);
+				if (n < 0)
+					return false;
+				offset += n;
+				const char * end = buffer + carry + n;
+				const char * line = buffer;
+				for (const char * c = line; c < end; c++)
+					if (*c == '\n') {
+						f (line, c);
+						line = c + 1;
+					}
+				if (n == 0) {
+					if (line < end)
+						f (line, end);
+					return true;
+				}
+				carry = end - line;
+				if (carry >= size - 1) { // line larger than the buffer
+					f (line, end);
+					carry = 0;
+				}
+				for (size_t i = 0; i < carry; i++)
+					buffer [i] = line [i];
+			}
+		}
+
+		void close ();
+	};
+
+	/**
+	 * Skip non-digit characters and parse the next unsigned integer
+	 * Return the position after the number, or end if none is found
+	 */
+	const char * scanU64 (const char * p, const char * end, unsigned long long * value);
+
+	/**
+	 * Number of file descriptors opened by the process, -1 on error
+	 */
+	long countOpenFds ();
+
+	// Skip the next n whitespace separated fields
+	const char * skipFields (const char * p, const char * end, int n);
+
+	/**
+	 * Parse a sysfs cpu list such as "0-3,8-11"
+	 */
+	std::vector<int> parseCPUList (const std::string & list);
+
+	/**
+	 * Ids of the online cpus as listed by sysRoot/devices/system/cpu/online, they may have gaps (offline cpus)
+	 * 0 to sysconf(_SC_NPROCESSORS_ONLN) - 1 if the list cannot be read
+	 */
+	std::vector<int> onlineCpus (const std::string & sysRoot);
+
+}
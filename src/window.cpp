@@ -0,0 +1,214 @@
+#include "window.hpp"
+#include <cmath>
+#include <string.h>
+#include <algorithm>
+#include "utils/config.hpp"
+#include "utils/log.hpp"
+
+// Bins grow by 4%, a bin estimate is within 2% of the values it counts, SKETCH_BINS bins cover a ratio of 5e8
+#define SKETCH_GAMMA 1.04
+
+namespace server {
+
+    static const double sketchLogGamma = std::log(SKETCH_GAMMA);
+    static const char* const windowSuffixes[] = {"_min", "_max", "_mean", "_p50", "_p99"};
+    static const char* const windowHelp[] = {"Minimum", "Maximum", "Mean", "Median", "99th percentile"};
+
+    void QuantileSketch::clear() {
+        offset = 0;
+        memset(bins, 0, sizeof(bins));
+        zeros = 0;
+        count = 0;
+    }
+
+    void QuantileSketch::add(double value) {
+        if(std::isnan(value))
+            return;
+        if(value <= 0){
+            zeros++;
+            count++;
+            return;
+        }
+        addIndex((int) std::ceil(std::log(value) / sketchLogGamma), 1);
+    }
+
+    void QuantileSketch::addIndex(int index, unsigned long long n) {
+        if(count == zeros) // first positive value, centered in the range
+            offset = index - SKETCH_BINS / 2;
+        count += n;
+        if(index >= offset + SKETCH_BINS){ // slide up, lowest bins are collapsed into the first one
+            int shift = index - (offset + SKETCH_BINS - 1);
+            unsigned int collapsed = 0;
+            for(int k = 0; k <= shift && k < SKETCH_BINS; k++)
+                collapsed += bins[k];
+            if(shift < SKETCH_BINS - 1){
+                memmove(bins + 1, bins + shift + 1, (SKETCH_BINS - shift - 1) * sizeof(bins[0]));
+                memset(bins + SKETCH_BINS - shift, 0, shift * sizeof(bins[0]));
+            }
+            else
+                memset(bins + 1, 0, (SKETCH_BINS - 1) * sizeof(bins[0]));
+            bins[0] = collapsed;
+            offset += shift;
+        }
+        else if(index < offset){ // slide down as long as no upper bin is lost, collapsed into the first one otherwise
+            int highest = SKETCH_BINS - 1;
+            while(highest > 0 && bins[highest] == 0)
+                highest--;
+            int shift = std::min(offset - index, SKETCH_BINS - 1 - highest);
+            if(shift > 0){
+                memmove(bins + shift, bins, (SKETCH_BINS - shift) * sizeof(bins[0]));
+                memset(bins, 0, shift * sizeof(bins[0]));
+                offset -= shift;
+            }
+            index = std::max(index, offset);
+        }
+        bins[index - offset] += n;
+    }
+
+    double QuantileSketch::quantile(double q) const {
+        if(count == 0)
+            return 0;
+        double rank = std::max(0.0, std::ceil(q * count) - 1); // nearest rank, 0-based
+        unsigned long long cumulative = zeros;
+        if(rank < cumulative)
+            return 0;
+        for(int k = 0; k < SKETCH_BINS; k++){
+            cumulative += bins[k];
+            if(rank < cumulative) // middle of the bin, (gamma^(i-1), gamma^i]
+                return 2 * std::pow(SKETCH_GAMMA, offset + k) / (SKETCH_GAMMA + 1);
+        }
+        return 2 * std::pow(SKETCH_GAMMA, offset + SKETCH_BINS - 1) / (SKETCH_GAMMA + 1);
+    }
+
+    WindowAggregates::WindowAggregates(size_t samples) : _full(false) {
+        size_t capacity = std::max(1, utils::Config::Get().samplingSeries);
+        _ringSize = std::max((size_t) 1, samples);
+        _series.resize(capacity);
+        _rings.resize(capacity * _ringSize);
+        for(size_t i = capacity; i > 0; i--)
+            _free.push_back(i - 1);
+        _keys.assign(utils::Config::Get().samplingKeys.begin(), utils::Config::Get().samplingKeys.end());
+    }
+
+    int WindowAggregates::slot(const std::string& identifier, const std::string& key) {
+        auto& slots = _slots[identifier];
+        auto it = slots.find(key);
+        if(it != slots.end())
+            return it->second;
+        int slot = -1; // not aggregated, remembered until the end of the window
+        bool selected = _keys.empty() || std::find(_keys.begin(), _keys.end(), key) != _keys.end();
+        if(selected && _free.empty()){
+            if(!_full)
+                utils::logging::warn("WindowAggregates", _series.size(), "series already aggregated, increase samplingseries to aggregate", identifier, key);
+            _full = true;
+        }
+        else if(selected){
+            slot = _free.back();
+            _free.pop_back();
+            WindowSeries& series = _series[slot];
+            series.used = true;
+            series.hasLast = false;
+            series.count = 0;
+            series.ring = 0;
+            series.sketch.clear();
+            series.identifier = identifier;
+            series.key = key;
+        }
+        slots[key] = slot;
+        return slot;
+    }
+
+    void WindowAggregates::fold(int slot) {
+        WindowSeries& series = _series[slot];
+        const double* ring = _rings.data() + slot * _ringSize;
+        for(size_t i = 0; i < series.ring; i++)
+            series.sketch.add(ring[i]);
+        series.ring = 0;
+    }
+
+    void WindowAggregates::observe(Dump* dump) {
+        double value;
+        for(const auto& identifier : dump->getKeys())
+            for(const auto& key : identifier.second){
+                if(!dump->get(key.second, &value))
+                    continue;
+                int slot = this-> slot(identifier.first, key.first);
+                if(slot < 0)
+                    continue;
+                WindowSeries& series = _series[slot];
+                series.seen = true;
+                series.counter = dump->getType(key.second) == COUNTER;
+                if(series.counter){
+                    double previous = series.last;
+                    bool hasPrevious = series.hasLast;
+                    series.last = value;
+                    series.hasLast = true;
+                    if(!hasPrevious || value < previous) // first sample or restart of its source
+                        continue;
+                    value -= previous;
+                }
+                if(series.count == 0){
+                    series.min = series.max = value;
+                    series.sum = 0;
+                }
+                series.min = std::min(series.min, value);
+                series.max = std::max(series.max, value);
+                series.sum += value;
+                series.count++;
+                if(series.ring == _ringSize)
+                    fold(slot);
+                _rings[slot * _ringSize + series.ring++] = value;
+            }
+    }
+
+    void WindowAggregates::flush(Dump* dump) {
+        for(size_t slot = 0; slot < _series.size(); slot++){
+            WindowSeries& series = _series[slot];
+            if(!series.used)
+                continue;
+            if(!series.seen){ // released by its source, e.g. a stopped VM
+                for(auto id : series.metrics)
+                    dump->releaseMetric(id);
+                series.metrics.clear();
+                series.used = false;
+                _slots[series.identifier].erase(series.key);
+                _free.push_back(slot);
+                continue;
+            }
+            series.seen = false;
+            if(series.count == 0)
+                continue;
+            fold(slot);
+            if(series.metrics.empty())
+                for(int i = 0; i < 5; i++){
+                    std::string key = series.key + windowSuffixes[i];
+                    std::string help = std::string(windowHelp[i]) + " of " + series.key + " over the samples of the last read session"
+                        + (series.counter ? " (increase between two samples)" : "");
+                    series.metrics.push_back(series.identifier.empty() ? dump->registerGlobalMetric(key, GAUGE, help)
+                        : dump->registerSpecificMetric(series.identifier, key, GAUGE, help));
+                }
+            // Sketch estimates are bounded by the exact extremes
+            dump->set(series.metrics[0], series.min);
+            dump->set(series.metrics[1], series.max);
+            dump->set(series.metrics[2], series.sum / series.count);
+            dump->set(series.metrics[3], std::min(series.max, std::max(series.min, series.sketch.quantile(0.5))));
+            dump->set(series.metrics[4], std::min(series.max, std::max(series.min, series.sketch.quantile(0.99))));
+            series.count = 0;
+            series.sketch.clear();
+        }
+        // Forget series which were not aggregated, they are looked up again at the next window
+        for(auto it = _slots.begin(); it != _slots.end();){
+            for(auto key = it->second.begin(); key != it->second.end();){
+                if(key->second < 0)
+                    key = it->second.erase(key);
+                else
+                    ++key;
+            }
+            if(it->second.empty())
+                it = _slots.erase(it);
+            else
+                ++it;
+        }
+    }
+
+}
@@ -0,0 +1,93 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include "dump.hpp"
+
+#define SKETCH_BINS 512
+
+namespace server {
+
+	/**
+	 * Fixed-size quantile sketch, values are counted in logarithmic bins (relative error of about 2%)
+	 * Bins cover a sliding range of SKETCH_BINS indexes, lowest bins are collapsed when values spread further so that high quantiles stay accurate
+	 * Two sketches can be merged by adding their bins, non-positive values are counted apart
+	 */
+	struct QuantileSketch {
+		int offset = 0; // index of bins[0], a value v goes to index ceil(log(v) / log(gamma))
+		unsigned int bins[SKETCH_BINS] = {};
+		unsigned long long zeros = 0;
+		unsigned long long count = 0;
+
+		void clear();
+
+		void add(double value);
+
+		void addIndex(int index, unsigned long long n);
+
+		/**
+		 * Estimate of the q-quantile, 0 if empty
+		 */
+		double quantile(double q) const;
+	};
+
+	/**
+	 * Aggregates of a series over the current window, samples are kept in a ring folded into the sketch once full
+	 */
+	struct WindowSeries {
+		bool used = false;
+		bool seen = false; // set during the current window
+		bool counter = false; // samples are the increase since the previous value
+		double last = 0;
+		bool hasLast = false;
+		double min, max, sum;
+		unsigned long long count = 0;
+		size_t ring = 0; // samples in the ring
+		QuantileSketch sketch;
+		std::string identifier; // "" for global series
+		std::string key;
+		std::vector<MetricId> metrics; // min, max, mean, p50, p99, registered at the first window
+	};
+
+	/**
+	 * Windowed aggregates of the series of a collector sampled several times per read session
+	 * At each sample the value of every series (its increase for counters) is recorded, at the end of the window
+	 * [key]_min, [key]_max, [key]_mean, [key]_p50 and [key]_p99 are set in the dump
+	 * Series and rings are preallocated, at most samplingseries series are aggregated whatever the number of VMs
+	 */
+	class WindowAggregates {
+
+		private:
+
+		std::vector<WindowSeries> _series;
+		std::vector<double> _rings; // [slot * _ringSize + sample]
+		size_t _ringSize;
+		std::vector<int> _free;
+		std::unordered_map<std::string, std::unordered_map<std::string, int>> _slots; // id : identifier, then key = slot in _series
+		std::vector<std::string> _keys; // keys to aggregate, all if empty
+		bool _full;
+
+		int slot(const std::string& identifier, const std::string& key);
+
+		void fold(int slot);
+
+		public:
+
+		/**
+		 * Sized for samples per window, more samples are folded into the sketches as the rings fill
+		 */
+		WindowAggregates(size_t samples);
+
+		/**
+		 * Record the series set during the current cycle of the dump, called once per sample
+		 */
+		void observe(Dump* dump);
+
+		/**
+		 * Set the aggregates of the window in the dump and start a new window
+		 * Series which were not sampled during the window are released
+		 */
+		void flush(Dump* dump);
+	};
+
+}
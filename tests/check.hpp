@@ -0,0 +1,33 @@
+#pragma once
+#include <string>
+#include <iostream>
+#include "tempdir.hpp"
+
+/**
+ * Minimal checks for the test executables, one per tests/test_*.cpp and registered with ctest
+ * A failed check is reported and the test goes on, its main returns the number of failures
+ */
+namespace test {
+
+	inline int& failures() {
+		static int count = 0;
+		return count;
+	}
+
+	inline void fail(const char* file, int line, const std::string& message) {
+		std::cerr << file << ":" << line << " check failed: " << message << std::endl;
+		failures()++;
+	}
+
+}
+
+#define CHECK(condition) do { if(!(condition)) test::fail(__FILE__, __LINE__, #condition); } while(0)
+
+#define CHECK_EQUAL(actual, expected) do { auto _a = (actual); auto _e = (expected); if(!(_a == _e)) \
+	test::fail(__FILE__, __LINE__, std::string(#actual " == " #expected ", got ") + std::to_string(_a) + " instead of " + std::to_string(_e)); } while(0)
+
+/**
+ * Rendered output contains line, as a whole
+ */
+#define CHECK_LINE(output, line) do { std::string _o = "\n" + (output); if(_o.find("\n" + std::string(line) + "\n") == std::string::npos) \
+	test::fail(__FILE__, __LINE__, std::string("missing line ") + (line)); } while(0)
@@ -0,0 +1,59 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <fstream>
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include "error.hpp"
+
+namespace test {
+
+	/**
+	 * Temporary directory removed with its content on destruction, shared by the tests and the benchmarks
+	 */
+	class TempDir {
+
+		private:
+
+		std::string _path;
+
+		public:
+
+		TempDir() {
+			const char* base = getenv("TMPDIR");
+			std::string pattern = std::string(base != nullptr ? base : "/tmp") + "/vmprobe.XXXXXX";
+			std::vector<char> path(pattern.begin(), pattern.end());
+			path.push_back('\0');
+			if(mkdtemp(path.data()) == nullptr)
+				throw server::ProbeError("TempDir cannot create " + pattern + ": " + strerror(errno) + "\n");
+			_path = path.data();
+		}
+
+		~TempDir() {
+			nftw(_path.c_str(), [](const char* path, const struct stat*, int, struct FTW*){ return remove(path); }, 64, FTW_DEPTH | FTW_PHYS);
+		}
+
+		const std::string& path() {
+			return _path;
+		}
+
+		/**
+		 * Parent directories of relative are created
+		 */
+		void writeFile(const std::string& relative, const std::string& content) {
+			for(size_t slash = relative.find('/'); slash != std::string::npos; slash = relative.find('/', slash + 1))
+				makeDir(relative.substr(0, slash));
+			std::ofstream file(_path + "/" + relative);
+			file << content;
+		}
+
+		void makeDir(const std::string& relative) {
+			mkdir((_path + "/" + relative).c_str(), 0755);
+		}
+	};
+
+}
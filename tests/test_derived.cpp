@@ -0,0 +1,49 @@
+#include "check.hpp"
+#include "derived.hpp"
+#include "utils/config.hpp"
+
+static std::string render(server::Dump* dump) {
+    dump->dump();
+    std::string output = dump->getBuffer();
+    dump->clear();
+    return output;
+}
+
+static void testSelection() {
+    server::DerivedMetrics perf({"perf_"});
+    server::DerivedMetrics procfs({"cpu_", "memory_", "stat_", "sched_", "sample_"});
+    CHECK(perf.derives("ipc"));
+    CHECK(perf.derives("cpi")); // reads the earlier ipc
+    CHECK(!perf.derives("wait_share"));
+    CHECK(procfs.derives("wait_share"));
+    CHECK(!perf.derives("mixed"));
+    CHECK(!procfs.derives("mixed"));
+}
+
+static void testEvaluate() {
+    server::DerivedMetrics perf({"perf_"});
+    server::Dump dump("test", "", false, true, false);
+    server::MetricId instructions = dump.registerSpecificMetric("vm", "perf_hwinstructions");
+    server::MetricId cycles = dump.registerSpecificMetric("vm", "perf_hwcpucycles");
+    dump.set(instructions, 300);
+    dump.set(cycles, 200);
+    perf.evaluate(&dump);
+    std::string output = render(&dump);
+    CHECK_LINE(output, "test_domain_ipc{domain=\"vm\"} 1.5");
+    CHECK(output.find("cpi") != std::string::npos);
+
+    // A division by zero is not exported
+    dump.set(instructions, 0);
+    dump.set(cycles, 0);
+    perf.evaluate(&dump);
+    output = render(&dump);
+    CHECK(output.find("ipc") == std::string::npos);
+}
+
+int main() {
+    utils::Config::Get().derived = {{"ipc", "perf_hwinstructions/perf_hwcpucycles"}, {"cpi", "1/ipc"},
+        {"wait_share", "sched_waittime/(sched_runtime+sched_waittime)"}, {"mixed", "perf_hwcpucycles/sched_runtime"}};
+    testSelection();
+    testEvaluate();
+    return test::failures();
+}
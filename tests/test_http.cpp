@@ -0,0 +1,242 @@
+#include "check.hpp"
+#include "httpserver.hpp"
+#include <map>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <zlib.h>
+
+struct Response {
+    int status = 0;
+    std::map<std::string, std::string> headers; // lower case names
+    std::string body;
+};
+
+/**
+ * Blocking client socket connected to the server, reads time out so that a missing response fails instead of hanging
+ */
+static int connectTo(const server::HttpServer& http) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    timeval timeout = {5, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    int size = 4096; // keep large responses in flight
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(http.getPort());
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+    if(connect(fd, (sockaddr*) &addr, sizeof(addr)) < 0){
+        perror("connect");
+        exit(1);
+    }
+    return fd;
+}
+
+static void sendAll(int fd, const std::string& data) {
+    for(size_t sent = 0; sent < data.size();){
+        ssize_t size = write(fd, data.data() + sent, data.size() - sent);
+        if(size <= 0)
+            return;
+        sent += size;
+    }
+}
+
+/**
+ * Read exactly size bytes, return false on end of stream or timeout
+ */
+static bool readExactly(int fd, std::string* buffer, size_t size) {
+    char chunk[4096];
+    while(buffer->size() < size){
+        ssize_t n = read(fd, chunk, std::min(sizeof(chunk), size - buffer->size()));
+        if(n <= 0)
+            return false;
+        buffer->append(chunk, n);
+    }
+    return true;
+}
+
+/**
+ * Read one response, without its body if head, partial reads stop after limit body bytes
+ */
+static bool readResponse(int fd, Response* response, bool head = false, size_t limit = std::string::npos) {
+    std::string header;
+    while(header.size() < 4 || header.compare(header.size() - 4, 4, "\r\n\r\n") != 0)
+        if(!readExactly(fd, &header, header.size() + 1))
+            return false;
+    *response = Response();
+    response->status = atoi(header.c_str() + header.find(' ') + 1);
+    for(size_t line = header.find("\r\n") + 2; line < header.size() - 2; line = header.find("\r\n", line) + 2){
+        std::string field = header.substr(line, header.find("\r\n", line) - line);
+        std::string name = field.substr(0, field.find(':'));
+        for(auto& c : name)
+            c = tolower(c);
+        response->headers[name] = field.substr(field.find(':') + 2);
+    }
+    size_t length = head ? 0 : std::stoul(response->headers["content-length"]);
+    return readExactly(fd, &response->body, std::min(length, limit));
+}
+
+/**
+ * The server closed the connection, read returns the end of stream
+ */
+static bool closed(int fd) {
+    char byte;
+    return read(fd, &byte, 1) == 0;
+}
+
+static std::string inflate(const std::string& input) {
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    inflateInit2(&stream, 15 + 16);
+    std::string output;
+    char buffer[4096];
+    stream.next_in = (Bytef*) input.data();
+    stream.avail_in = input.size();
+    int result = Z_OK;
+    while(result == Z_OK){
+        stream.next_out = (Bytef*) buffer;
+        stream.avail_out = sizeof(buffer);
+        result = ::inflate(&stream, Z_NO_FLUSH);
+        output.append(buffer, sizeof(buffer) - stream.avail_out);
+    }
+    inflateEnd(&stream);
+    return result == Z_STREAM_END ? output : "";
+}
+
+static void publish(server::HttpServer* http, std::string body) {
+    http->publish(&body);
+}
+
+static void testRequests(server::HttpServer* http) {
+    std::string body = "vmprobe_global_probe_delay 1000\nvmprobe_global_probe_epoch 1700000000000\n";
+    publish(http, body);
+    int fd = connectTo(*http);
+    Response response;
+
+    sendAll(fd, "GET /metrics HTTP/1.1\r\nHost: localhost\r\n\r\n");
+    CHECK(readResponse(fd, &response));
+    CHECK_EQUAL(response.status, 200);
+    CHECK(response.body == body);
+    CHECK(response.headers["content-type"].find("text/plain") == 0);
+    CHECK(response.headers.count("content-encoding") == 0);
+
+    // No body, the next response follows right after the header on the same connection
+    sendAll(fd, "HEAD /metrics HTTP/1.1\r\n\r\n");
+    CHECK(readResponse(fd, &response, true));
+    CHECK_EQUAL(response.status, 200);
+    CHECK(response.headers["content-length"] == std::to_string(body.size()));
+
+    sendAll(fd, "GET /metrics HTTP/1.1\r\nAccept-Encoding: deflate, gzip\r\n\r\n");
+    CHECK(readResponse(fd, &response));
+    CHECK_EQUAL(response.status, 200);
+    CHECK(response.headers["content-encoding"] == "gzip");
+    CHECK(inflate(response.body) == body);
+
+    sendAll(fd, "GET /other HTTP/1.1\r\n\r\n");
+    CHECK(readResponse(fd, &response));
+    CHECK_EQUAL(response.status, 404);
+
+    sendAll(fd, "POST /metrics HTTP/1.1\r\nContent-Length: 0\r\n\r\n");
+    CHECK(readResponse(fd, &response));
+    CHECK_EQUAL(response.status, 405);
+    CHECK(response.headers["allow"] == "GET, HEAD");
+
+    // Pipelined requests are answered in order
+    sendAll(fd, "GET /metrics HTTP/1.1\r\n\r\nGET /nothing HTTP/1.1\r\n\r\nGET /metrics?name=x HTTP/1.1\r\nConnection: close\r\n\r\n");
+    CHECK(readResponse(fd, &response));
+    CHECK_EQUAL(response.status, 200);
+    CHECK(response.body == body);
+    CHECK(readResponse(fd, &response));
+    CHECK_EQUAL(response.status, 404);
+    CHECK(readResponse(fd, &response));
+    CHECK_EQUAL(response.status, 200);
+    CHECK(response.headers["connection"] == "close");
+    CHECK(closed(fd));
+    close(fd);
+
+    // Headers never terminated
+    fd = connectTo(*http);
+    sendAll(fd, "GET /metrics HTTP/1.1\r\nX-Padding: " + std::string(9000, 'x'));
+    CHECK(readResponse(fd, &response));
+    CHECK_EQUAL(response.status, 431);
+    CHECK(closed(fd));
+    close(fd);
+}
+
+/**
+ * A scrape in flight keeps sending the snapshot it started with, the next one gets the new snapshot
+ */
+static void testPublishDuringScrape(server::HttpServer* http) {
+    std::string first(16 << 20, 'a');
+    std::string second = "second\n";
+    std::string buffer = first;
+    http->publish(&buffer);
+    int fd = connectTo(*http);
+    Response response;
+    sendAll(fd, "GET /metrics HTTP/1.1\r\n\r\n");
+    CHECK(readResponse(fd, &response, false, 4096)); // the rest is still in flight
+    CHECK(response.headers["content-length"] == std::to_string(first.size()));
+
+    buffer = second;
+    http->publish(&buffer);
+    CHECK(buffer.empty()); // the first snapshot is still held by the connection
+    CHECK(readExactly(fd, &response.body, first.size()));
+    CHECK(response.body == first);
+
+    sendAll(fd, "GET /metrics HTTP/1.1\r\n\r\n");
+    CHECK(readResponse(fd, &response));
+    CHECK(response.body == second);
+    close(fd);
+
+    // Nobody holds the second snapshot anymore, its body is handed back
+    buffer = "third\n";
+    http->publish(&buffer);
+    CHECK(buffer == second);
+}
+
+static void testLimits() {
+    server::HttpServer http("127.0.0.1", 0, false, 200, 2);
+    CHECK(http.httpStart());
+    publish(&http, "a 1\n");
+    Response response;
+
+    // Once both are answered they are counted as open
+    int first = connectTo(http);
+    int second = connectTo(http);
+    for(int fd : {first, second}){
+        sendAll(fd, "GET /metrics HTTP/1.1\r\n\r\n");
+        CHECK(readResponse(fd, &response));
+        CHECK_EQUAL(response.status, 200);
+    }
+    int refused = connectTo(http);
+    CHECK(closed(refused));
+    close(refused);
+
+    // Idle for longer than the timeout
+    usleep(500000);
+    CHECK(closed(first));
+    CHECK(closed(second));
+    close(first);
+    close(second);
+
+    int fd = connectTo(http);
+    sendAll(fd, "GET /metrics HTTP/1.1\r\n\r\n");
+    CHECK(readResponse(fd, &response));
+    CHECK_EQUAL(response.status, 200);
+    close(fd);
+    http.httpStop();
+}
+
+int main() {
+    server::HttpServer http("127.0.0.1", 0, true, 5000, 16);
+    CHECK(http.httpStart());
+    CHECK(http.getPort() > 0);
+    testRequests(&http);
+    testPublishDuringScrape(&http);
+    http.httpStop();
+    testLimits();
+    return test::failures();
+}
@@ -0,0 +1,62 @@
+#include "check.hpp"
+#include "libvirtcli.hpp"
+#include "error.hpp"
+#include "utils/config.hpp"
+#include <unistd.h>
+
+// Reported to ctest as a skipped test
+#define TEST_SKIPPED 77
+
+/**
+ * The value of the series of the domain named test, empty if it is not in output, which starts with a new line
+ */
+static std::string domainValue(const std::string& output, const std::string& key) {
+    std::string prefix = "\ntest_domain_" + key + "{domain=\"test\"} ";
+    size_t begin = output.find(prefix);
+    if(begin == std::string::npos)
+        return "";
+    begin += prefix.size();
+    return output.substr(begin, output.find('\n', begin) - begin);
+}
+
+static bool hasSeries(const std::string& output, const std::string& prefix) {
+    return output.find("\ntest_domain_" + prefix) != std::string::npos;
+}
+
+/**
+ * The test driver holds a single running domain named test, with 2 vCPUs, whatever the host
+ */
+static void testDefaultDomain(server::LibvirtClient* client) {
+    server::Dump dump("test", "", false, true, false);
+    for(int session = 0; session < 2; session++){ // the second one reuses the registered series
+        client->addAllDomainsMetrics(&dump);
+        dump.dump();
+        std::string output = "\n" + dump.getBuffer();
+        dump.clear();
+        CHECK(domainValue(output, "state") == "1");
+        CHECK(domainValue(output, "cpu_current") == "2");
+        CHECK(hasSeries(output, "cpu_"));
+        CHECK(!domainValue(output, "memory_alloc").empty());
+        CHECK(!domainValue(output, "memory_max").empty());
+        CHECK(hasSeries(output, "vcpu_"));
+        CHECK(output.find("domain=\"test\"") != std::string::npos);
+    }
+}
+
+int main() {
+    if(getuid() != 0){ // required by LibvirtClient, although not by the test driver
+        std::cerr << "skipped, not root" << std::endl;
+        return TEST_SKIPPED;
+    }
+    utils::Config::Get().libvirtEvents = false;
+    server::LibvirtClient client("test:///default");
+    try {
+        client.connect();
+    } catch(const server::ProbeError&) {
+        std::cerr << "skipped, libvirt has no test driver" << std::endl;
+        return TEST_SKIPPED;
+    }
+    testDefaultDomain(&client);
+    client.disconnect();
+    return test::failures();
+}
@@ -0,0 +1,176 @@
+#include "check.hpp"
+#include <string.h>
+#include "sampler.hpp"
+#include "utils/config.hpp"
+
+#define RING_SIZE 256
+#define KVM_EXIT_ID 101
+#define KVM_ENTRY_ID 202
+
+namespace server {
+
+    /**
+     * Records are written in a ring held in memory, as the kernel would in the mapping of a perf event
+     */
+    class SamplerTest {
+
+        private:
+
+        PerfSampler _sampler;
+        perf_event_mmap_page _meta;
+        char _data[RING_SIZE];
+
+        void ringWrite(unsigned long long offset, const void* source, size_t size) {
+            for(size_t i = 0; i < size; i++)
+                _data[(offset + i) & (RING_SIZE - 1)] = ((const char*) source)[i];
+        }
+
+        public:
+
+        SamplerTest() {
+            memset(&_meta, 0, sizeof(_meta));
+            memset(_data, 0, sizeof(_data));
+            SampledTracepoint exit;
+            exit.name = "kvm:kvm_exit";
+            exit.metric = "sample_kvmexit";
+            exit.config = 1;
+            exit.fieldOffset = 8;
+            exit.fieldSize = 4;
+            SampledTracepoint entry;
+            entry.name = "kvm:kvm_entry";
+            entry.metric = "sample_kvmentry";
+            entry.config = 2;
+            _sampler._tracepoints = {exit, entry};
+            _sampler._eventIds = {{KVM_EXIT_ID, 0}, {KVM_ENTRY_ID, 1}};
+            _sampler._fieldKey = "exitreason";
+            _sampler._buffers.resize(1);
+            _sampler._buffers[0].meta = &_meta;
+            _sampler._buffers[0].data = _data;
+            _sampler._buffers[0].size = RING_SIZE;
+        }
+
+        ~SamplerTest() {
+            _sampler._buffers.clear();
+        }
+
+        PerfSampler* sampler() {
+            return &_sampler;
+        }
+
+        bool load(SampledTracepoint* tracepoint, const std::string& field) {
+            return _sampler.loadTracepoint(tracepoint, field);
+        }
+
+        unsigned long long tail() {
+            return _meta.data_tail;
+        }
+
+        /**
+         * PERF_SAMPLE_IDENTIFIER | PERF_SAMPLE_TID | PERF_SAMPLE_RAW, with a 12 bytes raw record holding the field at offset 8
+         */
+        void sample(unsigned long long id, unsigned int pid, unsigned int field) {
+            unsigned long long head = _meta.data_head;
+            perf_event_header header = {PERF_RECORD_SAMPLE, 0, 40};
+            unsigned int tid[2] = {pid, pid};
+            unsigned int rawSize = 12;
+            unsigned int raw[3] = {0, 0, field};
+            ringWrite(head, &header, sizeof(header));
+            ringWrite(head + 8, &id, sizeof(id));
+            ringWrite(head + 16, tid, sizeof(tid));
+            ringWrite(head + 24, &rawSize, sizeof(rawSize));
+            ringWrite(head + 28, raw, sizeof(raw));
+            _meta.data_head = head + header.size;
+        }
+
+        void lost(unsigned long long count) {
+            unsigned long long head = _meta.data_head;
+            perf_event_header header = {PERF_RECORD_LOST, 0, 24};
+            unsigned long long id = KVM_EXIT_ID;
+            ringWrite(head, &header, sizeof(header));
+            ringWrite(head + 8, &id, sizeof(id));
+            ringWrite(head + 16, &count, sizeof(count));
+            _meta.data_head = head + header.size;
+        }
+
+        /**
+         * The ring starts close to its end, so that records and their fields cross it
+         */
+        void start(unsigned long long offset) {
+            _meta.data_head = _meta.data_tail = offset;
+        }
+    };
+
+}
+
+static std::string render(server::Dump* dump) {
+    dump->dump();
+    std::string output = dump->getBuffer();
+    dump->clear();
+    return output;
+}
+
+static void testRing() {
+    server::SamplerTest test;
+    server::Dump dump("test", "", false, true, false);
+    test.start(200);
+    test.sample(KVM_EXIT_ID, 10, 30); // 200 to 240
+    test.sample(KVM_EXIT_ID, 10, 30); // 240 to 280, pid and field are past the end of the ring
+    test.sample(KVM_EXIT_ID, 11, 48);
+    test.sample(KVM_ENTRY_ID, 12, 0); // not a VM process
+    test.sample(999, 10, 30); // unknown event id, ignored
+    test.lost(5);
+    std::unordered_map<int, std::string> pids = {{10, "vm-a"}, {11, "vm-b"}};
+    test.sampler()->samplerRead(&dump, pids);
+    CHECK_EQUAL(test.tail(), 200ULL + 5 * 40 + 24);
+    std::string output = render(&dump);
+    CHECK_LINE(output, "test_global_sample_lost 5");
+    CHECK_LINE(output, "test_global_sample_kvmexit 3");
+    CHECK_LINE(output, "test_global_sample_kvmentry 1");
+    CHECK_LINE(output, "test_domain_sample_kvmexit{domain=\"vm-a\"} 2");
+    CHECK_LINE(output, "test_domain_sample_kvmexit{domain=\"vm-b\"} 1");
+    CHECK_LINE(output, "test_domain_sample_kvmentry{domain=\"vm-a\"} 0");
+    CHECK_LINE(output, "test_domain_sample_kvmexit_exitreason{domain=\"vm-a\",exitreason=\"30\"} 2");
+    CHECK_LINE(output, "test_domain_sample_kvmexit_exitreason{domain=\"vm-b\",exitreason=\"48\"} 1");
+
+    // Counts are per read session, a bucket already seen is exported as 0 and a VM without process is released
+    test.sample(KVM_EXIT_ID, 10, 48);
+    pids.erase(11);
+    test.sampler()->samplerRead(&dump, pids);
+    output = render(&dump);
+    CHECK_LINE(output, "test_global_sample_lost 0");
+    CHECK_LINE(output, "test_domain_sample_kvmexit{domain=\"vm-a\"} 1");
+    CHECK_LINE(output, "test_domain_sample_kvmexit_exitreason{domain=\"vm-a\",exitreason=\"30\"} 0");
+    CHECK_LINE(output, "test_domain_sample_kvmexit_exitreason{domain=\"vm-a\",exitreason=\"48\"} 1");
+    CHECK(output.find("vm-b") == std::string::npos);
+}
+
+static void testTracepointFormat() {
+    test::TempDir dir;
+    utils::Config::Get().sysRoot = dir.path();
+    dir.writeFile("kernel/tracing/events/kvm/kvm_exit/id", "1234\n");
+    dir.writeFile("kernel/tracing/events/kvm/kvm_exit/format", "name: kvm_exit\nID: 1234\nformat:\n"
+        "\tfield:unsigned short common_type;\toffset:0;\tsize:2;\tsigned:0;\n"
+        "\tfield:unsigned int exit_reason;\toffset:8;\tsize:4;\tsigned:0;\n"
+        "\tfield:unsigned long guest_rip;\toffset:16;\tsize:8;\tsigned:0;\n");
+    std::string path;
+    CHECK_EQUAL(server::PerfSampler::tracepointId("kvm:kvm_exit", &path), 1234);
+    CHECK(path == dir.path() + "/kernel/tracing/events/kvm/kvm_exit/");
+    server::SamplerTest test;
+    server::SampledTracepoint tracepoint;
+    tracepoint.name = "kvm:kvm_exit";
+    CHECK(test.load(&tracepoint, "exit_reason"));
+    CHECK(tracepoint.metric == "sample_kvmexit");
+    CHECK_EQUAL(tracepoint.fieldOffset, 8);
+    CHECK_EQUAL(tracepoint.fieldSize, 4);
+    tracepoint.fieldOffset = -1;
+    CHECK(test.load(&tracepoint, "reason")); // only whole field names match
+    CHECK_EQUAL(tracepoint.fieldOffset, -1);
+    CHECK_EQUAL(server::PerfSampler::tracepointId("kvm:kvm_missing"), -1);
+    CHECK_EQUAL(server::PerfSampler::tracepointId("kvm_exit"), -1);
+}
+
+int main() {
+    testRing();
+    testTracepointFormat();
+    return test::failures();
+}
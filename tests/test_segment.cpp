@@ -0,0 +1,125 @@
+#include "check.hpp"
+#include "segment.hpp"
+#include "export.hpp"
+
+typedef std::vector<std::pair<int, server::MetricValue>> Cells;
+
+static server::MetricValue integer(long long value) {
+    server::MetricValue v;
+    v.type = server::MetricValue::SIGNED;
+    v.i = value;
+    return v;
+}
+
+static server::MetricValue real(double value) {
+    server::MetricValue v;
+    v.type = server::MetricValue::REAL;
+    v.d = value;
+    return v;
+}
+
+/**
+ * Decode all blocks of segment and check them against the timestamps and cells encoded
+ */
+static void checkSegment(server::SegmentDecoder* decoder, const std::vector<uint8_t>& segment, const std::vector<int64_t>& timestamps,
+    const std::vector<Cells>& blocks, const std::vector<std::string>& names) {
+    size_t offset = 0;
+    CHECK(decoder->decoderHeader(segment.data(), segment.size(), &offset));
+    int64_t timestamp;
+    Cells cells;
+    size_t b = 0;
+    for(; offset < segment.size() && decoder->decoderBlock(segment.data(), segment.size(), &offset, &timestamp, &cells); b++){
+        if(b >= blocks.size())
+            break;
+        CHECK_EQUAL(timestamp, timestamps[b]);
+        CHECK_EQUAL(cells.size(), blocks[b].size());
+        for(size_t c = 0; c < cells.size() && c < blocks[b].size(); c++){
+            CHECK_EQUAL(cells[c].first, blocks[b][c].first);
+            CHECK(cells[c].second.type == blocks[b][c].second.type);
+            CHECK_EQUAL(cells[c].second.u, blocks[b][c].second.u); // bit exact, reals included
+            CHECK(decoder->decoderName(cells[c].first) == names[cells[c].first]);
+        }
+    }
+    CHECK_EQUAL(b, blocks.size());
+    CHECK_EQUAL(offset, segment.size());
+}
+
+/**
+ * Segments are encoded one after the other by the same encoder (rotation), and decoded by the same decoder
+ * The second one starts at another timestamp with another period, so that a delta left from the first one would show
+ */
+static void testRoundTrip() {
+    server::SegmentEncoder encoder;
+    server::SegmentDecoder decoder;
+    std::vector<std::string> names = {"test_global_cpu_freq", "test_domain_vm_perf_hwinstructions", "test_domain_vm_ipc"};
+    for(size_t id = 0; id < names.size(); id++)
+        encoder.encoderDefine(id, names[id]);
+
+    std::vector<int64_t> first = {1700000000000, 1700000001000, 1700000002000, 1700000003010};
+    std::vector<Cells> firstBlocks = {
+        {{0, integer(2400000)}, {1, integer(5000)}, {2, real(1.25)}},
+        {{0, integer(2400000)}, {1, integer(4800)}, {2, real(1.5)}},
+        {{0, integer(2300000)}, {2, real(0.1)}}, // other ids
+        {{0, real(2.5)}, {2, real(0.1)}}, // type change
+    };
+    std::vector<uint8_t> segment;
+    encoder.encoderReset(&segment);
+    for(size_t b = 0; b < first.size(); b++)
+        encoder.encoderBlock(first[b], firstBlocks[b], &segment);
+    checkSegment(&decoder, segment, first, firstBlocks, names);
+
+    std::vector<int64_t> second = {1700000100000, 1700000100500, 1700000101000};
+    std::vector<Cells> secondBlocks = {
+        {{0, integer(2400000)}, {1, integer(-3)}},
+        {{0, integer(2400000)}, {1, integer(-3)}},
+        {{1, integer(0)}, {2, real(-7.75)}},
+    };
+    segment.clear();
+    encoder.encoderReset(&segment);
+    for(size_t b = 0; b < second.size(); b++)
+        encoder.encoderBlock(second[b], secondBlocks[b], &segment);
+    checkSegment(&decoder, segment, second, secondBlocks, names);
+
+    // A block cut by a crash ends the segment, the previous ones are kept
+    size_t offset = 0;
+    int64_t timestamp;
+    Cells cells;
+    segment.pop_back();
+    CHECK(decoder.decoderHeader(segment.data(), segment.size(), &offset));
+    CHECK(decoder.decoderBlock(segment.data(), segment.size(), &offset, &timestamp, &cells));
+    CHECK(decoder.decoderBlock(segment.data(), segment.size(), &offset, &timestamp, &cells));
+    CHECK_EQUAL(timestamp, second[1]);
+    CHECK(!decoder.decoderBlock(segment.data(), segment.size(), &offset, &timestamp, &cells));
+}
+
+/**
+ * A series released during a row keeps its last cell, a series registered later in that row gets another id
+ */
+static void testExportRelease() {
+    test::TempDir dir;
+    server::SegmentExport exporter;
+    CHECK(exporter.exportOpen(dir.path(), 1 << 20));
+    exporter.sinkBeginRow(1700000000000);
+    int released = exporter.sinkColumn("released");
+    int kept = exporter.sinkColumn("kept");
+    exporter.sinkWrite({{released, integer(1)}, {kept, integer(2)}});
+    exporter.sinkRelease(released);
+    int added = exporter.sinkColumn("added");
+    CHECK(added != released);
+    exporter.sinkWrite({{added, integer(3)}});
+    exporter.sinkBeginRow(1700000001000);
+    CHECK_EQUAL(exporter.sinkColumn("reused"), released); // once the row was written
+    exporter.exportClose();
+
+    std::ifstream file(dir.path() + "/vmprobe-1700000000000.seg", std::ios::binary);
+    std::vector<uint8_t> segment((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    server::SegmentDecoder decoder;
+    std::vector<std::string> names = {"released", "kept", "added"};
+    checkSegment(&decoder, segment, {1700000000000}, {{{released, integer(1)}, {kept, integer(2)}, {added, integer(3)}}}, names);
+}
+
+int main() {
+    testRoundTrip();
+    testExportRelease();
+    return test::failures();
+}
@@ -0,0 +1,115 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <regex>
+#include <map>
+#include <chrono>
+#include <functional>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include "daemon.hpp"
+#include "utils/parser.hpp"
+#include "utils/config.hpp"
+
+/**
+ * Run full read sessions of the daemon against a host generated by vmprobe_scalegen and report, as one JSON object,
+ * the mean duration of each phase (from the probe_phase_duration_us histogram of the last exposition) and the memory of the probe
+ */
+
+static int usage() {
+    std::cerr << "usage: vmprobe_scale [--sessions 10] [--threads] root" << std::endl;
+    return 1;
+}
+
+static size_t countEntries(const std::string& directory, const std::function<bool(const std::string&)>& match) {
+    size_t count = 0;
+    DIR* dir = opendir(directory.c_str());
+    if(dir == nullptr)
+        return 0;
+    while(dirent* entry = readdir(dir))
+        if(match(entry->d_name))
+            count++;
+    closedir(dir);
+    return count;
+}
+
+int main(int argc, char** argv) {
+    unsigned long long sessions = 10;
+    bool threads = false;
+    std::string root;
+    for(int i = 1; i < argc; i++){
+        std::string arg = argv[i];
+        if(arg == "--sessions" && i + 1 < argc)
+            sessions = std::stoull(argv[++i]);
+        else if(arg == "--threads")
+            threads = true;
+        else if(arg.rfind("--", 0) == 0 || !root.empty())
+            return usage();
+        else
+            root = arg;
+    }
+    if(root.empty() || sessions == 0)
+        return usage();
+    std::streambuf* stdoutBuffer = std::cout.rdbuf(std::cerr.rdbuf()); // probe logs go to stderr
+
+    utils::Parser parser(root + "/config.yaml");
+    parser.parse();
+    utils::Config& config = utils::Config::Get();
+    config.collectorThreads = threads; // phases of a session then run one after the other and their durations add up
+    config.labels = true;
+    size_t vms = countEntries(config.cgroupRoot + "/machine.slice", [](const std::string& name){
+        return name.size() > 6 && name.compare(name.size() - 6, 6, ".scope") == 0;
+    });
+    size_t pids = countEntries(config.procRoot, [](const std::string& name){
+        return !name.empty() && name.find_first_not_of("0123456789") == std::string::npos;
+    });
+
+    server::Daemon* daemon = new server::Daemon();
+    auto begin = std::chrono::steady_clock::now();
+    daemon->start(sessions);
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+    // The real /proc of the harness, not the generated one
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    long rssPages = 0;
+    std::ifstream statm("/proc/self/statm");
+    statm >> rssPages >> rssPages;
+
+    std::ifstream exposition(config.endpoint);
+    std::regex phaseLine("probe_phase_duration_us_(sum|count)\\{phase=\"([a-z_]+)\"\\} ([0-9.e+]+)");
+    std::map<std::string, std::pair<double, double>> phases; // id : phase = sum, count
+    size_t series = 0, bytes = 0;
+    std::string line;
+    std::smatch match;
+    while(std::getline(exposition, line)){
+        bytes += line.size() + 1;
+        if(line.empty() || line[0] == '#')
+            continue;
+        series++;
+        if(std::regex_search(line, match, phaseLine)){
+            auto& phase = phases[match[2]];
+            (match[1] == "sum" ? phase.first : phase.second) = std::stod(match[3]);
+        }
+    }
+    daemon->kill();
+
+    std::cout.rdbuf(stdoutBuffer);
+    double session = 0;
+    std::cout << "{\"vms\": " << vms << ", \"pids\": " << pids << ", \"cpus\": " << countEntries(config.sysRoot + "/devices/system/cpu",
+        [](const std::string& name){ return name.size() > 3 && name.compare(0, 3, "cpu") == 0 && isdigit(name[3]); })
+        << ", \"sessions\": " << sessions << ", \"threads\": " << (threads ? "true" : "false") << ", \"phases_us\": {";
+    const char* separator = "";
+    for(const auto& phase : phases){
+        if(phase.second.second == 0)
+            continue;
+        double mean = phase.second.first / phase.second.second;
+        session += mean;
+        std::cout << separator << "\"" << phase.first << "\": " << mean;
+        separator = ", ";
+    }
+    std::cout << "}, \"session_us\": " << session << ", \"elapsed_s\": " << elapsed << ", \"series\": " << series << ", \"exposition_bytes\": " << bytes
+        << ", \"max_rss_kb\": " << usage.ru_maxrss << ", \"rss_kb\": " << rssPages * (sysconf(_SC_PAGESIZE) / 1024) << "}" << std::endl;
+    return 0;
+}
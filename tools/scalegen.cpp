@@ -0,0 +1,204 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+
+/**
+ * Build the procfs, sysfs and cgroup trees of a synthetic host, to be read by the probe through procroot, sysroot and cgrouproot
+ * Every VM is a libvirt scope of machine.slice whose processes (one emulator, the others vCPUs) have their stat and schedstat files
+ */
+
+struct HostShape {
+    int vms = 100;
+    int pids = 4; // per VM, the first one is the emulator
+    int cpus = 64;
+    int nodes = 2;
+    int version = 2;
+};
+
+static bool makeDirs(const std::string& path) {
+    for(size_t slash = path.find('/', 1); ; slash = path.find('/', slash + 1)){
+        std::string prefix = path.substr(0, slash);
+        if(mkdir(prefix.c_str(), 0755) < 0 && errno != EEXIST){
+            std::cerr << "cannot create " << prefix << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+        if(slash == std::string::npos)
+            return true;
+    }
+}
+
+static void writeFile(const std::string& path, const std::string& content) {
+    std::ofstream file(path);
+    file << content;
+}
+
+static std::string cpuRange(int first, int last) {
+    return first == last ? std::to_string(first) : std::to_string(first) + "-" + std::to_string(last);
+}
+
+static void generateSys(const std::string& root, const HostShape& shape) {
+    std::string cpu = root + "/sys/devices/system/cpu";
+    makeDirs(cpu);
+    writeFile(cpu + "/online", cpuRange(0, shape.cpus - 1) + "\n");
+    for(int c = 0; c < shape.cpus; c++){
+        std::string dir = cpu + "/cpu" + std::to_string(c);
+        makeDirs(dir + "/cpufreq");
+        makeDirs(dir + "/topology");
+        writeFile(dir + "/cpufreq/scaling_cur_freq", std::to_string(2000000 + (c % 8) * 100000) + "\n");
+        writeFile(dir + "/cpufreq/cpuinfo_max_freq", "3500000\n");
+        writeFile(dir + "/cpufreq/cpuinfo_min_freq", "1000000\n");
+    }
+    makeDirs(root + "/sys/devices/system/node");
+    writeFile(root + "/sys/devices/system/node/online", cpuRange(0, shape.nodes - 1) + "\n");
+    // Cpus are spread evenly over the nodes (at least one each, checked by main), one socket per node
+    for(int n = 0; n < shape.nodes; n++){
+        int first = (long long) n * shape.cpus / shape.nodes;
+        int last = (long long) (n + 1) * shape.cpus / shape.nodes - 1;
+        std::string dir = root + "/sys/devices/system/node/node" + std::to_string(n);
+        makeDirs(dir);
+        writeFile(dir + "/cpulist", cpuRange(first, last) + "\n");
+        for(int c = first; c <= last; c++)
+            writeFile(cpu + "/cpu" + std::to_string(c) + "/topology/physical_package_id", std::to_string(n) + "\n");
+    }
+}
+
+static void generateProcess(const std::string& root, int pid, const std::string& comm, int seed) {
+    std::string dir = root + "/proc/" + std::to_string(pid);
+    makeDirs(dir + "/task/" + std::to_string(pid));
+    writeFile(dir + "/task/" + std::to_string(pid) + "/comm", comm + "\n");
+    writeFile(dir + "/stat", std::to_string(pid) + " (" + comm + ") S 1 " + std::to_string(pid) + " " + std::to_string(pid)
+        + " 0 -1 138412096 " + std::to_string(5000 + seed) + " 0 3 0 " + std::to_string(1800000 + seed * 7) + " 411305 0 0 20 0 37 0 "
+        "391783925 9073324032 " + std::to_string(1000000 + seed) + " 18446744073709551615 94245474721792 94245481044213 140727300437376 0 0 0 "
+        "268444224 4096 25155 0 0 0 -1 12 0 0 0 0 0 94245483327280 94245493114856 94245515665408 140727300440641 140727300440766 "
+        "140727300440766 140727300444123 0\n");
+    writeFile(dir + "/schedstat", std::to_string(22484123459782ULL + seed * 1000003ULL) + " " + std::to_string(813712406512ULL + seed * 10007ULL)
+        + " " + std::to_string(96712331 + seed) + "\n");
+}
+
+static void generateProc(const std::string& root, const HostShape& shape) {
+    makeDirs(root + "/proc");
+    std::string schedstat = "version 15\ntimestamp 4365894286\n";
+    for(int c = 0; c < shape.cpus; c++)
+        schedstat += "cpu" + std::to_string(c) + " 0 0 0 0 0 0 " + std::to_string(1570393542887ULL + c * 1009ULL) + " "
+            + std::to_string(167404447290ULL + c * 101ULL) + " " + std::to_string(8123954 + c) + "\n"
+            "domain0 00000000,00000003 2191218 2180474 9412 10764536 1410 7 0 2180474 11287 11003 219 1236049 60 0 0 11003 "
+            "40427 36991 3263 2862106 275 2 0 36991 0 0 0 0 0 0 0 0 0 5139 126 0\n";
+    writeFile(root + "/proc/schedstat", schedstat);
+    writeFile(root + "/proc/meminfo", "MemTotal:       527895484 kB\nMemFree:        123914308 kB\nMemAvailable:   389912676 kB\n"
+        "Buffers:          1853824 kB\nCached:         254812508 kB\nSwapCached:            0 kB\n");
+}
+
+/**
+ * In v2 processes only live in the libvirt leaves (emulator, vcpuN), in v1 perf_event they are listed by the scope
+ */
+static void generateCgroups(const std::string& root, const HostShape& shape) {
+    std::string cgroup = root + "/cgroup";
+    makeDirs(cgroup + "/machine.slice");
+    if(shape.version == 2)
+        writeFile(cgroup + "/cgroup.controllers", "cpuset cpu io memory pids perf_event\n");
+    int pid = 10000;
+    for(int vm = 0; vm < shape.vms; vm++){
+        std::string name = "vm" + std::to_string(vm);
+        std::string scope = cgroup + "/machine.slice/machine-qemu\\x2d" + std::to_string(vm + 1) + "\\x2d" + name + ".scope";
+        int vcpus = std::max(1, shape.pids - 1);
+        std::string scopeProcs, emulatorProcs;
+        std::vector<std::string> vcpuProcs(vcpus);
+        for(int p = 0; p < shape.pids; p++, pid++){
+            std::string line = std::to_string(pid) + "\n";
+            scopeProcs += line;
+            if(p == 0){
+                emulatorProcs += line;
+                generateProcess(root, pid, "qemu-system-x86", pid);
+            }
+            else{
+                vcpuProcs[(p - 1) % vcpus] += line;
+                generateProcess(root, pid, "CPU " + std::to_string((p - 1) % vcpus) + "/KVM", pid);
+            }
+        }
+        if(shape.version == 1){
+            makeDirs(scope);
+            writeFile(scope + "/cgroup.procs", scopeProcs);
+            continue;
+        }
+        makeDirs(scope + "/libvirt/emulator");
+        writeFile(scope + "/cgroup.procs", "");
+        writeFile(scope + "/libvirt/cgroup.procs", "");
+        writeFile(scope + "/libvirt/emulator/cgroup.procs", emulatorProcs);
+        for(int v = 0; v < vcpus; v++){
+            std::string leaf = scope + "/libvirt/vcpu" + std::to_string(v);
+            makeDirs(leaf);
+            writeFile(leaf + "/cgroup.procs", vcpuProcs[v]);
+        }
+    }
+}
+
+/**
+ * Configuration reading the generated tree, libvirt is the test driver and no perf event is opened (the cgroups are not real ones)
+ */
+static void generateConfig(const std::string& root) {
+    writeFile(root + "/config.yaml", "# Synthetic host generated by vmprobe_scalegen\n"
+        "prefix=scale\n"
+        "delay=1000\n"
+        "endpoint=" + root + "/vms.prom\n"
+        "url=test:///default\n"
+        "labels=true\n"
+        "collectorthreads=false\n"
+        "libvirtevents=false\n"
+        "procroot=" + root + "/proc\n"
+        "sysroot=" + root + "/sys\n"
+        "cgrouproot=" + root + "/cgroup\n"
+        "perfhardware=\n"
+        "perfsoftware=\n"
+        "perfhardwarecache=\n"
+        "perftracepoint=\n");
+}
+
+static int usage() {
+    std::cerr << "usage: vmprobe_scalegen [--vms 100] [--pids 4] [--cpus 64] [--nodes 2] [--cgroup 2|1] root" << std::endl;
+    return 1;
+}
+
+int main(int argc, char** argv) {
+    HostShape shape;
+    std::string root;
+    for(int i = 1; i < argc; i++){
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if(arg == "--vms" && hasValue)
+            shape.vms = std::stoi(argv[++i]);
+        else if(arg == "--pids" && hasValue)
+            shape.pids = std::stoi(argv[++i]);
+        else if(arg == "--cpus" && hasValue)
+            shape.cpus = std::stoi(argv[++i]);
+        else if(arg == "--nodes" && hasValue)
+            shape.nodes = std::stoi(argv[++i]);
+        else if(arg == "--cgroup" && hasValue)
+            shape.version = std::stoi(argv[++i]);
+        else if(arg.rfind("--", 0) == 0 || !root.empty())
+            return usage();
+        else
+            root = arg;
+    }
+    if(root.empty() || root[0] != '/' || shape.vms < 0 || shape.pids < 1 || shape.cpus < 1 || shape.nodes < 1
+        || shape.nodes > shape.cpus || (shape.version != 1 && shape.version != 2))
+        return usage();
+    struct stat st;
+    if(stat((root + "/proc").c_str(), &st) == 0){
+        std::cerr << root << " already holds a generated host, remove it first" << std::endl;
+        return 1;
+    }
+    if(!makeDirs(root))
+        return 1;
+    generateSys(root, shape);
+    generateProc(root, shape);
+    generateCgroups(root, shape);
+    generateConfig(root);
+    std::cout << "Generated " << shape.vms << " VMs with " << shape.pids << " processes each on " << shape.cpus << " cpus in " << root
+        << ", run vmprobe_scale " << root << std::endl;
+    return 0;
+}